@@ -29,6 +29,7 @@ set brickaddr 0
 set guiserverport 0
 set irserverport  0
 set firmware ""
+set speed 1
 
 set libdir ""
 set libs ""
@@ -95,6 +96,11 @@ for { set i 0 } { $i < $argc } {incr i 1} {
             incr i 1
             set irserverport [lindex $argv $i]
         }
+        "-speed" {
+            incr i 1
+            set speed [lindex $argv $i]
+            puts "Requested Speed:     $speed"
+        }
         default {
             # Unrecognized command-line argument
         }
@@ -546,13 +552,25 @@ proc show_about_box { } {
     tk_messageBox -icon info -title "About BrickEMU" -message "BrickEmu (C) 2003-2004 Jochen Hoenicke\n\nThis program is free software; you can redistribute it and/or modify it under the terms of the GPL.\n\nYou can find the latest version at:\nhttps://jochen-hoenicke.de/rcx/"
 }
 
+proc create_speedmenu { } {
+    menu .speedmenu
+    foreach ratio { 1/4 1/2 1 2 4 } {
+        .speedmenu add radiobutton -label "$ratio x" -variable speed \
+            -value $ratio -command { send_cmd "PS$speed" }
+    }
+    .speedmenu add radiobutton -label "Unthrottled" -variable speed \
+        -value max -command { send_cmd "PS$speed" }
+}
+
 proc create_menu { } {
     create_bosmenus
+    create_speedmenu
     menu .filemenu
     .filemenu add command -label "Reset" -command { reset }
     .filemenu add command -label "Open..." -command {load_savefile}
     .filemenu add command -label "Save As..." -command {save_savefile}
     .filemenu add command -label "Firmware..." -command {load_firmware}
+    .filemenu add cascade -label "Speed" -menu .speedmenu
     .filemenu add separator
     .filemenu add command -label "Debug" -command { debug }
     .filemenu add separator
@@ -869,8 +887,8 @@ if { $guiserverport == 0 } {
     set fd [socket -server start_server 0 ]
     set guiserverport [lindex [fconfigure $fd -sockname] 2]
 
-    puts "Starting: $scriptdir/emu -rom \"$rom\" -guiserverport $guiserverport"
-    exec "$scriptdir/emu" -rom "$rom" -guiserverport $guiserverport &
+    puts "Starting: $scriptdir/emu -rom \"$rom\" -guiserverport $guiserverport -speed $speed"
+    exec "$scriptdir/emu" -rom "$rom" -guiserverport $guiserverport -speed $speed &
 } else {
     global emufd;
 
@@ -25,6 +25,8 @@
 #include "h8300.h"
 #include "memory.h"
 #include "peripherals.h"
+#include "replay.h"
+#include "observe.h"
 
 #define ADCSR_ADF  0x80
 #define ADCSR_ADIE 0x40
@@ -34,10 +36,14 @@
 #define ADCSR_CH   0x07
 
 
-static uint16 values[8], polled[4];
-static uint8 tmp;
-static uint8 adcsr, read_adcsr, adcr, adchannel;
-static cycle_count_t ad_start_cycle;
+static BRICK_LOCAL uint16 values[8], polled[4];
+static BRICK_LOCAL uint8 tmp;
+static BRICK_LOCAL uint8 adcsr, read_adcsr, adcr, adchannel;
+static BRICK_LOCAL cycle_count_t ad_start_cycle;
+
+static void ad_check_next_cycle(void);
+static void ad_update_time(void);
+static BRICK_LOCAL periph_event ad_event = { ad_update_time, 0, -1 };
 
 typedef struct {
     cycle_count_t ad_start_cycle;
@@ -56,7 +62,7 @@ static int ad_save(void *buffer, int maxlen) {
     data->read_adcsr = read_adcsr;
     data->adcr = adcr;
     data->adchannel = adchannel;
-    data->ad_start_cycle = htonl(ad_start_cycle);
+    data->ad_start_cycle = hton64(ad_start_cycle);
     return sizeof(ad_save_type);
 }
 
@@ -70,40 +76,43 @@ static void ad_load(void *buffer, int len) {
     read_adcsr = data->read_adcsr;
     adcr = data->adcr;
     adchannel = data->adchannel;
-    ad_start_cycle = ntohl(data->ad_start_cycle);
+    ad_start_cycle = ntoh64(data->ad_start_cycle);
+    ad_check_next_cycle();
 }
 
 static void ad_reset() {
     adcr = 0x7f;
     adcsr = 0;
     adchannel = 0;
+    ad_check_next_cycle();
 }
 
 static void ad_read_fd(int fd) {
     char buf[5];
-    int len = 0;
+    int len = 0, n;
 
     /* read in 5 bytes: sensorid 3xVal newline */
     do {
-        len += read(fd, buf + len, 5 - len);
+        if ((n = replay_read(fd, buf + len, 5 - len)) <= 0)
+            return;
+        len += n;
     } while (len < 5);
 
     values[buf[0]-'0'] =  
         ((buf[1] > '9' ? buf[1] - 'a' + 10 : buf[1]-'0') << 14)
         | ((buf[2] > '9' ? buf[2] - 'a' + 10 : buf[2]-'0') << 10)
         | ((buf[3] > '9' ? buf[3] - 'a' + 10 : buf[3]-'0') <<  6);
+    OBSERVE(sensors[buf[0]-'0'], values[buf[0]-'0']);
 }
 
 static void ad_check_next_cycle() {
-    if ((adcsr & 0xc0) == 0xc0) {
-        next_timer_cycle = cycles;
-    } else if ((adcsr & (ADCSR_ADIE|ADCSR_ADST)) == (ADCSR_ADIE|ADCSR_ADST)) {
+    irq_set(ADI_HANDLER, (adcsr & 0xc0) == 0xc0);
+    if ((adcsr & (ADCSR_ADIE|ADCSR_ADST)) == (ADCSR_ADIE|ADCSR_ADST)) {
 
         cycle_count_t next_conv_time = add_to_cycle('S', ad_start_cycle, (adcsr & ADCSR_CKS ? 134 : 266));
-        if (next_conv_time < next_timer_cycle) {
-            next_timer_cycle = next_conv_time;
-        }
-    }
+        periph_schedule(&ad_event, next_conv_time);
+    } else
+        periph_cancel(&ad_event);
 }
 
 static void ad_update_time() {
@@ -129,12 +138,6 @@ static void ad_update_time() {
     ad_check_next_cycle();
 }
 
-static int ad_check_irq() {
-    if ((adcsr & 0xc0) == 0xc0)
-        return 35;
-    return 255;
-}
-
 static void set_adcsr(uint8 value) {
     value &= 0x7f | read_adcsr; /* high bit can only be cleared */
 
@@ -151,6 +154,7 @@ static void set_adcsr(uint8 value) {
     ad_check_next_cycle();
 }
 static uint8 get_adcsr(void) {
+    ad_update_time();
     return read_adcsr = adcsr;
 }
 static void set_adcr(uint8 value) {
@@ -198,7 +202,6 @@ static peripheral_ops adsensor = {
     reset: ad_reset,
     update_time: ad_update_time,
     read_fd: ad_read_fd,
-    check_irq: ad_check_irq,
     load_data: ad_load,
     save_data: ad_save
 };
@@ -26,6 +26,7 @@
 #include "h8300.h"
 #include "memory.h"
 #include "peripherals.h"
+#include "replay.h"
 #include "lx.h"
 #include "symbols.h"
 #include "coff.h"
@@ -41,10 +42,12 @@
 #define TDATA_END      8
 
 #define READ_BYTE(offset) (memory[offset])
-#define WRITE_BYTE(offset, val) memory[offset] = (val)
+#define WRITE_BYTE(offset, val) do { memory[offset] = (val); \
+                                     mem_modified(offset, 1); } while(0)
 #define READ_WORD(offset) ((memory[offset] << 8) | memory[(offset) + 1])
 #define WRITE_WORD(offset, val) do { memory[offset] = (val) >> 8; \
-                             memory[(offset) + 1] = (val) & 0xff; } while(0)
+                             memory[(offset) + 1] = (val) & 0xff; \
+                             mem_modified(offset, 2); } while(0)
 #define DEBUG(...)
 
 static void bibo_free(uint16 mm_start, uint16 mm_first_free, uint16 addr) {
@@ -325,14 +328,16 @@ static void bibo_load_program(int fd) {
     uint16 mm_start = symbols_getaddr("_mm_start");
     uint16 mm_first_free = symbols_getaddr("_mm_first_free");
 
-    read(fd, buf, 1);
+    replay_read(fd, buf, 1);
     prog = programs + 22 * (buf[0] - '0');
 
     len = 0;
     do {
-        len += read(fd, filename + len, 1);
-    } while (filename[len-1] != '\n' && filename[len-1] != '\r');
-    filename[len-1] = 0;
+        if (replay_read(fd, filename + len, 1) <= 0)
+            break;
+    } while (filename[len] != '\n' && filename[len] != '\r'
+             && ++len < MAX_PATHNAME_LEN);
+    filename[len] = 0;
 
     if (mm_start == 0 || programs == 0) {
         fprintf(stderr, "BrickEmu: Program load error: Not enough symbolic information about firmware\n");
@@ -404,6 +409,8 @@ static void bibo_load_program(int fd) {
            header.text_size  + header.data_size + header.bss_size,
            memory + text + header.text_size, 
            header.data_size);
+    mem_modified(text + header.text_size + header.data_size,
+                 header.bss_size + header.data_size);
     WRITE_WORD(prog + 20, header.text_size + header.data_size);
 }
 
@@ -411,7 +418,7 @@ static void bibo_sethostaddr(int fd) {
     uint16 lnp_hostaddr;
     char buf[5];
     int addr;
-    read(fd, buf, 1);
+    replay_read(fd, buf, 1);
 
     lnp_hostaddr = symbols_getaddr("_lnp_hostaddr");
 
@@ -420,7 +427,7 @@ static void bibo_sethostaddr(int fd) {
             sprintf(buf, "ON%x\n", memory[lnp_hostaddr] >> 4);
         else
             strcpy(buf, "ON?\n");
-        write(fd, buf, strlen(buf));
+        periph_write(buf);
     } else if (!lnp_hostaddr) {
         fprintf(stderr, "Not enough symbolic information about firmware\n");
     } else {
@@ -428,6 +435,7 @@ static void bibo_sethostaddr(int fd) {
             buf[0] > 'A' ? (buf[0] - 'A' + 10) : (buf[0] - '0');
 
         memory[lnp_hostaddr] = addr << 4;
+        mem_modified(lnp_hostaddr, 1);
     }
 }
 
@@ -435,7 +443,7 @@ static void bibo_checkos(int fd) {
     char buf[5];
 
     sprintf(buf, "OO%d\n", symbols_getaddr("_mm_start") ? 1 : 0);
-    write(fd, buf, strlen(buf));
+    periph_write(buf);
 }
 
 static void bibo_newprogram_addr(int fd) {
@@ -449,9 +457,11 @@ static void bibo_newprogram_addr(int fd) {
 
     len = 0;
     do {
-        len += read(fd, buf + len, 1);
-    } while (len < sizeof(buf) && buf[len-1] != '\n' && buf[len-1] != '\r');
-    buf[len-1] = 0;
+        if (replay_read(fd, buf + len, 1) <= 0)
+            break;
+    } while (buf[len] != '\n' && buf[len] != '\r'
+             && ++len < (int) sizeof(buf) - 1);
+    buf[len] = 0;
     prog = programs + 22 * (buf[0] - '0');
     size = atoi(buf+1);
     if (programs && mm_start) {
@@ -468,7 +478,7 @@ static void bibo_newprogram_addr(int fd) {
             bibo_free(mm_start, mm_first_free, addr);
     }
     sprintf(buf, "OA%x\n", addr);
-    write(fd, buf, strlen(buf));
+    periph_write(buf);
 }
 
 extern void brickos_read_fd(int fd);
@@ -477,11 +487,13 @@ static void bibo_read_fd(int fd) {
     char buf[3];
 
     /* check if bibo is loaded, otherwise chain brickos */
-    if (symbols_getaddr("_td_idle") == 0)
+    if (symbols_getaddr("_td_idle") == 0) {
       brickos_read_fd(fd);
+      return;
+    }
 
     /* read in next byte: id */
-    read(fd, buf, 1);
+    replay_read(fd, buf, 1);
 
     switch (buf[0]) {
     case 'M':
@@ -527,15 +539,9 @@ static void bibo_read_fd(int fd) {
     }
 }
 
-static int bibo_check_irq() {
-    return 255;
-}
-
-
 static peripheral_ops bibo = {
     id: 'O',
-    read_fd: bibo_read_fd,
-    check_irq: bibo_check_irq
+    read_fd: bibo_read_fd
 };
 
 void bibo_init(void) {
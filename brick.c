@@ -0,0 +1,175 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+/** \file brick.c
+ * \brief setting up emulated bricks
+ *
+ * The state of a brick (cpu registers, memory, peripherals) is kept in
+ * global variables declared BRICK_LOCAL.  When compiled with
+ * MULTI_BRICK these are thread local, so every thread can run its own
+ * brick: brick_create starts a thread that initializes the peripherals
+ * and runs the cpu.  The bricks talk to each other over the IR server
+ * like separate emulator processes do.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef MULTI_BRICK
+#include <pthread.h>
+#endif
+#include "h8300.h"
+#include "peripherals.h"
+#include "brick.h"
+#include "replay.h"
+#include "observe.h"
+#include "scenario.h"
+
+#define TRAP_EXCEPTION 5
+
+extern void periph_init(int port);
+extern void mem_init(char *);
+extern void frame_init(void);
+extern void lcd_init(void);
+extern void t16_init(void);
+extern void t8_init(void);
+extern void sound_init(void);
+extern void btn_init(void);
+extern void ws_init(void);
+extern void ser_init(void);
+extern void db_init(void);
+extern void ad_init(void);
+extern void wdog_init(void);
+extern void firm_init(void);
+extern void motor_init(void);
+extern void bibo_init(void);
+
+/** \brief initialize the brick of the calling thread
+ *
+ * Connects to the GUI and initializes all peripherals.  Afterwards
+ * run_cpu starts the brick.
+ */
+void brick_init(const brick_config *config) {
+    if (config->speed && periph_set_speed(config->speed) < 0) {
+        fprintf(stderr, "Invalid speed: %s\n", config->speed);
+        exit(1);
+    }
+    periph_set_pacing(config->pace_quantum, config->max_lag);
+    if (config->output_rate)
+        periph_set_output_rate(config->output_rate);
+    if (config->record_file
+        && replay_open(config->record_file, REPLAY_RECORD) < 0)
+        exit(1);
+    if (config->replay_file
+        && replay_open(config->replay_file, REPLAY_PLAY) < 0)
+        exit(1);
+    if (config->observe_file && observe_init(config->observe_file) < 0)
+        exit(1);
+    if (config->scenario_file && scenario_open(config->scenario_file) < 0)
+        exit(SCENARIO_ERROR);
+    mem_init(config->rom_file);
+    frame_init();
+    ser_init();
+    db_init();
+    periph_init(config->guiserverport);
+    savefile_init(config->boot_cache);
+    t16_init();
+    t8_init();
+    printf("BrickEmu: Preparing to Initialize Sound\n");
+    sound_init();
+    printf("BrickEmu: Sound Initialized\n");
+    btn_init();
+    printf("BrickEmu: Buttons Initialized\n");
+    lcd_init();
+    printf("BrickEmu: LCD Initialized\n");
+    ws_init();
+    ad_init();
+    wdog_init();
+    firm_init();
+    motor_init();
+    bibo_init();
+    if (scenario_running)
+        scenario_start();
+
+    printf("BrickEmu: Initialization Complete\n");
+
+    if (config->debug)
+        db_trap = TRAP_EXCEPTION;
+}
+
+#ifdef MULTI_BRICK
+
+/** \brief a brick running in its own thread */
+struct brick {
+    pthread_t thread;
+    brick_config config;
+};
+
+/** \brief set in threads started by brick_create */
+static BRICK_LOCAL int brick_threaded;
+
+static void *brick_thread(void *arg) {
+    brick *b = arg;
+
+    brick_threaded = 1;
+    brick_init(&b->config);
+    run_cpu();
+    return NULL;
+}
+
+/** \brief start a new brick in its own thread
+ *
+ * The configuration is copied, the strings it points to must stay
+ * valid until the brick is initialized.  This may be called from any
+ * thread.
+ * \returns the new brick or NULL if the thread can't be created.
+ */
+brick *brick_create(const brick_config *config) {
+    brick *b = malloc(sizeof(brick));
+
+    if (!b)
+        return NULL;
+    b->config = *config;
+    if (pthread_create(&b->thread, NULL, brick_thread, b) != 0) {
+        perror("pthread_create");
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+/** \brief wait until the brick stopped and free it */
+void brick_join(brick *b) {
+    pthread_join(b->thread, NULL);
+    free(b);
+}
+#endif
+
+/** \brief stop the brick of the calling thread
+ *
+ * Bricks started by brick_create only end their own thread, otherwise
+ * the emulator exits.
+ */
+void brick_exit(int status) {
+#ifdef MULTI_BRICK
+    if (brick_threaded)
+        pthread_exit(NULL);
+#endif
+    exit(status);
+}
@@ -0,0 +1,67 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#ifndef _BRICK_H_
+#define  _BRICK_H_
+
+#include "types.h"
+
+/** \brief settings for one emulated brick */
+typedef struct brick_config {
+    /** \brief ROM image or NULL for the default */
+    char *rom_file;
+    /** \brief port of the GUI server or 0 to start GUI.tcl */
+    int guiserverport;
+    /** \brief ratio of simulated to real time or NULL, see periph_set_speed */
+    const char *speed;
+    /** \brief pacing quantum and lag tolerance in usecs or 0, see
+     * periph_set_pacing */
+    int pace_quantum, max_lag;
+    /** \brief frames per second of the GUI output or 0, see
+     * periph_set_output_rate */
+    int output_rate;
+    /** \brief wait for the debugger before the first instruction */
+    int debug;
+    /** \brief journal to record the inputs to or NULL, see replay.h */
+    const char *record_file;
+    /** \brief journal to replay the inputs from or NULL */
+    const char *replay_file;
+    /** \brief directory of the boot state cache or NULL, see savefile.c */
+    const char *boot_cache;
+    /** \brief file to publish the state in or NULL, see observe.h */
+    const char *observe_file;
+    /** \brief scenario to run headless or NULL, see scenario.h */
+    const char *scenario_file;
+} brick_config;
+
+/** \brief initialize the brick of the calling thread */
+extern void brick_init(const brick_config *config);
+/** \brief stop the brick of the calling thread */
+extern void brick_exit(int status);
+
+#ifdef MULTI_BRICK
+typedef struct brick brick;
+
+/** \brief start a new brick in its own thread */
+extern brick *brick_create(const brick_config *config);
+/** \brief wait until the brick stopped and free it */
+extern void brick_join(brick *b);
+#endif
+
+#endif
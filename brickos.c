@@ -26,6 +26,7 @@
 #include "h8300.h"
 #include "memory.h"
 #include "peripherals.h"
+#include "replay.h"
 #include "lx.h"
 #include "symbols.h"
 #include "coff.h"
@@ -49,10 +50,12 @@
 #define PCHAIN_CTID     6
 
 #define READ_BYTE(offset) (memory[offset])
-#define WRITE_BYTE(offset, val) memory[offset] = (val)
+#define WRITE_BYTE(offset, val) do { memory[offset] = (val); \
+                                     mem_modified(offset, 1); } while(0)
 #define READ_WORD(offset) ((memory[offset] << 8) | memory[(offset) + 1])
 #define WRITE_WORD(offset, val) do { memory[offset] = (val) >> 8; \
-                             memory[(offset) + 1] = (val) & 0xff; } while(0)
+                             memory[(offset) + 1] = (val) & 0xff; \
+                             mem_modified(offset, 2); } while(0)
 
 static void brickos_free(uint16 mm_start, uint16 mm_first_free,
                          uint16 addr) {
@@ -248,14 +251,16 @@ static void brickos_load_program(int fd) {
     uint16 mm_start = symbols_getaddr("_mm_start");
     uint16 mm_first_free = symbols_getaddr("_mm_first_free");
 
-    read(fd, buf, 1);
+    replay_read(fd, buf, 1);
     prog = programs + 22 * (buf[0] - '0');
 
     len = 0;
     do {
-        len += read(fd, filename + len, 1);
-    } while (filename[len-1] != '\n' && filename[len-1] != '\r');
-    filename[len-1] = 0;
+        if (replay_read(fd, filename + len, 1) <= 0)
+            break;
+    } while (filename[len] != '\n' && filename[len] != '\r'
+             && ++len < MAX_PATHNAME_LEN);
+    filename[len] = 0;
 
     if (mm_start == 0 || programs == 0) {
         fprintf(stderr, "Not enough symbolic information about firmware\n");
@@ -326,6 +331,8 @@ static void brickos_load_program(int fd) {
            header.text_size  + header.data_size + header.bss_size,
            memory + text + header.text_size, 
            header.data_size);
+    mem_modified(text + header.text_size + header.data_size,
+                 header.bss_size + header.data_size);
     WRITE_WORD(prog + 20, header.text_size + header.data_size);
 }
 
@@ -333,7 +340,7 @@ static void brickos_sethostaddr(int fd) {
     uint16 lnp_hostaddr;
     char buf[5];
     int addr;
-    read(fd, buf, 1);
+    replay_read(fd, buf, 1);
 
     lnp_hostaddr = symbols_getaddr("_lnp_hostaddr");
 
@@ -342,7 +349,7 @@ static void brickos_sethostaddr(int fd) {
             sprintf(buf, "ON%x\n", memory[lnp_hostaddr] >> 4);
         else
             strcpy(buf, "ON?\n");
-        write(fd, buf, strlen(buf));
+        periph_write(buf);
     } else if (!lnp_hostaddr) {
         fprintf(stderr, "Not enough symbolic information about firmware\n");
     } else {
@@ -350,6 +357,7 @@ static void brickos_sethostaddr(int fd) {
             buf[0] > 'A' ? (buf[0] - 'A' + 10) : (buf[0] - '0');
 
         memory[lnp_hostaddr] = addr << 4;
+        mem_modified(lnp_hostaddr, 1);
     }
 }
 
@@ -357,7 +365,7 @@ static void brickos_checkos(int fd) {
     char buf[5];
 
     sprintf(buf, "OO%d\n", symbols_getaddr("_mm_start") ? 1 : 0);
-    write(fd, buf, strlen(buf));
+    periph_write(buf);
 }
 
 static void brickos_newprogram_addr(int fd) {
@@ -371,9 +379,11 @@ static void brickos_newprogram_addr(int fd) {
 
     len = 0;
     do {
-        len += read(fd, buf + len, 1);
-    } while (len < sizeof(buf) && buf[len-1] != '\n' && buf[len-1] != '\r');
-    buf[len-1] = 0;
+        if (replay_read(fd, buf + len, 1) <= 0)
+            break;
+    } while (buf[len] != '\n' && buf[len] != '\r'
+             && ++len < (int) sizeof(buf) - 1);
+    buf[len] = 0;
     prog = programs + 22 * (buf[0] - '0');
     size = atoi(buf+1);
     if (programs && mm_start) {
@@ -390,14 +400,14 @@ static void brickos_newprogram_addr(int fd) {
             brickos_free(mm_start, mm_first_free, addr);
     }
     sprintf(buf, "OA%x\n", addr);
-    write(fd, buf, strlen(buf));
+    periph_write(buf);
 }
 
 void brickos_read_fd(int fd) {
     char buf[3];
 
     /* read in next byte: id */
-    read(fd, buf, 1);
+    replay_read(fd, buf, 1);
 
     switch (buf[0]) {
     case 'M':
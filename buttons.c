@@ -20,6 +20,8 @@
 #include "h8300.h"
 #include "memory.h"
 #include "peripherals.h"
+#include "replay.h"
+#include "observe.h"
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -31,20 +33,25 @@
 #define BUTTON_PRGM  0x80
 
 
-static uint8 btn_state, iscr, ier, irqpending;
+static BRICK_LOCAL uint8 btn_state, iscr, ier, irqpending;
 
 typedef struct {
     uint8 btn_state, iscr, ier, irqpending;
 } btn_save_type;
 
+static void btn_update_irq() {
+    int i;
+    int irqs = (~btn_state & ier & ~iscr & 7) | irqpending;
+
+    for (i = 0; i < 3; i++)
+        irq_set(IRQ0_HANDLER + i, irqs & (1 << i));
+}
+
 static void btn_reset() {
     iscr = ier = irqpending = 0;
     btn_state = 0xff;
-}
-
-static void btn_check_next_cycle() {
-    if ((~btn_state & ier & ~iscr & 7) | (irqpending & iscr))
-        next_timer_cycle = cycles;
+    OBSERVE(buttons, btn_state);
+    btn_update_irq();
 }
 
 static int btn_save(void *buffer, int maxlen) {
@@ -62,7 +69,7 @@ static void btn_load(void *buffer, int len) {
     ier = data->ier;
     irqpending = data->irqpending;
     irqpending |= data->btn_state & ~btn_state & iscr & 7;
-    btn_check_next_cycle();
+    btn_update_irq();
 }
 
 static void btn_read_fd(int fd) {
@@ -70,9 +77,11 @@ static void btn_read_fd(int fd) {
     int mask, newval;
 
     /* read in 3 bytes: btnid val newline */
-    int len = 0;
+    int len = 0, n;
     do {
-        len += read(fd, buf + len, 3 - len);
+        if ((n = replay_read(fd, buf + len, 3 - len)) <= 0)
+            return;
+        len += n;
     } while (len < 3);
 
     mask = 0;
@@ -99,29 +108,22 @@ static void btn_read_fd(int fd) {
     if ((btn_state ^ newval) & mask) {
         irqpending |= btn_state & mask & iscr & 7;
         btn_state ^= mask;
+        OBSERVE(buttons, btn_state);
 #ifdef VERBOSE_BUTTON
         printf("%" CYCLE_COUNT_F ": BTN %02x\n", cycles, btn_state);
 #endif
-        btn_check_next_cycle();
+        btn_update_irq();
     }
 }
 
-static int btn_check_irq() {
-    int i;
-    int irqs;
-
-    irqs = (~btn_state & ier & ~iscr & 7) | irqpending;
+static void btn_ack_irq(int vector) {
+    int i = vector - IRQ0_HANDLER;
 
-    for (i = 0; i < 3; i++) {
-        if (irqs & (1 << i)) {
-            irqpending &= ~(1 << i);
+    irqpending &= ~(1 << i);
 #ifdef VERBOSE_BUTTON
-            printf("Generated IRQ%d\n", i);
+    printf("Generated IRQ%d\n", i);
 #endif
-            return 4 + i;
-        }
-    }
-    return 255;
+    btn_update_irq();
 }
 
 static void set_iscr(uint8 value) {
@@ -130,7 +132,7 @@ static void set_iscr(uint8 value) {
 #endif
     iscr = value & 0x7;
     irqpending &= iscr;
-    btn_check_next_cycle();
+    btn_update_irq();
 }
 
 static uint8 get_iscr(void) {
@@ -142,7 +144,7 @@ static void set_ier(uint8 value) {
     printf("buttons.c: set_ier(%02x)\n", value);
 #endif
     ier = value & 0x7;
-    btn_check_next_cycle();
+    btn_update_irq();
 }
 
 static uint8 get_ier(void) {
@@ -164,7 +166,6 @@ peripheral_ops buttons = {
     id: 'B',
     reset: btn_reset,
     read_fd: btn_read_fd,
-    check_irq: btn_check_irq,
     load_data: btn_load,
     save_data: btn_save
 };
@@ -178,5 +179,8 @@ void btn_init() {
     port[0xc7 - 0x88].get = get_ier;
     port[0xc7 - 0x88].set = set_ier;
 
+    irq_set_ack(IRQ0_HANDLER, btn_ack_irq);
+    irq_set_ack(IRQ1_HANDLER, btn_ack_irq);
+    irq_set_ack(IRQ2_HANDLER, btn_ack_irq);
     register_peripheral(buttons);
 }
@@ -48,6 +48,7 @@ int coff_read (FILE *file, int start)
             uint32 scnptr = ntohl(sect.scnptr);
             fseek(file, scnptr, SEEK_SET);
             fread(memory + paddr, size, 1, file);
+            mem_modified(paddr, size);
 #ifdef VERBOSE_COFF
             fprintf(stderr, "section %8s loaded to %04lx-%04lx\n", 
                     sect.sectname, paddr, paddr+size);
@@ -0,0 +1,220 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+/** \file cpubench.c
+ * \brief speed test for the C cpu core
+ *
+ * Links h8300.c without any peripherals and runs a small loop of
+ * typical opcodes in run_cpu().  An event is scheduled every
+ * BENCH_EVENT_CYCLES cycles, like the timers of the real brick do.
+ * The Makefile builds it once with threaded dispatch and once with
+ * the switch; "make cpubench" runs both and prints the time needed
+ * per emulated instruction.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "h8300.h"
+#include "memory.h"
+#include "peripherals.h"
+#include "frame.h"
+
+#ifdef NO_THREADED_DISPATCH
+#define BENCH_DISPATCH "switch"
+#else
+#define BENCH_DISPATCH "threaded"
+#endif
+#ifdef LAZY_FLAGS
+#define BENCH_NAME BENCH_DISPATCH "+lazy"
+#else
+#define BENCH_NAME BENCH_DISPATCH
+#endif
+
+/** \brief default number of H8 cycles to run */
+#define BENCH_CYCLES        400000000
+/** \brief cycles between two calls of check_irq */
+#define BENCH_EVENT_CYCLES  1000
+#define BENCH_START         0x8000
+/** \brief db_trap value that ends the benchmark */
+#define BENCH_DONE          2
+
+BRICK_LOCAL uint8 memory[65536];
+BRICK_LOCAL uint8 memtype[65536];
+BRICK_LOCAL mem_page mem_pages[MEM_PAGES];
+BRICK_LOCAL int mem_debug_pages;
+BRICK_LOCAL unsigned int frame_opcstat[256];
+
+static cycle_count_t bench_cycles = BENCH_CYCLES;
+static struct timeval bench_start;
+
+static const uint8 bench_code[] = {
+    0x79, 0x07, 0xff, 0x80,     /* mov.w #0xff80,r7 */
+    0x79, 0x06, 0xfd, 0x80,     /* mov.w #0xfd80,r6 */
+    /* outer: */
+    0xfa, 0x64,                 /* mov.b #100,r2l */
+    /* inner: */
+    0x6f, 0x60, 0x00, 0x00,     /* mov.w @(0,r6),r0 */
+    0x88, 0x01,                 /* add.b #1,r0l */
+    0x90, 0x00,                 /* addx #0,r0h */
+    0x6f, 0xe0, 0x00, 0x00,     /* mov.w r0,@(0,r6) */
+    0x0c, 0x81,                 /* mov.b r0l,r1h */
+    0x11, 0x01,                 /* shlr r1h */
+    0x15, 0x01,                 /* xor.b r0h,r1h */
+    0x73, 0x31,                 /* btst #3,r1h */
+    0x47, 0x02,                 /* beq skip */
+    0x70, 0x09,                 /* bset #0,r1l */
+    /* skip: */
+    0xe9, 0x7f,                 /* and.b #0x7f,r1l */
+    0x55, 0x06,                 /* bsr sub */
+    0x1a, 0x0a,                 /* dec r2l */
+    0x46, 0xe0,                 /* bne inner */
+    0x40, 0xdc,                 /* bra outer */
+    /* sub: */
+    0x6d, 0xf0,                 /* mov.w r0,@-r7 */
+    0x6f, 0x60, 0x00, 0x02,     /* mov.w @(2,r6),r0 */
+    0x09, 0x10,                 /* add.w r1,r0 */
+    0x6f, 0xe0, 0x00, 0x02,     /* mov.w r0,@(2,r6) */
+    0x6d, 0x70,                 /* mov.w @r7+,r0 */
+    0x54, 0x70,                 /* rts */
+};
+
+uint8 get_byte_div(uint16 addr) {
+    return memory[addr];
+}
+
+uint16 get_word_div(uint16 addr) {
+    addr &= ~1;
+    return (memory[addr] << 8) | memory[addr + 1];
+}
+
+void SET_BYTE(uint16 addr, uint8 val) {
+    if (memtype[addr] & MEMTYPE_CODE)
+        cpu_invalidate_code(addr, 1);
+    memory[addr] = val;
+}
+
+void SET_WORD(uint16 addr, uint16 val) {
+    if ((memtype[addr] | memtype[(uint16) (addr + 1)]) & MEMTYPE_CODE)
+        cpu_invalidate_code(addr, 2);
+    memory[addr] = val >> 8;
+    memory[addr+1] = val & 0xff;
+}
+
+static const page_funcs bench_page_funcs = {
+    get_byte_div, get_word_div, SET_BYTE, SET_WORD
+};
+
+/* Pages with code are never written directly, which is all the
+ * invalidation the benchmark needs.
+ */
+void mem_set_type(uint16 addr, int len, uint8 type) {
+    int i;
+
+    for (i = addr; i < addr + len && i < 0x10000; i++) {
+        memtype[i] |= type;
+        mem_pages[i >> MEM_PAGE_BITS].types |= type;
+        if (type & MEMTYPE_CODE)
+            mem_pages[i >> MEM_PAGE_BITS].write = NULL;
+    }
+}
+
+void mem_clear_type(uint16 addr, int len, uint8 type) {
+    int i;
+
+    for (i = addr; i < addr + len && i < 0x10000; i++)
+        memtype[i] &= ~type;
+}
+
+void do_reset(void) {
+    int i;
+
+    memcpy(memory + BENCH_START, bench_code, sizeof(bench_code));
+    memory[0] = BENCH_START >> 8;
+    memory[1] = BENCH_START & 0xff;
+    memset(memtype + 0xfd80, MEMTYPE_FAST, 0xff80 - 0xfd80);
+    for (i = 0; i < MEM_PAGES; i++) {
+        uint8 fast = memtype[i << MEM_PAGE_BITS] & MEMTYPE_FAST;
+        mem_pages[i].read = mem_pages[i].write = memory;
+        mem_pages[i].funcs = &bench_page_funcs;
+        mem_pages[i].byte_cycles = fast ? 2 : 3;
+        mem_pages[i].word_cycles = fast ? 2 : 6;
+    }
+
+    irq_disabled_one = 1;
+    ccr = 0x80;
+    cycles = 0;
+    next_timer_cycle = next_nmi_cycle = BENCH_EVENT_CYCLES;
+    db_trap = 0;
+    pc = GET_WORD_CYCLES(0);
+    gettimeofday(&bench_start, NULL);
+}
+
+int check_irq(void) {
+    if (cycles >= bench_cycles)
+        db_trap = BENCH_DONE;
+    next_timer_cycle = next_nmi_cycle = cycles + BENCH_EVENT_CYCLES;
+    return 0;
+}
+
+void periph_handletrap(void) {
+    struct timeval now;
+    double secs, insns = 0;
+    int i;
+
+    gettimeofday(&now, NULL);
+    if (db_trap != BENCH_DONE) {
+        printf("%s: unexpected trap %d at %04x\n", BENCH_NAME, db_trap, pc);
+        dump_state();
+        exit(1);
+    }
+    for (i = 0; i < 256; i++)
+        insns += frame_opcstat[i];
+    secs = (now.tv_sec - bench_start.tv_sec)
+        + (now.tv_usec - bench_start.tv_usec) / 1e6;
+    printf("%-13s %10.0f instructions in %6.3f s: %6.2f ns/instruction\n",
+           BENCH_NAME, insns, secs, secs * 1e9 / insns);
+    exit(0);
+}
+
+void cpu_sleep(void) {
+}
+
+void debug_printf(void) {
+}
+
+void frame_dump_stack(FILE *out, uint16 fp) {
+}
+
+void frame_switch(uint16 oldframe, uint16 newframe) {
+}
+
+void frame_begin(uint16 fp, int in_irq) {
+}
+
+void frame_end(uint16 fp, int in_irq) {
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1)
+        bench_cycles = strtoul(argv[1], NULL, 0);
+    run_cpu();
+    return 0;
+}
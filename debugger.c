@@ -34,6 +34,7 @@
 #include "h8300.h"
 #include "memory.h"
 #include "peripherals.h"
+#include "debugger.h"
 #include "frame.h"
 #include "socket.h"
 
@@ -53,17 +54,17 @@ typedef int32 gdb_register_size_t;
 #define NUM_REGS 13
 #define NUM_REG_BYTES (NUM_REGS*sizeof(gdb_register_size_t))
 
-int   debuggerfd;
-int   monitorport;
+BRICK_LOCAL int   debuggerfd;
+BRICK_LOCAL int   monitorport;
 
-static uint8 db_registers[NUM_REG_BYTES];
-static int   serverfd, gdbfd;
+static BRICK_LOCAL uint8 db_registers[NUM_REG_BYTES];
+static BRICK_LOCAL int   serverfd, gdbfd;
 
-static char db_in_buffer[2048];
-static char db_out_buffer[2048];
-static int db_len = 0, db_out_len = 0, db_cont;
+static BRICK_LOCAL char db_in_buffer[2048];
+static BRICK_LOCAL char db_out_buffer[2048];
+static BRICK_LOCAL int db_len = 0, db_out_len = 0, db_cont;
 
-static int remote_debug;
+static BRICK_LOCAL int remote_debug;
 
 static int bptype2mask[6] = {
     MEMTYPE_BREAKPOINT, 
@@ -190,7 +191,7 @@ static int hexToInt(char **ptr, int *intValue) {
   return (numChars);
 }
 
-static int sigval;
+static BRICK_LOCAL int sigval;
 
 static void db_handle_packet(char* packet) {
     int start;
@@ -217,9 +218,10 @@ static void db_handle_packet(char* packet) {
         memset(db_registers, 0, sizeof(db_registers));
 
         for (i = 0; i < 8; i++) {
-            db_registers[4*i]   = reg[i];
-            db_registers[4*i+1] = reg[i+8];
+            db_registers[4*i]   = REG8(i);
+            db_registers[4*i+1] = REG8(i+8);
         }
+        cpu_flush_ccr();
         db_registers[33]  = ccr;
         db_registers[36]  = pc >> 8;
         db_registers[37]  = pc & 0xff;
@@ -241,9 +243,9 @@ static void db_handle_packet(char* packet) {
             uint8 value[4];
             hex2mem (packet, value, 4);
             if (addr >= 0 && addr < 8) {
-                reg[addr  ] = value[0];
-                reg[addr+8] = value[1];
+                SET_REG16(addr, (value[0] << 8) | value[1]);
             } else if (addr == 8) {
+                cpu_flush_ccr();
                 ccr = value[1];
             } else if (addr == 9) {
                 pc = (value[0]<<8)+value[1];
@@ -290,6 +292,7 @@ static void db_handle_packet(char* packet) {
             if (addr >= 0 && addr + length <= 0xff88) {
                 /* we allow writing to ROM, but why not :) */
                 hex2mem(packet, &memory[addr], length);
+                mem_modified(addr, length);
                 db_out_buffer[db_out_len++] = 'O';
                 db_out_buffer[db_out_len++] = 'K';
             } else {
@@ -335,8 +338,8 @@ static void db_handle_packet(char* packet) {
             if (addr >= 0 && addr + length <= 0xff88
                 && type >= 0 && type < 6) {
                 int mask = bptype2mask[type];
-                for (i = addr; i < addr + length; i++)
-                    memtype[i] |= mask;
+                mem_set_type(addr, length, mask);
+                cpu_invalidate_code(addr, length);
                 db_out_buffer[db_out_len++] = 'O';
                 db_out_buffer[db_out_len++] = 'K';
             } else {
@@ -362,8 +365,7 @@ static void db_handle_packet(char* packet) {
             if (addr >= 0 && addr + length <= 0xff88
                 && type >= 0 && type < 6) {
                 int mask = bptype2mask[type];
-                for (i = addr; i < addr + length; i++)
-                    memtype[i] &= ~mask;
+                mem_clear_type(addr, length, mask);
                 db_out_buffer[db_out_len++] = 'O';
                 db_out_buffer[db_out_len++] = 'K';
             } else {
@@ -551,3 +553,15 @@ printf("Can't start debugging server\n");
     sigact.sa_flags = SA_RESTART;
     sigaction(SIGQUIT, &sigact, NULL);
 }
+
+/** \brief start the debugging server again on a new port
+ *
+ * A brick forked from a checkpoint calls this, so that it can be
+ * debugged independently of its parent.
+ */
+void db_restart(void) {
+    if (gdbfd >= 0)
+        close(gdbfd);
+    close(serverfd);
+    db_init();
+}
@@ -22,6 +22,10 @@
 
 #include "types.h"
 
-extern void db_handletrap(int signal, uint16 stoppc);
+extern void db_handletrap(void);
+extern void db_handlefd(void);
+
+/** \brief start the debugging server again on a new port */
+extern void db_restart(void);
 
 #endif
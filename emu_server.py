@@ -1,4 +1,6 @@
+import mmap
 import socket
+import struct
 import sys
 import time
 from queue import Queue
@@ -50,6 +52,8 @@ SENSOR_3_X = 36
 # P for peripherals
 #    R for reset
 #    D for debug
+#    S for speed, e.g. PS1, PS1/4 or PSmax (unthrottled)
+#    C for checkpoint, e.g. PCbooted; answered with PC<port>
 # O for bibo os, if loaded, otherwise brickos
 #   O check os
 # L for LCD
@@ -110,6 +114,54 @@ def find_free_port():
         return s.getsockname()[1]
 
 
+# Layout of the file written by "emu -observe <file>", see observe.h
+OBSERVE_MAGIC = 0x4272456f
+OBSERVE_VERSION = 1
+OBSERVE_FORMAT = "=4I4QIH12s3B3s3H8H2x"
+OBSERVE_FIELDS = ("cycles", "idle_cycles", "real_usecs", "max_lag",
+                  "target_speed", "pc", "lcd", "lcd_enabled", "buttons",
+                  "analog_active")
+
+
+class BrickObserver:
+    """Read the state the emulator publishes with "-observe <file>".
+
+    The emulator doesn't need to be asked, so a snapshot can be taken
+    at any rate.
+    """
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, size = struct.unpack_from("=3I", self.map)
+        if magic != OBSERVE_MAGIC or version != OBSERVE_VERSION:
+            raise ValueError(f"{path} is not an observe file of version {OBSERVE_VERSION}")
+        self.size = struct.calcsize(OBSERVE_FORMAT)
+
+    def close(self):
+        self.map.close()
+
+    def snapshot(self):
+        """Return a consistent copy of the state as a dict.
+
+        seq is odd while the emulator changes the state, so the copy
+        is only taken if seq is even and the same before and after.
+        """
+        while True:
+            data = self.map[:self.size]
+            seq = struct.unpack_from("=I", data, 12)[0]
+            if seq % 2 == 0 and self.map[12:16] == data[12:16]:
+                break
+        values = struct.unpack(OBSERVE_FORMAT, data)
+        state = dict(zip(OBSERVE_FIELDS, values[4:14]))
+        state["motor_dir"] = list(values[14])
+        state["motor_on"] = list(values[15:18])
+        state["sensors"] = list(values[18:26])
+        state["lcd_state"] = {8 * i + bit: (byte & (1 << bit)) > 0
+                              for i, byte in enumerate(state["lcd"]) for bit in range(8)}
+        return state
+
+
 class EmuServer:
     def __init__(self, ip, port):
         self.ip = ip
@@ -120,6 +172,7 @@ class EmuServer:
         self.run_forever = True
         self.rom_path = None
         self.firmware_path = None
+        self.boot_cache = False
         self.conn = None
         self.lcd_state = {key: False for key in range(0, 100)}
         self.motor_state = {
@@ -134,6 +187,10 @@ class EmuServer:
     def set_firmware_path(self, firmware_path):
         self.firmware_path = firmware_path
 
+    def set_boot_cache(self, enabled):
+        """Reuse the booted firmware, the emulator needs -bootcache <dir>."""
+        self.boot_cache = enabled
+
     def send(self, data):
         self.in_queue.put(data)
 
@@ -182,6 +239,29 @@ class EmuServer:
         if value >= 0 and value < 1024:
             self.send_cmd(f"A{sensor}{value:03x}")
 
+    def set_speed(self, ratio):
+        """Set the ratio of simulated to real time, e.g. 1, "1/4" or "max"."""
+        self.send_cmd(f"PS{ratio}")
+
+    def checkpoint(self, name):
+        """Serve the current state as checkpoint, see checkpoint_port."""
+        self.send_cmd(f"PC{name}")
+
+    def checkpoint_port(self, timeout=10):
+        """Wait for the answer to checkpoint() and return the port.
+
+        Every connection to this port gets its own copy of the brick,
+        forked from the checkpoint; copy n writes its output to the
+        directory <name>-<n>.  Other received messages are dropped.
+        """
+        end = time.time() + timeout
+        while time.time() < end:
+            for msg in self.recv():
+                if msg.startswith("PC"):
+                    return int(msg[2:])
+            time.sleep(0.05)
+        return None
+
     def _init_sensors(self, sensor_1, sensor_2, sensor_3, battery):
         cmd_sequence = [
             (SENSOR_1, sensor_1),
@@ -210,6 +290,29 @@ class EmuServer:
                 self.send_cmd(cmd[0], end_of_line=cmd[1])
             time.sleep(0.2)
 
+    def _wait_for_message(self, prefix):
+        while True:
+            msg = self._socket_recv()
+            if msg.startswith(prefix):
+                return msg
+
+    def _boot_firmware(self):
+        """Load the firmware, from the boot cache if possible.
+
+        "CK<files>" answers "CK1" if the emulator restored the state of
+        a brick booted with this ROM and firmware, "CK0" otherwise.
+        After a normal boot "CB" stores the state once the firmware
+        answered the OS check.
+        """
+        if self.boot_cache:
+            self.send_cmd(f"CK{self.firmware_path}", end_of_line="\n")
+            if self._wait_for_message("CK") == "CK1":
+                return
+        self._set_firmware()
+        if self.boot_cache:
+            self._wait_for_message("OO")
+            self.send_cmd("CB", end_of_line="\n")
+
     def _wait_for_emulator_startup(self):
         started = False
         while not started:
@@ -231,8 +334,10 @@ class EmuServer:
             in_data = self._socket_recv()
             if in_data:
                 if lcd_cmd in in_data:
-                    start_value = 8 * int(in_data[1])
-                    value = int(in_data[3:5], 16)
+                    # L<segment byte>,<hex bits>, the byte may have two digits
+                    index, _, bits = in_data[1:].partition(",")
+                    start_value = 8 * int(index)
+                    value = int(bits, 16)
                     for i in range(0, 8):
                         self.lcd_state[start_value + i] = (value & (1 << i)) > 0
                 if motor_cmd in in_data:
@@ -249,6 +354,18 @@ class EmuServer:
             if data:
                 self.conn.send(data)
 
+    def run_checkpoint_client(self):
+        """Connect to the checkpoint at self.port and run the forked brick.
+
+        The brick is already set up, so no initialization is done.
+        """
+        self.conn = socket.create_connection((self.ip, self.port))
+        try:
+            self.init_done = True
+            self._run()
+        finally:
+            self.conn.close()
+
     def run_server(self):
         # Create a TCP/IP socket
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
@@ -269,7 +386,7 @@ class EmuServer:
                 self._init_sensors(1023, 1023, 1023, 320)
                 time.sleep(0.02)
                 if self.firmware_path:
-                    self._set_firmware()
+                    self._boot_firmware()
                 time.sleep(0.02)
                 self.init_done = True
 
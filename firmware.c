@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include "memory.h"
 #include "peripherals.h"
+#include "replay.h"
 #include "coff.h"
 #include "symbols.h"
 
@@ -10,21 +11,19 @@
 static void firm_null() {
 }
 
-static int firm_check_irq() {
-    return 255;
-}
-
 static void firm_read_fd(int fd) {
     FILE *file;
     char filename[MAX_PATHNAME_LEN+1];
     int entry;
 
-    /* read in 3 bytes: btnid val newline */
+    /* read in the filename up to the newline */
     int len = 0;
     do {
-        len += read(fd, filename + len, 1);
-    } while (filename[len-1] != '\n' && filename[len-1] != '\r');
-    filename[len-1] = 0;
+        if (replay_read(fd, filename + len, 1) <= 0)
+            break;
+    } while (filename[len] != '\n' && filename[len] != '\r'
+             && ++len < MAX_PATHNAME_LEN);
+    filename[len] = 0;
 
     if (memory[0xee5e] != 0xd) {
         fprintf (stderr, "RCX not ready to receive firmware\n");
@@ -60,6 +59,7 @@ static void firm_read_fd(int fd) {
     memory[0xee63] = (entry & 0xff);  /* firmware entry point */
     memory[0xee5e] = 0x13; /* run firmware */
     memory[0xef06] = 8;  /* no more updates */
+    mem_modified(0xee5e, 0xef07 - 0xee5e);
     
     fprintf (stderr, "BrickEmu: Firmware loaded to %04x: %s\n", entry, filename);
 }
@@ -68,8 +68,7 @@ static peripheral_ops firmware = {
     id: 'F',
     read_fd: firm_read_fd,
     reset: firm_null,
-    update_time: firm_null,
-    check_irq: firm_check_irq
+    update_time: firm_null
 };
 
 void firm_init() {
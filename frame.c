@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
 #include "types.h"
@@ -35,11 +36,11 @@
 #undef LOG_MEMORY
 
 #ifdef LOG_CALLS
-FILE *framelog;
+BRICK_LOCAL FILE *framelog;
 #endif
 
-unsigned int frame_opcstat[256];
-unsigned int frame_asmopcstat[256];
+BRICK_LOCAL unsigned int frame_opcstat[256];
+BRICK_LOCAL unsigned int frame_asmopcstat[256];
 
 typedef struct callee_info {
     uint32 calls;
@@ -76,12 +77,31 @@ typedef struct thread_info {
 } thread_info;
 
 #ifdef HASH_PROFILES
-static hash_type profiles;
+static BRICK_LOCAL hash_type profiles;
 #else
-static profile_info *profiles[65536];
+static BRICK_LOCAL profile_info *profiles[65536];
+#endif
+static BRICK_LOCAL hash_type threads;
+static BRICK_LOCAL thread_info *current_thread;
+
+#ifdef PROFILE_SEQUENCES
+/* number of sequences written to opcseq.txt */
+#define MAX_SEQUENCES 256
+/* marks triples in sequence_info.ops */
+#define SEQUENCE_TRIPLE 0x1000000
+
+typedef struct sequence_info {
+    unsigned int ops;
+    unsigned int count;
+} sequence_info;
+
+/* the last two first opcode bytes, the older one in bits 8-15 */
+static BRICK_LOCAL unsigned int last_opcodes;
+static BRICK_LOCAL unsigned int pairstat[65536];
+static BRICK_LOCAL hash_type triplestat;
+static BRICK_LOCAL sequence_info *sequences;
+static BRICK_LOCAL int num_sequences;
 #endif
-static hash_type threads;
-static thread_info *current_thread;
 
 /* #define VERBOSE_FRAME */
 #define MIN_DESC_LEVEL 3
@@ -470,7 +490,7 @@ void frame_end(uint16 fp, int in_irq) {
         prof->max_local_cycles = local;
 }
 
-static FILE *proffile;
+static BRICK_LOCAL FILE *proffile;
 
 static void frame_dump_callee(unsigned int key, void *param) {
     char buf[11];
@@ -587,6 +607,75 @@ static void frame_dump_function(unsigned int key, void *param) {
     fprintf(proffile, "\n");
 }
 
+#ifdef PROFILE_SEQUENCES
+/**
+ * Count the pair and triple of opcodes ending with the opcode op.
+ * Called by the cpu core for each executed instruction.
+ */
+void frame_count_sequence(uint8 op) {
+    unsigned int ops = ((last_opcodes << 8) | op) & 0xffffff;
+    unsigned int *count;
+
+    pairstat[ops & 0xffff]++;
+    count = hash_get(&triplestat, ops);
+    if (!count) {
+        count = hash_create(&triplestat, ops, sizeof(unsigned int));
+        *count = 0;
+    }
+    (*count)++;
+    last_opcodes = ops;
+}
+
+static void frame_add_triple(unsigned int ops, void *count) {
+    sequences[num_sequences].ops = ops | SEQUENCE_TRIPLE;
+    sequences[num_sequences].count = *(unsigned int *) count;
+    num_sequences++;
+}
+
+static int frame_compare_sequences(const void *a, const void *b) {
+    unsigned int ca = ((const sequence_info *) a)->count;
+    unsigned int cb = ((const sequence_info *) b)->count;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/**
+ * Write the most frequent opcode sequences in the format of
+ * h8300-fusion.dat.
+ */
+static void frame_dump_sequences(void) {
+    FILE *seqfile = fopen("opcseq.txt", "w");
+    int i;
+
+    if (!seqfile) {
+        perror("opcseq.txt");
+        return;
+    }
+    sequences = malloc((65536 + triplestat.elems) * sizeof(sequence_info));
+    num_sequences = 0;
+    for (i = 0; i < 65536; i++) {
+        if (pairstat[i]) {
+            sequences[num_sequences].ops = i;
+            sequences[num_sequences].count = pairstat[i];
+            num_sequences++;
+        }
+    }
+    hash_enumerate(&triplestat, frame_add_triple);
+    qsort(sequences, num_sequences, sizeof(sequence_info),
+          frame_compare_sequences);
+
+    fprintf(seqfile, "# opcode sequences: count, first opcode bytes\n");
+    for (i = 0; i < num_sequences && i < MAX_SEQUENCES; i++) {
+        unsigned int ops = sequences[i].ops;
+        fprintf(seqfile, "%u\t", sequences[i].count);
+        if (ops & SEQUENCE_TRIPLE)
+            fprintf(seqfile, "%02X ", (ops >> 16) & 0xff);
+        fprintf(seqfile, "%02X %02X\n", (ops >> 8) & 0xff, ops & 0xff);
+    }
+    fclose(seqfile);
+    free(sequences);
+}
+#endif
+
 void frame_dump_profile() {
     proffile = fopen("profile.txt", "w");
 
@@ -618,6 +707,10 @@ void frame_dump_profile() {
 #endif
     fclose(proffile);
 
+#ifdef PROFILE_SEQUENCES
+    frame_dump_sequences();
+#endif
+
 #ifdef LOG_CALLS
     fclose(framelog);
 #endif
@@ -632,6 +725,11 @@ void frame_init(void) {
     hash_init(&threads, 5);
     memset(frame_opcstat, 0, sizeof(frame_opcstat));
     memset(frame_asmopcstat, 0, sizeof(frame_asmopcstat));
+#ifdef PROFILE_SEQUENCES
+    hash_init(&triplestat, 1021);
+    memset(pairstat, 0, sizeof(pairstat));
+    last_opcodes = 0;
+#endif
 
 #ifdef LOG_CALLS
     framelog = fopen("frames.txt", "w");
@@ -28,5 +28,6 @@ extern void frame_switch(uint16 oldframe, uint16 newframe);
 extern void frame_begin(uint16 fp, int in_irq);
 extern void frame_end(uint16 fp, int in_irq);
 extern void frame_dump_profile(void);
+extern void frame_count_sequence(uint8 op);
 
 #endif
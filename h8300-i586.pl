@@ -45,11 +45,11 @@
 #
 #################
 
-$WRITE_PATTERN = "a4";
+$WRITE_PATTERN = "b4";   # writes to predecoded code go through C
 $FAST_PATTERN  = "40";
 $READ_PATTERN  = "88";
 $CODE_PATTERN  = "80";   # don't check for breakpoint on second word
-$READWRITE_PATTERN ="ac";
+$READWRITE_PATTERN ="bc";
 
 
 sub getWRdAddr() {
@@ -177,17 +177,23 @@ sub illOpc($) {
     "\tjnz\tLOCAL(illegalOpcode)\n"
 }
 
-# add some cycles if slow mem
+# add some cycles if slow mem.  The count is for external memory
+# without wait states: 1 or 2 for byte accesses, 4 or 8 for word
+# accesses.  The real extra cycles come from the access cost tables
+# in memory.c.
 sub addSlowCycles {
     my $reg = $_[1] || "%eax";
     my $tmpreg = $_[2] || "c";
-    return
-	"\txorl\t%e${tmpreg}x,%e${tmpreg}x\n".
-	"\ttestb\t\$0x$FAST_PATTERN, EXTERN(memtype)($reg)\n".
-	"\tsetz\t%${tmpreg}l\n".
-	($_[0] == 1
+    my ($table, $count) = $_[0] >= 4
+	? ("mem_slow_word_cycles", $_[0] / 4)
+	: ("mem_slow_byte_cycles", $_[0]);
+    return
+	"\tmovl\t$reg,%e${tmpreg}x\n".
+	"\tshrl\t\$7,%e${tmpreg}x\n".
+	"\tmovzbl\tEXTERN($table)(%e${tmpreg}x),%e${tmpreg}x\n".
+	($count == 1
 	 ? "\taddl\t%e${tmpreg}x,%ebp\n"
-	 : "\tleal\t(%ebp,%e${tmpreg}x,$_[0]),%ebp\n");
+	 : "\tleal\t(%ebp,%e${tmpreg}x,$count),%ebp\n");
 }
 
 sub getNextCycle($) {
@@ -1070,7 +1076,7 @@ sub MovBTA8() {
 	
 	"\ttestb\t\$0x$WRITE_PATTERN, EXTERN(memtype)(%ecx)\n".
 	"\tjz\t5f\n".
-	"\ttestb\t\$0x24, EXTERN(memtype)(%ecx)\n".
+	"\ttestb\t\$0x34, EXTERN(memtype)(%ecx)\n".
 	"\tjnz\tLOCAL(clean_up)\n".              # should we handle motor bits???
 	"\tcmpl\t\$0xff88, %ecx\n".
 	"\tjb\tLOCAL(illegaladdr)\n".
@@ -1278,7 +1284,6 @@ sub build_case($$) {
 
     $opclen     = 2 + 2*$extraopclen;
     $cycles     = $opclen +  $extracycles;
-    $slowcycles = (6 - 2) * ($opclen/2);
 
     if ($noepilogue) {
 	$epilogue = "";
@@ -1294,10 +1299,10 @@ sub build_case($$) {
 
 	     ? "\taddl\t\$$opclen,%esi\n".
 	     ($cycles ? "\taddl\t\$$cycles,%ebp\n" : "").
-	     "\txorl\t%eax,%eax\n".
-	     "\ttestb\t\$0x$FAST_PATTERN, EXTERN(memtype)-$opclen(%esi)\n".
-	     "\tsetz\t%al\n".
-	     "\tleal\t(%ebp,%eax,$slowcycles),%ebp\n"
+	     "\tleal\t-$opclen(%esi),%eax\n".
+	     "\tshrl\t\$7,%eax\n".
+	     "\tmovzbl\tEXTERN(mem_slow_word_cycles)(%eax),%eax\n".
+	     "\tleal\t(%ebp,%eax,".($opclen/2)."),%ebp\n"
 
 	     : ($cycles ? "\taddl\t\$$cycles,%ebp\n" : "")).
 
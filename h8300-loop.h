@@ -0,0 +1,155 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+/* The main loop of the cpu.  h8300.c includes this file once for every
+ * variant of the loop.  Before it defines
+ *
+ *   CPU_LOOP         the name of the function
+ *   CPU_LOOP_LABEL   prefix for the assembler labels of the opcodes
+ *   CPU_LOOP_CHECKED 1 for the loop that checks breakpoints, watchpoints,
+ *                    log marks and single steps, 0 for the fast loop
+ *
+ * The loop returns after handling a trap or event when the other
+ * variant is needed, i.e. when CPU_NEEDS_CHECKS changed.  The other
+ * loop is then called with resume set and continues at that point.
+ */
+
+#if CPU_LOOP_CHECKED
+#define CHECKED(cond) (cond)
+#else
+#define CHECKED(cond) 0
+#endif
+
+static void CPU_LOOP(int resume) {
+    uint16 oldpc = pc;
+    uint8 opcval;
+    unsigned int opc, op;
+    block_insn *insn = &no_block;
+#ifdef THREADED_DISPATCH
+    static const void *const cpu_opctable[] = {
+#define CPU_OPCODE_TABLE
+#include "h8300-threaded.inc"
+#undef CPU_OPCODE_TABLE
+    };
+#endif
+
+#ifdef CPU_HAS_FAST_LOOP
+    if (resume)
+        goto resume;
+#endif
+    while (1) {
+        if (pc & 1)
+            db_trap = 10;
+        if (db_trap || CHECKED(db_singlestep)) {
+            if (CHECKED(db_singlestep)) {
+                oldpc = pc;
+                db_trap = TRAP_EXCEPTION;
+            }
+            if (0) {
+        trap:
+                if (db_singlestep_pc == oldpc) {
+                    db_singlestep_pc = 0xffff;
+                    db_singlestep = 1;
+                    if (!(db_singlestep_memtype & MEMTYPE_BREAKPOINT))
+                        mem_clear_type(oldpc, 1, MEMTYPE_BREAKPOINT);
+                }
+                db_trap = TRAP_EXCEPTION;
+        fault:
+                pc = oldpc;
+            }
+#ifdef HAVE_RUN_CPU_ASM
+        handletrap:
+#endif
+            FLUSH_CCR;
+            idle_effects++;
+            periph_handletrap();
+        }
+#ifdef CPU_HAS_FAST_LOOP
+        if (CPU_NEEDS_CHECKS != CPU_LOOP_CHECKED)
+            return;
+    resume:
+#endif
+
+        if (irq_disabled_one) {
+            irq_disabled_one = 0;
+
+        } else {
+
+#ifdef HAVE_RUN_CPU_ASM
+            if (!db_singlestep) {
+                FLUSH_CCR;
+#ifdef HAVE_RUN_CPU_JIT
+                run_cpu_jit();
+#else
+                run_cpu_asm();
+#endif
+                idle_effects++;
+                if (db_trap)
+                    goto handletrap;
+            }
+#endif
+            if (cycles >= (ccr & 0x80 ? next_nmi_cycle : next_timer_cycle)) {
+                idle_effects++;
+                if (!CHECKED(db_singlestep)) {
+                    check_irq();
+
+                } else {
+
+                    /* singlestep handling is a bit more difficult */
+                    db_singlestep_pc = pc;
+                    check_irq();
+                    if (db_singlestep_pc != pc) {
+                        /* interrupt occured: step over it */
+                        db_singlestep_memtype = memtype[db_singlestep_pc];
+                        mem_set_type(db_singlestep_pc, 1,
+                                     MEMTYPE_BREAKPOINT);
+                        cpu_invalidate_code(db_singlestep_pc, 2);
+                        db_singlestep = 0;
+                    }
+                }
+                continue;
+            }
+        }
+
+        FETCH_OPCODE;
+#ifdef DEBUG_CPU
+        printf ("Exec %04x: %04x\n", pc-2, opc);
+#endif
+
+#define MAKE_LABEL(label) __asm__ ("\n.L" CPU_LOOP_LABEL label ":\n")
+#ifdef THREADED_DISPATCH
+        goto *cpu_opctable[op];
+#include "h8300-threaded.inc"
+    illOpc:
+        db_trap = ILLOPC_EXCEPTION;
+        goto fault;
+#else
+        switch(op) {
+#include "h8300.inc"
+        default:
+        illOpc:
+            db_trap = ILLOPC_EXCEPTION;
+            goto fault;
+        }
+#endif
+#undef MAKE_LABEL
+    }
+}
+
+#undef CHECKED
@@ -45,11 +45,11 @@
 #
 #################
 
-$WRITE_PATTERN = "a4";
+$WRITE_PATTERN = "b4";   # writes to predecoded code go through C
 $FAST_PATTERN  = "40";
 $READ_PATTERN  = "88";
 $CODE_PATTERN  = "80";   # don't check for breakpoint on second word
-$READWRITE_PATTERN ="ac";
+$READWRITE_PATTERN ="bc";
 
 $destreg = "\%o5";
 $destval = "\%o1";
@@ -1110,7 +1110,7 @@ sub MovBTA8() {
 	
 	"\ttestb\t\$0x$WRITE_PATTERN, EXTERN(memtype)(%ecx)\n".
 	"\tjz\t5f\n".
-	"\ttestb\t\$0x24, EXTERN(memtype)(%ecx)\n".
+	"\ttestb\t\$0x34, EXTERN(memtype)(%ecx)\n".
 	"\tjnz\tclean_up\n".              # should we handle motor bits???
 	"\tcmpl\t\$0xff88, %ecx\n".
 	"\tjb\tillegaladdr\n".
@@ -0,0 +1,265 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+/** \file h8300-x86-64-jit.c
+ * \brief copy-and-patch translator for the x86-64 assembler core
+ *
+ * A basic block is translated by copying the opcode templates generated
+ * by h8300-x86-64.pl behind each other.  Each copy is preceded by a check
+ * for the next event and by two instructions that load the opcode bytes
+ * into %ecx and %edx, the way the dispatcher of run_cpu_asm does.  The
+ * rel32 operands of jumps leaving a template are adjusted to the new
+ * location.  Blocks end at control flow opcodes; their exits jump to
+ * jit_link_exit until the target block is known, then they are patched
+ * to jump there directly.
+ *
+ * Opcodes without template, breakpoints and log points end a block.
+ * Memory traps are checked by the templates, which leave to the C
+ * interpreter in that case.  Everything is thrown away when translated
+ * code is modified.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "h8300.h"
+#include "memory.h"
+
+#define JIT_BUFFER_SIZE  (4 << 20)
+/** \brief space that must be left in the buffer before translating a block */
+#define JIT_BLOCK_SPACE  0x10000
+#define JIT_MAX_INSNS    32
+
+/** \brief an opcode template; relocs lists the end offsets of its
+ *  rel32 operands and is 0 terminated.
+ */
+typedef struct {
+    uint8 *start;
+    uint8 *end;
+    uint32 *relocs;
+} jit_template;
+
+extern jit_template jit_templates[256];
+extern uint8 jit_exit[], jit_dispatch[], jit_link_exit[];
+
+extern uint8 *jit_link(uint8 *slot, uint32 addr);
+
+/** \brief translated block for each even pc; jit_exit if it can't be
+ *  translated.  Indexed by pc/2 from h8300-x86-64.S.
+ */
+uint8 *jit_map[0x8000];
+
+static uint8 jit_buffer[JIT_BUFFER_SIZE] __attribute__((aligned(4096)));
+static uint8 *jit_top = jit_buffer;
+static int jit_state;             /* 0: not initialized, 1: ok, -1: off */
+static int jit_generation;
+static int jit_used;
+
+static uint8 *put32(uint8 *p, uint32 val) {
+    memcpy(p, &val, 4);
+    return p + 4;
+}
+
+static uint8 *put_rel32(uint8 *p, uint8 *target) {
+    return put32(p, target - (p + 4));
+}
+
+static int opcode_len(uint8 op) {
+    switch (op) {
+    case 0x5a: case 0x5e: case 0x6a: case 0x6b: case 0x6e: case 0x6f:
+    case 0x79: case 0x7b: case 0x7c: case 0x7d: case 0x7e: case 0x7f:
+        return 4;
+    }
+    return 2;
+}
+
+static void jit_flush(void) {
+    memset(jit_map, 0, sizeof(jit_map));
+    jit_top = jit_buffer;
+    jit_generation++;
+    jit_used = 0;
+}
+
+static int jit_init(void) {
+    if (mprotect(jit_buffer, JIT_BUFFER_SIZE,
+                 PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+        perror("JIT disabled: mprotect");
+        return -1;
+    }
+    return 1;
+}
+
+/** \brief emit an exit to the given H8 address and remember it for
+ *  later chaining.
+ */
+static uint8 *emit_exit(uint8 *p, uint8 **slot, uint32 *target, int *nexits,
+                        uint32 addr) {
+    slot[*nexits] = p;
+    target[(*nexits)++] = addr;
+    return p + 4;
+}
+
+static uint8 *jit_translate(uint16 start) {
+    uint8 *code, *p, *tpl;
+    uint8 *slot[2];
+    uint32 target[2];
+    uint32 *r;
+    uint32 addr = start;
+    int nexits = 0;
+    int branch = 0;
+    int n, i, len, size;
+    uint8 op;
+
+    if (jit_state == 0)
+        jit_state = jit_init();
+    if (jit_state < 0)
+        return jit_exit;
+    if (jit_top + JIT_BLOCK_SPACE > jit_buffer + JIT_BUFFER_SIZE)
+        jit_flush();
+    jit_used = 1;
+
+    code = p = jit_top;
+    for (n = 0; n < JIT_MAX_INSNS; n++) {
+        op = memory[addr];
+        len = opcode_len(op);
+        if ((memtype[addr] & (MEMTYPE_BREAKPOINT | MEMTYPE_LOG | MEMTYPE_DIV))
+            || (memtype[addr + 1] & MEMTYPE_BREAKPOINT)
+            || !jit_templates[op].start || addr + len > 0x10000)
+            break;
+
+        /* test %r9,%r9; jns jit_exit */
+        *p++ = 0x4d; *p++ = 0x85; *p++ = 0xc9;
+        *p++ = 0x0f; *p++ = 0x89; p = put_rel32(p, jit_exit);
+        /* movl $op,%ecx; movl $opcval,%edx */
+        *p++ = 0xb9; p = put32(p, op);
+        *p++ = 0xba; p = put32(p, memory[addr + 1]);
+
+        tpl = jit_templates[op].start;
+        size = jit_templates[op].end - tpl;
+        memcpy(p, tpl, size);
+        for (r = jit_templates[op].relocs; *r; r++) {
+            int32 rel;
+            memcpy(&rel, p + *r - 4, 4);
+            put32(p + *r - 4, rel + (tpl - p));
+        }
+        p += size;
+
+        mem_set_type(addr, len, MEMTYPE_CODE);
+        addr += len;
+
+        if (op >= 0x40 && op < 0x60) {
+            branch = 1;
+            break;
+        }
+    }
+
+    if (n == 0) {
+        /* remember that we can't translate it */
+        mem_set_type(start, 2, MEMTYPE_CODE);
+        jit_map[start >> 1] = jit_exit;
+        return jit_exit;
+    }
+
+    if (!branch) {
+        /* fall through to the next block */
+        *p++ = 0xe9;
+        p = emit_exit(p, slot, target, &nexits, addr);
+    } else {
+        uint16 opc_pc = addr - len;
+        switch (op) {
+        case 0x40: /* bra */
+        case 0x55: /* bsr */
+            *p++ = 0xe9;
+            p = emit_exit(p, slot, target, &nexits,
+                          addr + (int8) memory[opc_pc + 1]);
+            break;
+        case 0x41: /* brn */
+            *p++ = 0xe9;
+            p = emit_exit(p, slot, target, &nexits, addr);
+            break;
+        case 0x5a: /* jmp @aa:16 */
+        case 0x5e: /* jsr @aa:16 */
+            *p++ = 0xe9;
+            p = emit_exit(p, slot, target, &nexits,
+                          (memory[opc_pc + 2] << 8) | memory[opc_pc + 3]);
+            break;
+        case 0x54: /* rts */
+        case 0x56: /* rte */
+        case 0x59: /* jmp @Rn */
+        case 0x5d: /* jsr @Rn */
+            *p++ = 0xe9;
+            p = put_rel32(p, jit_dispatch);
+            break;
+        default:   /* bcc: cmpl $taken,%esi; jne fallthrough; jmp taken */
+            *p++ = 0x81; *p++ = 0xfe;
+            p = put32(p, addr + (int8) memory[opc_pc + 1]);
+            *p++ = 0x0f; *p++ = 0x85;
+            p = emit_exit(p, slot, target, &nexits, addr);
+            *p++ = 0xe9;
+            p = emit_exit(p, slot, target, &nexits,
+                          addr + (int8) memory[opc_pc + 1]);
+            break;
+        }
+    }
+
+    /* movl $slot,%edi; jmp jit_link_exit */
+    for (i = 0; i < nexits; i++) {
+        if (target[i] >= 0x10000 || (target[i] & 1)) {
+            put_rel32(slot[i], jit_exit);
+            continue;
+        }
+        put_rel32(slot[i], p);
+        *p++ = 0xbf; p = put32(p, (uint32) (uintptr_t) slot[i]);
+        *p++ = 0xe9; p = put_rel32(p, jit_link_exit);
+    }
+
+    jit_top = p;
+    jit_map[start >> 1] = code;
+    return code;
+}
+
+/** \brief find or translate the block at addr and chain the exit at slot
+ *  to it.  Called by jit_link_exit and jit_dispatch.
+ */
+uint8 *jit_link(uint8 *slot, uint32 addr) {
+    int generation = jit_generation;
+    uint8 *code = jit_map[addr >> 1];
+
+    if (!code)
+        code = jit_translate(addr);
+    if (slot && generation == jit_generation)
+        put_rel32(slot, code);
+    return code;
+}
+
+/** \brief drop all translated code if the range contains some.
+ *  Called by cpu_invalidate_code before it clears the MEMTYPE_CODE bits.
+ */
+void jit_invalidate_code(uint16 addr, int len) {
+    int i;
+
+    if (!jit_used)
+        return;
+    for (i = addr; i < addr + len && i < 0x10000; i++) {
+        if (memtype[i] & MEMTYPE_CODE) {
+            jit_flush();
+            return;
+        }
+    }
+}
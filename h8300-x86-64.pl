@@ -45,11 +45,11 @@
 #
 #################
 
-$WRITE_PATTERN = "a4";
+$WRITE_PATTERN = "b4";   # writes to predecoded code go through C
 $FAST_PATTERN  = "40";
 $READ_PATTERN  = "88";
 $CODE_PATTERN  = "80";   # don't check for breakpoint on second word
-$READWRITE_PATTERN ="ac";
+$READWRITE_PATTERN ="bc";
 
 
 sub getWRdAddr() {
@@ -178,17 +178,23 @@ sub illOpc($) {
     "\tjnz\tLOCAL(illegalOpcode)\n"
 }
 
-# add some cycles if slow mem
+# add some cycles if slow mem.  The count is for external memory
+# without wait states: 1 or 2 for byte accesses, 4 or 8 for word
+# accesses.  The real extra cycles come from the access cost tables
+# in memory.c.
 sub addSlowCycles {
     my $reg = $_[1] || "%rax";
     my $tmpreg = $_[2] || "c";
-    return
-	"\txorl\t%e${tmpreg}x,%e${tmpreg}x\n".
-	"\ttestb\t\$0x$FAST_PATTERN, EXTERN(memtype)($reg)\n".
-	"\tsetz\t%${tmpreg}l\n".
-	($_[0] == 1
+    my ($table, $count) = $_[0] >= 4
+	? ("mem_slow_word_cycles", $_[0] / 4)
+	: ("mem_slow_byte_cycles", $_[0]);
+    return
+	"\tmovq\t$reg,%r${tmpreg}x\n".
+	"\tshrl\t\$7,%e${tmpreg}x\n".
+	"\tmovzbl\tEXTERN($table)(%r${tmpreg}x),%e${tmpreg}x\n".
+	($count == 1
 	 ? "\taddq\t%r${tmpreg}x,%r9\n"
-	 : "\tleaq\t(%r9,%r${tmpreg}x,$_[0]),%r9\n");
+	 : "\tleaq\t(%r9,%r${tmpreg}x,$count),%r9\n");
 }
 
 sub getNextCycle($) {
@@ -307,7 +313,7 @@ sub Sleep() {
 }
 
 sub Trap() {
-    $goto="trap";
+    $goto="clean_up";     # C code advances pc before reporting the trap
 }
 
 ######### Arithmetic instructions ########################
@@ -316,7 +322,7 @@ sub AddSubCommon($) {
     my ($ext, $x, $w, $h, $l, $mask, $add, $adc, $opc, $setRd);
     $opc = $_[0];
 
-    if ($opc !~ /W/) {
+    if ($opc !~ /W/ && !$jit) {
 	if ($common{$opc}) {
 	    $noepilogue = 1;
 	    return "\tjmp\tLOCAL($common{$opc})\n";
@@ -346,7 +352,7 @@ sub AddSubCommon($) {
 
     return
 	($opc =~ /W/ ? "" 
-	 : "LOCAL($common{$opc}):\n".
+	 : ($jit ? "" : "LOCAL($common{$opc}):\n").
 	   "\tandl\t\$0xf,%ecx\n").
 
 	(!$ext ? "\t${addcmd}\n"               # do addition/subtraction
@@ -517,23 +523,27 @@ my @bitops =
 	[0x72, "BClrI", &BClrI] ] );
 
 sub BitAbs1() {
-    $noepilogue=1;
+    $noepilogue=1 unless $jit;
     return
 	"\txorl\t%eax,%eax\n".
 	"\tmovsbw\t%dl,%ax\n".
-	"\tjmp\tLOCAL(bitops1)\n";
+	($jit ? BitOps1() : "\tjmp\tLOCAL(bitops1)\n");
 }
 
 sub BitInd1() {
-    $extraopclen++;
-    $extracycles+=4;
     return
 	illOpc(0x8f).
 	"\tshrl\t\$4,%edx\n".
 	"\txorl\t%eax,%eax\n".
 	"\tmovb\tEXTERN(reg)+8(%rdx),%al\n".
 	"\tmovb\tEXTERN(reg)(%rdx),%ah\n".
+	BitOps1();
+}
 
+sub BitOps1() {
+    $extraopclen++;
+    $extracycles+=4;
+    return
 	"LOCAL(bitops1):\n".
 
 	"\ttestb\t\$0x$CODE_PATTERN,EXTERN(memtype)+2(%rsi)\n".
@@ -686,17 +696,37 @@ sub BTst() {
 
 ######### Branch instructions ########################
 
-sub BRA() {
-    $extracycles = 2;
-    return 
-	"LOCAL(do_bra):\n".
+sub doBra() {
+    return
 	illOpc(0x01).
 	addSlowCycles(4, "%rsi").            # add 4 cycles if slow mem
 	"\tmovsbl\t%dl, %edx\n".
 	"\taddl\t%edx, %esi\n";
 }
+
+# conditional jump to do_bra; jit templates carry their own copy of it
+sub branchTo($) {
+    my $jcc = $_[0];
+    return
+	"\t$jcc\tLOCAL(do_bra)\n".
+	addSlowCycles(4, "%rsi")             # add 4 cycles if slow mem
+	unless $jit;
+    return
+	"\t$jcc\t3f\n".
+	addSlowCycles(4, "%rsi").
+	"\tjmp\t4f\n".
+	"3:\n".
+	doBra().
+	"4:\n";
+}
+
+sub BRA() {
+    $extracycles = 2;
+    return 
+	"LOCAL(do_bra):\n".
+	doBra();
+}
 sub BRN() {
-    $goto="default_epilogue";
     $extracycles = 2;
     return
 	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
@@ -704,62 +734,52 @@ sub BRN() {
 sub BHI() {
     $extracycles = 2;
     return "\ttestb\t\$5,%bl\n".
-	"\tjz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jz");
 }
 sub BLO() {
     $extracycles = 2;
     return "\ttestb\t\$5,%bl\n".
-	"\tjnz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jnz");
 }
 sub BCC() {
     $extracycles = 2;
     return "\ttestb\t\$1,%bl\n".
-	"\tjz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jz");
 }
 sub BCS() {
     $extracycles = 2;
     return "\ttestb\t\$1,%bl\n".
-	"\tjnz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jnz");
 }
 sub BNE() {
     $extracycles = 2;
     return "\ttestb\t\$4,%bl\n".
-	"\tjz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jz");
 }
 sub BEQ() {
     $extracycles = 2;
     return "\ttestb\t\$4,%bl\n".
-	"\tjnz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jnz");
 }
 sub BVC() {
     $extracycles = 2;
     return "\ttestb\t\$2,%bl\n".
-	"\tjz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jz");
 }
 sub BVS() {
     $extracycles = 2;
     return "\ttestb\t\$2,%bl\n".
-	"\tjnz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jnz");
 }
 sub BPL() {
     $extracycles = 2;
     return "\ttestb\t\$8,%bl\n".
-	"\tjz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jz");
 }
 sub BMI() {
     $extracycles = 2;
     return "\ttestb\t\$8,%bl\n".
-	"\tjnz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jnz");
 }
 sub BGE() {
     $extracycles = 2;
@@ -767,8 +787,7 @@ sub BGE() {
 	"\tshrb\t\$2,%al\n".
 	"\txorb\t%bl,%al\n".
 	"\tandb\t\$2,%al\n".
-	"\tjz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jz");
 }
 sub BLT() {
     $extracycles = 2;
@@ -776,8 +795,7 @@ sub BLT() {
 	"\tshrb\t\$2,%al\n".
 	"\txorb\t%bl,%al\n".
 	"\tandb\t\$2,%al\n".
-	"\tjnz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jnz");
 }
 sub BGT() {
     $extracycles = 2;
@@ -786,8 +804,7 @@ sub BGT() {
 	"\tandb\t\$2,%al\n".
 	"\txorb\t%bl,%al\n".
 	"\tandb\t\$6,%al\n".
-	"\tjz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jz");
 }
 sub BLE() {
     $extracycles = 2;
@@ -796,18 +813,17 @@ sub BLE() {
 	"\tandb\t\$2,%al\n".
 	"\txorb\t%bl,%al\n".
 	"\tandb\t\$6,%al\n".
-	"\tjnz\tLOCAL(do_bra)\n".
-	addSlowCycles(4, "%rsi");            # add 4 cycles if slow mem
+	branchTo("jnz");
 }
 
 sub JmpRI() {
-    $noepilogue=1;
+    $noepilogue=1 unless $jit;
     return
 	illOpc(0x8f).
 	"\tshrl\t\$4,%edx\n".
 	"\tmovb\tEXTERN(reg)(%rdx),%ch\n".
 	"\tmovb\tEXTERN(reg)+8(%rdx),%cl\n".
-	"\tjmp\tLOCAL(jmpcommon)\n";
+	($jit ? JmpCommon() : "\tjmp\tLOCAL(jmpcommon)\n");
 }
 
 sub JmpCommon() {
@@ -863,22 +879,22 @@ sub JsrCommon() {
 }
 
 sub BSr() {
-    $noepilogue=1;
+    $noepilogue=1 unless $jit;
     return
 	"\tmovsbl\t%dl,%eax\n".
 	"\tleal\t2(%rsi),%edx\n".
 	"\taddl\t%edx,%eax\n".
-	"\tjmp\tLOCAL(jsrcommon)\n";
+	($jit ? JsrCommon() : "\tjmp\tLOCAL(jsrcommon)\n");
 }
 
 sub JsrRI() {
-    $noepilogue=1;
+    $noepilogue=1 unless $jit;
     return
 	illOpc(0x8f).
 	"\txorl\t%eax,%eax\n".
 	getWRsNoMask().
 	"\tleal\t2(%rsi),%edx\n".
-	"\tjmp\tLOCAL(jsrcommon)\n";
+	($jit ? JsrCommon() : "\tjmp\tLOCAL(jsrcommon)\n");
 }
 sub JsrA16() {
     return
@@ -886,7 +902,7 @@ sub JsrA16() {
 	getWOpc.
 	"\taddq\t\$2,%r9\n".                  # internal cycles
 	"\tleal\t4(%rsi),%edx\n".
-	"LOCAL(jsrcommon:)\n".
+	"LOCAL(jsrcommon):\n".
 	JsrCommon();
 }
 
@@ -956,7 +972,7 @@ sub MovBCore {
 	"1:\n".
 	readB().
 	setBRm().
-	($_[0] =~ /P/ ? "\taddl\t\$1,%eax\n".setWRs() : "").
+	($_[0] =~ /P/ ? "\taddl\t\$1,%eax\n".setWRs()."\tsubl\t\$1,%eax\n" : "").
 	"2:\n".
 	addSlowCycles(1, "%rax", "d").        # add 1 cycle if slow mem
 	"\tandb\t\$0xf1,%bl\n".
@@ -981,7 +997,7 @@ sub MovWCore {
 	"1:\n".
 	readW().
 	setWRd().
-	($_[0] =~ /P/ ? "\taddl\t\$2,%eax\n".setWRs() : "").
+	($_[0] =~ /P/ ? "\taddl\t\$2,%eax\n".setWRs()."\tsubl\t\$2,%eax\n" : "").
 	"2:\n".
 	addSlowCycles(4, "%rax", "d").         # add 4 cycles if slow mem
 	"\tandb\t\$0xf1,%bl\n".
@@ -1057,7 +1073,7 @@ sub MovBTA8() {
 	
 	"\ttestb\t\$0x$WRITE_PATTERN, EXTERN(memtype)(%rcx)\n".
 	"\tjz\t5f\n".
-	"\ttestb\t\$0x24, EXTERN(memtype)(%rcx)\n".
+	"\ttestb\t\$0x34, EXTERN(memtype)(%rcx)\n".
 	"\tjnz\tLOCAL(clean_up)\n".              # should we handle motor bits???
 	"\tcmpl\t\$0xff88, %ecx\n".
 	"\tjb\tLOCAL(illegaladdr)\n".
@@ -1262,41 +1278,97 @@ sub build_case($$) {
 
     return if ($goto ne "opc$hex");
 
+    $epilogue = epilogue();
+
+    return
+	"# ($func)\n".
+	"\t.align 16\n".
+	"LOCAL(opc$hex):\n".
+	$case.
+	$epilogue.
+	$helper;
+}
+
+# advance pc and cycles; jit templates fall through to the next opcode
+sub epilogue() {
     $opclen     = 2 + 2*$extraopclen;
     $cycles     = $opclen +  $extracycles;
-    $slowcycles = (6 - 2) * ($opclen/2);
 
     if ($noepilogue) {
-	$epilogue = "";
-    } elsif(!$extracycles && !$extraopclen) {
-	$epilogue = "\tjmp\tLOCAL(default_epilogue)\n";
-    } elsif (!$extraopclen) {
-	$epilogue = 
+	return "";
+    } elsif (!$jit && !$extracycles && !$extraopclen) {
+	return "\tjmp\tLOCAL(default_epilogue)\n";
+    } elsif (!$jit && !$extraopclen) {
+	return
 	    "\taddq\t\$$cycles,%r9\n".
 	    "\tjmp\tLOCAL(default_epilogue_nocycles)\n";
-    } else {
-	$epilogue =
-	    ($opclen 
+    }
+    return
+	($opclen 
+
+	 ? "\taddl\t\$$opclen,%esi\n".
+	 ($cycles ? "\taddq\t\$$cycles,%r9\n" : "").
+	 "\tleal\t-$opclen(%rsi),%eax\n".
+	 "\tshrl\t\$7,%eax\n".
+	 "\tmovzbl\tEXTERN(mem_slow_word_cycles)(%rax),%eax\n".
+	 "\tleaq\t(%r9,%rax,".($opclen/2)."),%r9\n"
 
-	     ? "\taddl\t\$$opclen,%esi\n".
-	     ($cycles ? "\taddq\t\$$cycles,%r9\n" : "").
-	     "\txorl\t%eax,%eax\n".
-	     "\ttestb\t\$0x$FAST_PATTERN, EXTERN(memtype)-$opclen(%rsi)\n".
-	     "\tsetz\t%al\n".
-	     "\tleaq\t(%r9,%rax,$slowcycles),%r9\n"
+	 : ($cycles ? "\taddq\t\$$cycles,%r9\n" : "")).
+
+	($jit ? "" : "\tjmp\tLOCAL(loop)\n");
+}
+
+#################
+#
+# The JIT in h8300-x86-64-jit.c copies these templates behind each other to
+# build a basic block.  Before each template it loads %ecx and %edx with
+# the opcode bytes.  A template must not jump to shared code; all jumps
+# that leave the template are rel32 (the templates live in their own
+# section) and are listed in the relocation table, so that they can be
+# adjusted after copying.
+#
+#################
+
+sub build_template($$) {
+    my ($hex, $func) = @_;
+    my (%own, $text, $relocs, $n);
+    $noepilogue  = 0;
+    $extraopclen = 0;
+    $extracycles = 0;
+    $goto = "opc$hex";
+    $case = &$func();
 
-	     : ($cycles ? "\taddq\t\$$cycles,%r9\n" : "")).
+    return "" if ($goto ne "opc$hex" || $noepilogue);
 
-	    "\tjmp\tLOCAL(loop)\n";
+    if ($hex =~ /x/) {
+	$val = hex (substr($hex,0,1)."0");
+	for ($i = 0; $i < 16; $i++) {
+	    $jittable[$val+$i] = "jit_$hex";
+	}
+    } else {
+	$jittable[hex $hex] = "jit_$hex";
     }
 
+    $text = $case.epilogue();
+    $own{$1} = 1 while ($text =~ /LOCAL\((\w+)\):/g);
+    $text =~ s/LOCAL\((\w+)\)/$own{$1} ? "LOCAL(jit_${hex}_$1)" : "LOCAL($1)"/ge;
+
+    $n = 0;
+    $relocs = "LOCAL(jit_${hex}_relocs):\n";
+    $text = join "", map {
+	if (/^\s*(j[a-z]+|call)\s+(LOCAL|EXTERN)\((\w+)\)/ && $3 !~ /^jit_/) {
+	    $relocs .= "\t.long\tLOCAL(jit_${hex}_r$n)-LOCAL(jit_$hex)\n";
+	    $_ .= "LOCAL(jit_${hex}_r".($n++)."):\n";
+	}
+	$_;
+    } split /^/, $text;
+    $jitrelocs .= $relocs."\t.long\t0\n";
+
     return
 	"# ($func)\n".
-	"\t.align 16\n".
-	"LOCAL(opc$hex):\n".
-	$case.
-	$epilogue.
-	$helper;
+	"LOCAL(jit_$hex):\n".
+	$text.
+	"LOCAL(jit_${hex}_end):\n";
 }
 
 @opctable = ("illegalOpcode") x 256;
@@ -1305,11 +1377,23 @@ while (<DATA>) {
     $_ =~ /([0-9a-fA-F][0-9a-fA-FxX])=(\w+)/ or next;
     $hex = $1;
     $func = $2;
+    push @cases, [$hex, $func];
     print build_case($hex, $func);
 }
 
+$jit = 1;
+print "\t.section\t.text.jit,\"ax\",\@progbits\n";
+print build_template($_->[0], $_->[1]) foreach (@cases);
+
 print "\t.section\t.rodata\nopctable:\n";
 print "\t.long\tLOCAL($_)\n" foreach (@opctable);
+
+print "\n\t.align\t8\n$jitrelocs";
+print "\n\t.align\t8\n.globl\tEXTERN(jit_templates)\nEXTERN(jit_templates):\n";
+foreach (@jittable[0..255]) {
+    print $_ ? "\t.quad\tLOCAL($_), LOCAL(${_}_end), LOCAL(${_}_relocs)\n"
+	     : "\t.quad\t0, 0, 0\n";
+}
 	   
 print "\niflags2ccr:";
 for ($i = 0; $i< 0x1000; $i++) {
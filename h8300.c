@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "h8300.h"
 #include "memory.h"
 #include "peripherals.h"
@@ -34,54 +35,348 @@
 #define BP_EXEC  0x0101
 #define BP_READ  0x0808
 #define BP_WRITE 0x0404
+#define BP_DIV   0x8080
 
-uint8  reg[16];
-uint16 pc;
-uint8  ccr;
+#ifdef HAVE_RUN_CPU_ASM
+BRICK_LOCAL uint8  reg[16];
+#else
+BRICK_LOCAL h8300_regs reg;
+#endif
+BRICK_LOCAL uint16 pc;
+BRICK_LOCAL uint8  ccr;
+
+BRICK_LOCAL cycle_count_t cycles, next_timer_cycle, next_nmi_cycle;
+BRICK_LOCAL int irq_disabled_one;
+BRICK_LOCAL volatile int db_trap;
+BRICK_LOCAL int db_singlestep;
+static BRICK_LOCAL uint16 db_singlestep_pc;
+static BRICK_LOCAL uint8 db_singlestep_memtype;
+
+/** \brief number of cycles skipped by the idle loop detection */
+BRICK_LOCAL cycle_count_t idle_cycles_skipped;
+
+/* Condition codes.  The generated opcodes set them with SET_HNZVC and
+ * SET_NZV; byte values are passed shifted left by 8, so the same
+ * formulas work for both sizes.  With LAZY_FLAGS these macros only store
+ * their operands and result in flag_* and the bits of ccr they own are
+ * computed by FLUSH_CCR when an opcode or one of the peripherals reads
+ * ccr.  Everything outside of run_cpu calls cpu_flush_ccr first.
+ */
+#define FLAGS_NZ   0x01         /* N and Z from flag_res */
+#define FLAGS_HC   0x02         /* H and C from flag_oval, flag_src, flag_dst */
+#define FLAGS_V    0x04         /* V from flag_oval, flag_src, flag_dst */
+#define FLAGS_BORROW 0x08       /* the operands belong to a subtraction */
+#define FLAGS_ADD  (FLAGS_NZ | FLAGS_HC | FLAGS_V)
+#define FLAGS_SUB  (FLAGS_ADD | FLAGS_BORROW)
+
+/* H, V and C bits of an addition or subtraction */
+#define CALC_HVC(op, oval, src, dest) \
+    (((((src) ^ (dest) ^ (oval)) >> 7) & 0x20) \
+     | ((op) & FLAGS_BORROW \
+        ? (((((src) ^ (oval)) & ((dest) ^ (oval))) >> 14) & 0x02) \
+          | ((((src) ^ (((src) ^ (dest)) & ((dest) ^ (oval)))) >> 15) & 0x01) \
+        : (((((src) ^ (dest)) & ((dest) ^ (oval))) >> 14) & 0x02) \
+          | ((((src) ^ (((src) ^ (oval)) & ((dest) ^ (oval)))) >> 15) & 0x01)))
+
+/* N and Z bits of a result */
+#define CALC_NZ(res) \
+    ((((res) >> 12) & 0x08) | ((res) == 0 ? 0x04 : 0))
+
+#ifdef LAZY_FLAGS
+static BRICK_LOCAL int flag_op;
+static BRICK_LOCAL uint16 flag_res, flag_oval, flag_src, flag_dst;
+
+#define SET_HNZVC(op, oval, src, dest) \
+    (flag_oval = (oval), flag_src = (src), \
+     flag_res = flag_dst = (dest), flag_op = (op))
+
+#define SET_NZV(dest) \
+    (flag_res = (dest), flag_op = (flag_op & ~FLAGS_V) | FLAGS_NZ, \
+     ccr &= ~0x02)
+
+#define FLAG_Z  (flag_op & FLAGS_NZ ? flag_res == 0 : ccr & 0x04)
+#define FLAG_N  (flag_op & FLAGS_NZ ? flag_res & 0x8000 : ccr & 0x08)
+
+#define FLUSH_CCR \
+    do { if (flag_op) flush_ccr(); } while (0)
+
+static void flush_ccr(void) {
+    uint8 mask = 0;
+
+    if (flag_op & FLAGS_HC)
+        mask |= 0x21;
+    if (flag_op & FLAGS_V)
+        mask |= 0x02;
+    if (mask)
+        ccr = (ccr & ~mask)
+            | (CALC_HVC(flag_op, flag_oval, flag_src, flag_dst) & mask);
+    if (flag_op & FLAGS_NZ)
+        ccr = (ccr & ~0x0c) | CALC_NZ(flag_res);
+    flag_op = 0;
+}
+#else
+#define SET_HNZVC(op, oval, src, dest) \
+    (ccr = (ccr & 0xd0) | CALC_HVC(op, oval, src, dest) | CALC_NZ(dest))
+
+#define SET_NZV(dest) \
+    (ccr = (ccr & 0xf1) | CALC_NZ(dest))
+
+#define FLAG_Z  (ccr & 0x04)
+#define FLAG_N  (ccr & 0x08)
+
+#define FLUSH_CCR do { } while (0)
+#endif
+
+/* only directly after SET_NZV */
+#define SET_V   (ccr |= 0x02)
+
+/** \brief number of slots in the basic block cache (power of two) */
+#define BLOCK_CACHE_SIZE 4096
+/** \brief maximum number of instructions in a cached basic block */
+#define BLOCK_MAX_INSNS  16
+/** \brief maximum number of bytes covered by a cached basic block */
+#define BLOCK_MAX_BYTES  (4 * BLOCK_MAX_INSNS)
+/** \brief pc value of instruction slots that never match */
+#define BLOCK_NO_PC      0x10000
+
+/* flags for insn_flags */
+#define INSN_LONG        0x01   /* four byte instruction */
+#define INSN_ENDS_BLOCK  0x02   /* branch, sleep, trap or illegal opcode */
+
+/** \brief a predecoded instruction inside a basic block
+ *
+ * Only the opcode word and its fetch cycles are cached, not the
+ * decoded operands; the handlers still decode the operands from opc
+ * and fetch a second word themselves.  The cache saves the breakpoint
+ * test, the memtype lookup and the cycle computation per instruction
+ * and lets the threaded core dispatch fused sequences.
+ */
+typedef struct {
+    /** \brief address of the instruction or BLOCK_NO_PC */
+    uint32 pc;
+    /** \brief the first opcode word */
+    uint16 opc;
+    /** \brief cycles needed to fetch the opcode word */
+    uint8  cycles;
+    /** \brief handler to dispatch to, opc >> 8 or a fused sequence */
+    uint16 op;
+} block_insn;
+
+/** \brief a predecoded basic block
+ *
+ * The instructions are terminated by an entry with pc BLOCK_NO_PC.
+ */
+typedef struct {
+    /** \brief start address of the block or BLOCK_NO_PC if unused */
+    uint32 start;
+    /** \brief first address after the last decoded byte */
+    uint32 end;
+    block_insn insn[BLOCK_MAX_INSNS + 1];
+} code_block;
 
-cycle_count_t cycles, next_timer_cycle, next_nmi_cycle;
-int irq_disabled_one;
-volatile int db_trap;
-int db_singlestep;
-static uint16 db_singlestep_pc;
-static uint8 db_singlestep_memtype;
+/** \brief direct mapped cache of basic blocks indexed by start pc */
+static BRICK_LOCAL code_block block_cache[BLOCK_CACHE_SIZE];
+
+/** \brief instruction slot returned when there is no usable block */
+static block_insn no_block = { BLOCK_NO_PC, 0, 0, 0 };
+
+/** \brief decoding information for the first opcode byte */
+static BRICK_LOCAL uint8 insn_flags[256];
 
 #ifdef HAVE_RUN_CPU_ASM
+#ifdef MULTI_BRICK
+#error "The assembler cores don't support thread local state"
+#endif
 extern void run_cpu_asm(void);
 #endif
 
+/* With GCC's labels as values run_cpu dispatches through a table of
+ * handlers generated by "h8300.pl threaded".  The assembler cores return
+ * to their own loop after each opcode, so they keep the switch.
+ */
+#if defined(__GNUC__) && !defined(HAVE_RUN_CPU_ASM) \
+    && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+#ifdef THREADED_DISPATCH
+/** \brief a superinstruction, see h8300-fusion.dat
+ *
+ * The handler op runs the first instruction and jumps directly to the
+ * handler of the rest of the sequence.  first holds the first opcode
+ * bytes, with OPCODE_GROUP applied.
+ */
+typedef struct {
+    uint16 op;
+    uint8  len;
+    uint8  first[3];
+} fused_sequence;
+
+static const fused_sequence fused_sequences[] = {
+#define CPU_FUSED_SEQUENCES
+#include "h8300-threaded.inc"
+#undef CPU_FUSED_SEQUENCES
+    { 0, 0, { 0 } }
+};
+
+/** \brief opcodes 2x, 3x and 8x-Fx share one threaded handler */
+#define OPCODE_GROUP(op) \
+    ((op) >= 0x80 || ((op) & 0xe0) == 0x20 ? (op) | 0x0f : (op))
+#endif
+
+#ifdef PROFILE_SEQUENCES
+#define COUNT_OPCODE \
+    frame_opcstat[opc>>8]++; \
+    frame_count_sequence(opc >> 8)
+#else
+#define COUNT_OPCODE frame_opcstat[opc>>8]++
+#endif
+
+/* Only pages containing a breakpoint, watchpoint or I/O register need
+ * a look at the memtype of the accessed bytes.  A word may reach into
+ * the next page.
+ */
+#define PAGE_HAS(addr, type) \
+    (MEM_PAGE(addr)->types & (type))
+#define WORD_PAGE_HAS(addr, type) \
+    (PAGE_HAS(addr, type) \
+     || ((addr) & ((1 << MEM_PAGE_BITS) - 1)) == (1 << MEM_PAGE_BITS) - 1)
+
+/* The cpu loop is built twice from h8300-loop.h, see run_cpu.
+ * CHECKED(cond) is cond in the checked loop and 0 in the fast one.
+ */
 #define GET_OPCODE \
-    if ((*(uint16*) (memtype+pc)) & BP_EXEC) \
+    if (CHECKED(WORD_PAGE_HAS(pc, MEMTYPE_BREAKPOINT) \
+                && ((*(uint16*) (memtype+pc)) & BP_EXEC))) \
         goto trap; \
     opc = GET_WORD_CYCLES(pc); \
     pc += 2
 
+/** \brief fetch the next opcode, from the basic block cache if possible */
+#define FETCH_OPCODE \
+    oldpc = pc; \
+    if (insn->pc != pc) \
+        insn = db_singlestep ? &no_block : lookup_block(pc); \
+    if (insn->pc == pc) { \
+        /* fast path: opcode is predecoded */ \
+        opc = insn->opc; \
+        op = insn->op; \
+        cycles += insn->cycles; \
+        pc += 2; \
+        insn++; \
+    } else { \
+        if (CHECKED(PAGE_HAS(pc, 0x03) && (memtype[pc] & 0x03))) \
+            dump_state(); \
+        GET_OPCODE; \
+        op = opc >> 8; \
+    } \
+    opcval = opc & 0xff; \
+    COUNT_OPCODE
+
+/* Reads from I/O registers and all writes are side effects that end
+ * an idle loop, see check_idle_loop.
+ */
 #define READ_BYTE(addr) \
     GET_BYTE_CYCLES(addr); \
-    if ((*(uint8*) (memtype+(addr))) & BP_READ) \
-        goto trap
+    if (PAGE_HAS(addr, MEMTYPE_READTRAP | MEMTYPE_DIV) \
+        && ((*(uint8*) (memtype+(addr))) & (BP_READ | MEMTYPE_DIV))) { \
+        if (CHECKED((*(uint8*) (memtype+(addr))) & BP_READ)) \
+            goto trap; \
+        idle_effects++; \
+    }
 
 #define READ_WORD(addr) \
     GET_WORD_CYCLES(addr); \
-    if ((*(uint16*) (memtype+(addr))) & BP_READ) \
-        goto trap
+    if (WORD_PAGE_HAS(addr, MEMTYPE_READTRAP | MEMTYPE_DIV) \
+        && ((*(uint16*) (memtype+(addr))) & (BP_READ | BP_DIV))) { \
+        if (CHECKED((*(uint16*) (memtype+(addr))) & BP_READ)) \
+            goto trap; \
+        idle_effects++; \
+    }
 
+/* Writes are checked in both loops, as the ROM is write protected by
+ * MEMTYPE_WRITETRAP.
+ */
 #define WRITE_BYTE(addr, val) \
-    if ((*(uint8*) (memtype+(addr))) & BP_WRITE) \
+    if (PAGE_HAS(addr, MEMTYPE_WRITETRAP) \
+        && ((*(uint8*) (memtype+(addr))) & BP_WRITE)) \
         goto trap; \
+    idle_effects++; \
     SET_BYTE_CYCLES(addr, val)
 
 #define WRITE_WORD(addr, val) \
-    if ((*(uint16*) (memtype+(addr))) & BP_WRITE) \
+    if (WORD_PAGE_HAS(addr, MEMTYPE_WRITETRAP) \
+        && ((*(uint16*) (memtype+(addr))) & BP_WRITE)) \
         goto trap; \
+    idle_effects++; \
     SET_WORD_CYCLES(addr, val)
 
+/** \brief take a relative branch.  Backward branches may close an
+ *  idle loop.
+ */
+#define BRANCH(disp) \
+    do { \
+        pc += (int8) (disp); \
+        if ((int8) (disp) < 0) \
+            check_idle_loop(); \
+    } while (0)
+
+/** \brief number of side effects (writes, I/O reads, interrupts) so far */
+static BRICK_LOCAL unsigned int idle_effects;
+/** \brief state of the cpu at the last backward branch */
+static BRICK_LOCAL uint16 idle_pc = 0xffff;
+static BRICK_LOCAL uint8 idle_ccr, idle_reg[16];
+static BRICK_LOCAL unsigned int idle_last_effects;
+static BRICK_LOCAL cycle_count_t idle_last_cycles;
+
+/** \brief fast forward an idle loop to the next event.
+ *
+ * Called after a backward branch was taken.  If the cpu was in exactly
+ * the same state at the last backward branch and there were no side
+ * effects in between, the loop will repeat itself with the same period
+ * until the next interrupt or timer event changes something.  So we
+ * can add whole periods to cycles as long as we stay below the next
+ * event; the remaining iterations are interpreted as usual, so the
+ * event is checked at the same instruction and the same cycle.
+ */
+static void check_idle_loop(void) {
+    cycle_count_t limit, period, skip;
+
+    FLUSH_CCR;
+    if (pc == idle_pc && idle_effects == idle_last_effects
+        && ccr == idle_ccr && memcmp(&reg, idle_reg, sizeof(reg)) == 0) {
+        limit = ccr & 0x80 ? next_nmi_cycle : next_timer_cycle;
+        period = cycles - idle_last_cycles;
+        if (limit > cycles && period > 0) {
+            skip = (limit - 1 - cycles) / period * period;
+            cycles += skip;
+            idle_cycles_skipped += skip;
+        }
+    } else {
+        idle_pc = pc;
+        idle_ccr = ccr;
+        memcpy(idle_reg, &reg, sizeof(reg));
+        idle_last_effects = idle_effects;
+    }
+    idle_last_cycles = cycles;
+}
+
+
+/** \brief compute the condition codes that are still pending.
+ *
+ * Must be called before ccr is read or written outside of run_cpu.
+ */
+void cpu_flush_ccr(void) {
+    FLUSH_CCR;
+}
 
 void dump_state(void) {
     int i;
+
+    FLUSH_CCR;
     for (i = 0; i < 8; i++) {
         printf("  R%d: %02x%02x (%3d:%3d == %5d)\n",
-               i, reg[i], reg[i+8], reg[i], reg[i+8], GET_REG16(i));
+               i, REG8(i), REG8(i+8), REG8(i), REG8(i+8), GET_REG16(i));
     }
     printf ("  PC: %04x   ccr: %c%c%c%c%c%c%c%c  cycles: %" CYCLE_COUNT_F "->%" CYCLE_COUNT_F "\n",
             pc, 
@@ -95,6 +390,8 @@ void dump_state(void) {
             (ccr & 0x01 ? 'C':'.'),
             cycles,
             ccr & 0x80 ? next_nmi_cycle : next_timer_cycle);
+    printf ("  idle cycles skipped: %llu\n",
+            (unsigned long long) idle_cycles_skipped);
     printf ("trap: %02x\n", db_trap);
     printf ("%04x:  %02x%02x %02x%02x   [%02x%02x %02x%02x]\n", pc, 
             memory[pc], memory[pc+1], memory[pc+2], memory[pc+3],
@@ -110,7 +407,155 @@ static void implement(char *opcode) {
     db_trap = ILLOPC_EXCEPTION;
 }
 
-extern unsigned int frame_opcstat[256];
+extern BRICK_LOCAL unsigned int frame_opcstat[256];
+
+static void init_insn_flags(void) {
+    static const uint8 long_opcodes[] = {
+        0x5a, 0x5e, 0x6a, 0x6b, 0x6e, 0x6f, 0x79, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f
+    };
+    static const uint8 illegal_opcodes[] = {
+        0x52, 0x53, 0x58, 0x5c, 0x64, 0x65, 0x66, 0x78, 0x7a
+    };
+    int i;
+
+    insn_flags[0x01] = INSN_ENDS_BLOCK;  /* sleep */
+    insn_flags[0x7b] = INSN_ENDS_BLOCK;  /* eepmov is not implemented */
+    for (i = 0x40; i < 0x60; i++)
+        insn_flags[i] = INSN_ENDS_BLOCK; /* branches, rts, rte, trap */
+    for (i = 0; i < sizeof(long_opcodes); i++)
+        insn_flags[long_opcodes[i]] |= INSN_LONG;
+    for (i = 0; i < sizeof(illegal_opcodes); i++)
+        insn_flags[illegal_opcodes[i]] = INSN_ENDS_BLOCK;
+}
+
+static void invalidate_block(code_block *block) {
+    block_insn *insn;
+    for (insn = block->insn; insn->pc != BLOCK_NO_PC; insn++)
+        insn->pc = BLOCK_NO_PC;
+    block->start = BLOCK_NO_PC;
+}
+
+#ifdef THREADED_DISPATCH
+/** \brief let the instructions that start a fused sequence dispatch to
+ *  its handler.  The first matching sequence wins.
+ */
+static void fuse_block(block_insn *insn, int n) {
+    const fused_sequence *seq;
+    int k, j;
+
+    for (k = 0; k < n - 1; k++) {
+        for (seq = fused_sequences; seq->len; seq++) {
+            if (k + seq->len > n)
+                continue;
+            for (j = 0; j < seq->len; j++) {
+                if (OPCODE_GROUP(insn[k + j].opc >> 8) != seq->first[j])
+                    break;
+            }
+            if (j == seq->len) {
+                insn[k].op = seq->op;
+                break;
+            }
+        }
+    }
+}
+#endif
+
+/** \brief decode the basic block starting at start
+ *
+ * The block ends after the first control flow instruction or before
+ * any instruction that lies in I/O space or carries a breakpoint or log
+ * bit, so that these always go through the slow path.  All decoded
+ * bytes get the MEMTYPE_CODE bit, so that writing them invalidates the
+ * block.
+ * \returns the first instruction of the block, or no_block if the
+ * instruction at start can't be cached.
+ */
+static block_insn *decode_block(code_block *block, uint16 start) {
+    uint16 addr = start;
+    int n = 0;
+
+    if (block->start != BLOCK_NO_PC)
+        invalidate_block(block);
+
+    while (n < BLOCK_MAX_INSNS) {
+        uint8 flags = insn_flags[memory[addr]];
+        int len = (flags & INSN_LONG) ? 4 : 2;
+        int i;
+
+        for (i = 0; i < len; i++) {
+            if (memtype[(uint16) (addr + i)]
+                & (MEMTYPE_DIV | MEMTYPE_MOTOR 
+                   | MEMTYPE_BREAKPOINT | MEMTYPE_LOG))
+                goto done;
+        }
+        if ((uint16) (addr + len) < addr)
+            break;
+
+        block->insn[n].pc = addr;
+        block->insn[n].opc = (memory[addr] << 8) | memory[addr + 1];
+        block->insn[n].cycles = MEM_PAGE(addr)->word_cycles;
+        block->insn[n].op = memory[addr];
+        mem_set_type(addr, len, MEMTYPE_CODE);
+        n++;
+        addr += len;
+        if (flags & INSN_ENDS_BLOCK)
+            break;
+    }
+ done:
+    block->insn[n].pc = BLOCK_NO_PC;
+    if (n == 0)
+        return &no_block;
+#ifdef THREADED_DISPATCH
+    fuse_block(block->insn, n);
+#endif
+
+    block->start = start;
+    block->end = addr;
+    return block->insn;
+}
+
+/** \brief find or decode the basic block starting at addr
+ */
+static block_insn *lookup_block(uint16 addr) {
+    code_block *block = &block_cache[(addr >> 1) & (BLOCK_CACHE_SIZE - 1)];
+    if (block->start == addr)
+        return block->insn;
+    return decode_block(block, addr);
+}
+
+/** \brief drop all cached blocks that cover the given memory range
+ *
+ * This is called whenever memory marked with MEMTYPE_CODE is written
+ * and after memory was changed behind the CPU's back.  The MEMTYPE_CODE
+ * bits of the range are cleared again.
+ */
+void cpu_invalidate_code(uint16 addr, int len) {
+    code_block *block;
+    int end = addr + len;
+    int i;
+
+#ifdef HAVE_RUN_CPU_JIT
+    jit_invalidate_code(addr, len);
+#endif
+    if (len > BLOCK_MAX_BYTES) {
+        for (i = 0; i < BLOCK_CACHE_SIZE; i++) {
+            block = &block_cache[i];
+            if (block->start != BLOCK_NO_PC 
+                && block->start < end && block->end > addr)
+                invalidate_block(block);
+        }
+    } else {
+        int start = (addr - BLOCK_MAX_BYTES + 2) & ~1;
+        if (start < 0)
+            start = 0;
+        for (i = start; i < end; i += 2) {
+            block = &block_cache[(i >> 1) & (BLOCK_CACHE_SIZE - 1)];
+            if (block->start == i && block->end > addr)
+                invalidate_block(block);
+        }
+    }
+    mem_clear_type(addr, len, MEMTYPE_CODE);
+}
 
 #ifdef DEBUG_CPU_ASM
 #include <string.h>
@@ -147,6 +592,7 @@ static void debug_cpu_asm(void) {
     unsigned int opc;
 
     while (cycles < (ccr & 0x80 ? old_next_nmi_cycle : old_next_timer_cycle)) {
+        FLUSH_CCR;
         memcpy(old_reg, reg, 16);
         old_pc = pc;
         old_ccr = ccr;
@@ -177,13 +623,15 @@ static void debug_cpu_asm(void) {
 #ifdef DEBUG_CPU
         printf ("Exec %04x: %04x\n", pc-2, opc);
 #endif
-        frame_opcstat[opc>>8]++;
+        COUNT_OPCODE;
         
         switch(opc >> 8) {
 #define GET_BYTE(addr) memory[(uint16)(addr)]
 #define GET_WORD(addr) ((memory[(uint16)(addr)] << 8) | memory[(uint16) (addr) + 1])
 #define SET_BYTE(addr, val) debug_set_byte(old_pc, addr,val)
 #define SET_WORD(addr, val) debug_set_word(old_pc, addr,val)
+#define PUT_BYTE(addr, val) debug_set_byte(old_pc, addr,val)
+#define PUT_WORD(addr, val) debug_set_word(old_pc, addr,val)
 #define frame_begin(stack, irq)
 #define frame_end(stack, irq)
 #define frame_switch(oldstack, newstack)
@@ -194,17 +642,32 @@ static void debug_cpu_asm(void) {
 #undef GET_WORD
 #undef SET_BYTE
 #undef SET_WORD
+#undef PUT_BYTE
+#undef PUT_WORD
 #undef frame_begin
 #undef frame_end
 #undef frame_switch
 #define GET_BYTE(addr) \
-    (!(memtype[(uint16)(addr)] & MEMTYPE_DIV) ? \
-       memory[(uint16)(addr)] : get_byte_div(addr))
+    (MEM_PAGE(addr)->read ? \
+       MEM_PAGE(addr)->read[(uint16) (addr)] \
+     : MEM_PAGE(addr)->funcs->get_byte(addr))
 
 #define GET_WORD(addr) \
-    (!((addr) & 1) && !(memtype[(uint16)(addr)] & MEMTYPE_DIV) ? \
-      (memory[(uint16)(addr)] << 8) | memory[(uint16) (addr) + 1] \
-     : get_word_div(addr))
+    (!((addr) & 1) && MEM_PAGE(addr)->read ? \
+      (MEM_PAGE(addr)->read[(uint16) (addr)] << 8) \
+       | MEM_PAGE(addr)->read[(uint16) (addr) + 1] \
+     : MEM_PAGE(addr)->funcs->get_word(addr))
+
+#define PUT_BYTE(addr, val) \
+    (MEM_PAGE(addr)->write ? \
+       (void) (MEM_PAGE(addr)->write[(uint16) (addr)] = (val)) \
+     : MEM_PAGE(addr)->funcs->set_byte(addr, val))
+
+#define PUT_WORD(addr, val) \
+    (!((addr) & 1) && MEM_PAGE(addr)->write ? \
+       (void) (MEM_PAGE(addr)->write[(uint16) (addr)] = (val) >> 8, \
+               MEM_PAGE(addr)->write[(uint16) (addr) + 1] = (val) & 0xff) \
+     : MEM_PAGE(addr)->funcs->set_word(addr, val))
         default:
         illOpc:
             db_trap = ILLOPC_EXCEPTION;
@@ -214,6 +677,7 @@ static void debug_cpu_asm(void) {
                     old_pc, memory[old_pc]);
             abort();
         }
+        FLUSH_CCR;
         if (new_pc != pc || new_ccr != ccr || new_cycles != cycles
             || memcmp(reg, new_reg, 16)) {
             printf ("Unexpected difference at %04x (%02x)\n", 
@@ -243,88 +707,93 @@ static void debug_cpu_asm(void) {
 #define run_cpu_asm debug_cpu_asm
 #endif
 
-void run_cpu(void) {
-    uint16 oldpc = pc;
-    uint8 opcval;
-    unsigned int opc;
-
-    db_singlestep_pc = 0xffff;
-    do_reset();
+#ifdef THREADED_DISPATCH
+/** \brief end of every threaded opcode handler
+ *
+ * As long as no event is due the next opcode is fetched and dispatched
+ * right here, so each handler has its own indirect jump.  Everything
+ * else goes back to the head of the loop in run_cpu.
+ */
+#ifndef DEBUG_CPU
+#define NEXT_OPCODE \
+    if ((pc & 1) || db_trap || CHECKED(db_singlestep) || irq_disabled_one \
+        || cycles >= (ccr & 0x80 ? next_nmi_cycle : next_timer_cycle)) \
+        continue; \
+    FETCH_OPCODE; \
+    goto *cpu_opctable[op]
+
+/** \brief end of a fused handler: continue with the next instruction of
+ *  the sequence at label, if it is still the predecoded one.  Only the
+ *  last instruction of a sequence may change pc, and fused handlers are
+ *  never reached while single stepping, as that bypasses the block cache.
+ */
+#define FUSE_NEXT(label) \
+    if (db_trap || irq_disabled_one || insn->pc != pc \
+        || cycles >= (ccr & 0x80 ? next_nmi_cycle : next_timer_cycle)) \
+        continue; \
+    oldpc = pc; \
+    opc = insn->opc; \
+    cycles += insn->cycles; \
+    pc += 2; \
+    insn++; \
+    opcval = opc & 0xff; \
+    COUNT_OPCODE; \
+    goto label
+#else
+#define NEXT_OPCODE continue
+#define FUSE_NEXT(label) continue
+#endif
+#endif
 
-    while (1) {
-        if (pc & 1)
-            db_trap = 10;
-        if (db_trap || db_singlestep) {
-            if (db_singlestep) {
-                oldpc = pc;
-                db_trap = TRAP_EXCEPTION;
-            }
-            if (0) {
-        trap:
-                if (db_singlestep_pc == oldpc) {
-                    db_singlestep_pc = 0xffff;
-                    db_singlestep = 1;
-                    memtype[oldpc] = db_singlestep_memtype;
-                }
-                db_trap = TRAP_EXCEPTION;
-        fault:
-                pc = oldpc;
-            }
-        handletrap:
-            periph_handletrap();
-        }
-            
+/* The assembler cores check breakpoints themselves and the C loop only
+ * single steps for them, so they only need the checked loop.
+ */
+#ifndef HAVE_RUN_CPU_ASM
+#define CPU_HAS_FAST_LOOP
+#endif
 
-        if (irq_disabled_one) {
-            irq_disabled_one = 0;
+/** \brief does the cpu loop have to look at breakpoints, watchpoints,
+ *  log marks and single steps?
+ */
+#define CPU_NEEDS_CHECKS (db_singlestep || mem_debug_pages)
+
+#define CPU_LOOP          cpu_loop_checked
+#define CPU_LOOP_LABEL    "checked_"
+#define CPU_LOOP_CHECKED  1
+#include "h8300-loop.h"
+#undef CPU_LOOP
+#undef CPU_LOOP_LABEL
+#undef CPU_LOOP_CHECKED
+
+#ifdef CPU_HAS_FAST_LOOP
+#define CPU_LOOP          cpu_loop_fast
+#define CPU_LOOP_LABEL    "fast_"
+#define CPU_LOOP_CHECKED  0
+#include "h8300-loop.h"
+#undef CPU_LOOP
+#undef CPU_LOOP_LABEL
+#undef CPU_LOOP_CHECKED
+#endif
 
-        } else {
+void run_cpu(void) {
+    int i;
 
-#ifdef HAVE_RUN_CPU_ASM
-            if (!db_singlestep) {
-                run_cpu_asm();
-                if (db_trap)
-                    goto handletrap;
-            }
-#endif
-            if (cycles >= (ccr & 0x80 ? next_nmi_cycle : next_timer_cycle)) {
-                if (!db_singlestep) {
-                    check_irq();
-
-                } else {
-
-                    /* singlestep handling is a bit more difficult */
-                    db_singlestep_pc = pc;
-                    check_irq();
-                    if (db_singlestep_pc != pc) {
-                        /* interrupt occured: step over it */
-                        db_singlestep_memtype = memtype[db_singlestep_pc];
-                        memtype[db_singlestep_pc] |= MEMTYPE_BREAKPOINT;
-                        db_singlestep = 0;
-                    }
-                }
-                continue;
-            }
-        }
-            
-        if (memtype[pc] & 0x03)
-            dump_state();
+    init_insn_flags();
+    for (i = 0; i < BLOCK_CACHE_SIZE; i++)
+        block_cache[i].start = block_cache[i].insn[0].pc = BLOCK_NO_PC;
 
-        oldpc = pc;
-        GET_OPCODE;
-        opcval = opc & 0xff;
-#ifdef DEBUG_CPU
-        printf ("Exec %04x: %04x\n", pc-2, opc);
-#endif
-        frame_opcstat[opc>>8]++;
+    db_singlestep_pc = 0xffff;
+    do_reset();
 
-        switch(opc >> 8) {
-#define MAKE_LABEL(label) __asm__ ("\n.L" label ":\n")
-#include "h8300.inc"
-        default:
-        illOpc:
-            db_trap = ILLOPC_EXCEPTION;
-            goto fault;
-        }
+#ifdef CPU_HAS_FAST_LOOP
+    /* run the fast loop as long as no debugging feature is in use */
+    for (i = 0; ; i = 1) {
+        if (CPU_NEEDS_CHECKS)
+            cpu_loop_checked(i);
+        else
+            cpu_loop_fast(i);
     }
+#else
+    cpu_loop_checked(0);
+#endif
 }
@@ -49,19 +49,50 @@
 
 #define H8_3292
 
+/* REG8(nr) is the byte register nr, R0H-R7H for 0-7 and R0L-R7L for
+ * 8-15.  The assembler cores keep this order in memory.  The C core
+ * stores the registers as host words, so that word accesses need no
+ * shifting, and picks the bytes according to the host's byte order.
+ */
+#ifdef HAVE_RUN_CPU_ASM
 #define GET_REG16(nr)     ((reg[(nr)] << 8) | reg[(nr) + 8])
 #define SET_REG16(nr,val) do { reg[(nr)] = (val) >> 8; \
                                reg[(nr) + 8] = (val) & 0xff; } while (0)
+#define REG8(nr)          reg[(nr)]
+
+extern BRICK_LOCAL uint8 reg[16];
+#else
+/** \brief the general registers R0-R7 with their byte halves */
+typedef union {
+    uint16 w[8];
+    uint8  b[16];
+} h8300_regs;
 
+#define GET_REG16(nr)     (reg.w[(nr)])
+#define SET_REG16(nr,val) (reg.w[(nr)] = (val))
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REG8(nr)          (reg.b[((nr) & 7) << 1 | ((nr) >> 3 & 1)])
+#else
+#define REG8(nr)          (reg.b[((nr) & 7) << 1 | (~(nr) >> 3 & 1)])
+#endif
 
-extern uint8 reg[16];
-extern uint16 pc;
-extern uint8 ccr;
-extern cycle_count_t cycles, next_timer_cycle, next_nmi_cycle;
-extern int irq_disabled_one;
-extern volatile int db_trap;
-extern int db_singlestep;
+extern BRICK_LOCAL h8300_regs reg;
+#endif
+extern BRICK_LOCAL uint16 pc;
+extern BRICK_LOCAL uint8 ccr;
+extern BRICK_LOCAL cycle_count_t cycles, next_timer_cycle, next_nmi_cycle;
+extern BRICK_LOCAL cycle_count_t idle_cycles_skipped;
+extern BRICK_LOCAL int irq_disabled_one;
+extern BRICK_LOCAL volatile int db_trap;
+extern BRICK_LOCAL int db_singlestep;
 extern void dump_state(void);
+extern void cpu_invalidate_code(uint16 addr, int len);
+extern void cpu_flush_ccr(void);
 extern void run_cpu(void);
 
+#ifdef HAVE_RUN_CPU_JIT
+extern void run_cpu_jit(void);
+extern void jit_invalidate_code(uint16 addr, int len);
+#endif
+
 #endif
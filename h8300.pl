@@ -28,13 +28,13 @@ sub getWRs() {
     "   uint16 src  = GET_REG16((opcval>>4) & 0x7);\n";
 }
 sub getBRo() {
-    "   uint8 oval = reg[opcval & 0xf];\n";
+    "   uint8 oval = REG8(opcval & 0xf);\n";
 }
 sub getBRd() {
-    "   uint8 dest = reg[opcval & 0xf];\n";
+    "   uint8 dest = REG8(opcval & 0xf);\n";
 }
 sub getBRs() {
-    "   uint8 src  = reg[(opcval>>4) & 0xf];\n";
+    "   uint8 src  = REG8((opcval>>4) & 0xf);\n";
 }
 
 sub setNZ($) {
@@ -44,10 +44,18 @@ sub setNZ($) {
 	"   if (dest == 0)  ccr |= 0x04;\n";
 }
 
+# ADD and SUB set their flags through SET_HNZVC in h8300.c, which may
+# compute them lazily.  Byte operands are shifted into the upper half so
+# that the flags are computed the same way for both sizes.
 sub setHNZVC($) {
     my $w = $_[0] =~ /W$/ ? 16 : 8;
     my $res;
 
+    if ($_[0] =~ /^(ADD|SUB)[BW]$/) {
+	my $sh = $w == 8 ? " << 8" : "";
+	return "   SET_HNZVC(FLAGS_$1, oval$sh, src$sh, dest$sh);\n";
+    }
+
     $auxmask = (1 << ($w-4)) - 1;
     $res = 
 	"   ccr &= 0xd0;\n".
@@ -68,8 +76,7 @@ sub setHNZVC($) {
 
 sub setNZV($) {
     my $w = $_[0] =~ /W$/ ? 16 : 8;
-    return "   ccr &= 0xf1;\n".
-	setNZ($_[0]);
+    return "   SET_NZV(dest".($w == 8 ? " << 8" : "").");\n";
 }
 
 
@@ -77,7 +84,7 @@ sub setWRd() {
     "   SET_REG16(opcval & 0x7, dest);\n";
 }
 sub setBRd() {
-    "   reg[opcval & 0xf] = dest;\n";
+    "   REG8(opcval & 0xf) = dest;\n";
 }
 
 sub call($) {
@@ -100,7 +107,8 @@ sub Nop() {
 }
 
 sub Sleep() {
-    "   cpu_sleep();\n";
+    "   cpu_sleep();\n".
+	"   idle_effects++;\n";
 }
 
 sub Trap() {
@@ -111,11 +119,11 @@ sub Trap() {
 
 sub AddBI() {
     "   uint8 nr = (opc >> 8) & 0xf;\n".
-	"   uint8 oval = reg[nr];\n".
+	"   uint8 oval = REG8(nr);\n".
 	"   uint8 src = opcval;\n".
 	"   uint8 dest = oval + src;\n".
 	setHNZVC("ADDB"). 
-	"   reg[nr] = dest;\n";
+	"   REG8(nr) = dest;\n";
 }
 sub AddB() {
     return
@@ -142,11 +150,11 @@ sub AddS() {
 sub AddXI() {
     return 
 	"   uint8 nr = (opc >> 8) & 0xf;\n".
-	"   uint8 oval = reg[nr];\n".
+	"   uint8 oval = REG8(nr);\n".
 	"   uint8 src = opcval;\n".
 	"   uint8 dest = oval + src + (ccr & 1);\n".
 	setHNZVC("ADDX"). 
-	"   reg[nr] = dest;\n";
+	"   REG8(nr) = dest;\n";
 }
 
 sub AddX() {
@@ -159,7 +167,7 @@ sub AddX() {
 }
 
 sub CmpBI() {
-    "   uint8 oval = reg[(opc >> 8) & 0xf];\n".
+    "   uint8 oval = REG8((opc >> 8) & 0xf);\n".
 	"   uint8 src = opcval;\n".
 	"   uint8 dest = oval - src;\n".
 	setHNZVC("SUBB");
@@ -205,12 +213,12 @@ sub SubS() {
 sub SubXI() {
     return 
 	" uint8 nr = (opc >> 8) & 0xf;\n".
-	" uint8 oval = reg[nr];\n".
+	" uint8 oval = REG8(nr);\n".
 	" uint8 src = opcval;\n".
 	" uint8 dest = oval - src - (ccr & 1);\n".
 	" uint8 pccr = ccr;\n".
 	setHNZVC("SUBX"). 
-	" reg[nr] = dest;\n".
+	" REG8(nr) = dest;\n".
         " ccr &= pccr | ~4;\n";
 }
 
@@ -230,7 +238,7 @@ sub Inc() {
 	"   if (opcval & 0xf0) goto illOpc;\n". 
 	"   dest++;\n".
 	setNZV("INC"). 
-	"   if (dest == 0x80) ccr |= 0x2;\n".
+	"   if (dest == 0x80) SET_V;\n".
         setBRd();
 }
 sub Dec() {
@@ -238,7 +246,7 @@ sub Dec() {
 	"   if (opcval & 0xf0) goto illOpc;\n". 
 	"   dest--;\n".
 	setNZV("DEC"). 
-	"   if (dest == 0x7f) ccr |= 0x2;\n".
+	"   if (dest == 0x7f) SET_V;\n".
         setBRd();
 	
 }
@@ -266,7 +274,7 @@ sub DAS() {
         setBRd();
 }
 sub MulXU() {
-    return  "   uint16 dest = reg[(opcval & 7) + 8];\n".
+    return  "   uint16 dest = REG8((opcval & 7) + 8);\n".
 	getBRs().
 	"   if (opcval & 0x08) goto illOpc;\n".
 	"   dest = dest * src;\n".
@@ -314,7 +322,7 @@ sub BitAbs() {
 	"  switch(opc >> 8) {\n";
     for (@{$bitops[$nr]}) {
 	$code = $_->[2];
-	$code =~ s/reg\[opcval & 0xf\]/val/g;
+	$code =~ s/REG8\(opcval & 0xf\)/val/g;
 	$res .= "  case 0x".sprintf("%02x", $_->[0]). ": /* $_->[1] */\n";
 	$res .= "  {\n$code   break;\n  }\n";
     }
@@ -336,7 +344,7 @@ sub BitInd() {
 	"  switch(opc >> 8) {\n";
     for (@{$bitops[$nr]}) {
 	$code = $_->[2];
-	$code =~ s/reg\[opcval & 0xf\]/val/g;
+	$code =~ s/REG8\(opcval & 0xf\)/val/g;
 	$res .= "  case 0x".sprintf("%02x", $_->[0]). ": /* $_->[1] */\n";
 	$res .= "  {\n$code   break;\n  }\n";
     }
@@ -349,32 +357,32 @@ sub BitInd() {
 
 sub BAnd() {
     return
-	"   ccr &= 0xfe | ( (reg[opcval & 0xf] >> ((opcval >> 4) & 7))\n".
+	"   ccr &= 0xfe | ( (REG8(opcval & 0xf) >> ((opcval >> 4) & 7))\n".
 	"                       ^ (opcval >> 7));\n";
 }
 sub BLd() {
     return
 	"   ccr &= 0xfe;\n".
-	"   ccr |= 0x1 & ( (reg[opcval & 0xf] >> ((opcval >> 4) & 7))\n".
+	"   ccr |= 0x1 & ( (REG8(opcval & 0xf) >> ((opcval >> 4) & 7))\n".
 	"                      ^ (opcval >> 7));\n";
 }
 sub BSt() {
     return
 	"   if ((ccr ^ (opcval >> 7)) & 1)\n".
-	"      reg[opcval & 0xf] |= (1 << ((opcval >> 4) & 7));\n".
+	"      REG8(opcval & 0xf) |= (1 << ((opcval >> 4) & 7));\n".
         "   else\n".
-	"      reg[opcval & 0xf] &= ~(1 << ((opcval >> 4) & 7));\n";
+	"      REG8(opcval & 0xf) &= ~(1 << ((opcval >> 4) & 7));\n";
 }
 
 
 sub BOr() {
     return
-	"   ccr |= 0x1 & ( (reg[opcval & 0xf] >> ((opcval >> 4) & 7))\n".
+	"   ccr |= 0x1 & ( (REG8(opcval & 0xf) >> ((opcval >> 4) & 7))\n".
 	"                      ^ (opcval >> 7));\n";
 }
 sub BXor() {
     return
-	"   ccr ^= 0x1 & ( (reg[opcval & 0xf] >> ((opcval >> 4) & 7))\n".
+	"   ccr ^= 0x1 & ( (REG8(opcval & 0xf) >> ((opcval >> 4) & 7))\n".
 	"                      ^ (opcval >> 7));\n";
 }
 
@@ -382,44 +390,44 @@ sub BXor() {
 sub BClrI() {
     return 
 	"   if (opcval & 0x80) goto illOpc;\n".
-	"   reg[opcval & 0xf] &= ~(1 << (opcval >> 4));\n";
+	"   REG8(opcval & 0xf) &= ~(1 << (opcval >> 4));\n";
 }
 
 sub BClr() {
     return 
-	"   reg[opcval & 0xf] &= ~(1 << (reg[opcval >> 4] & 7));\n";
+	"   REG8(opcval & 0xf) &= ~(1 << (REG8(opcval >> 4) & 7));\n";
 }
 
 sub BSetI() {
     return 
 	"   if (opcval & 0x80) goto illOpc;\n".
-	"   reg[opcval & 0xf] |= (1 << (opcval >> 4));\n";
+	"   REG8(opcval & 0xf) |= (1 << (opcval >> 4));\n";
 }
 
 sub BSet() {
     return 
-	"   reg[opcval & 0xf] |= (1 << (reg[opcval >> 4] & 7));\n";
+	"   REG8(opcval & 0xf) |= (1 << (REG8(opcval >> 4) & 7));\n";
 }
 
 sub BNotI() {
     return 
 	"   if (opcval & 0x80) goto illOpc;\n".
-	"   reg[opcval & 0xf] ^= (1 << (opcval >> 4));\n";
+	"   REG8(opcval & 0xf) ^= (1 << (opcval >> 4));\n";
 }
 sub BNot() {
     return 
-	"   reg[opcval & 0xf] ^= (1 << (reg[opcval >> 4] & 7));\n";
+	"   REG8(opcval & 0xf) ^= (1 << (REG8(opcval >> 4) & 7));\n";
 }
 sub BTstI() {
     return 
 	"   if (opcval & 0x80) goto illOpc;\n".
 	"   ccr &= 0xfb;\n".
-	"   ccr |= (0x1 & (~reg[opcval & 0xf] >> (opcval >> 4)))<<2;\n";
+	"   ccr |= (0x1 & (~REG8(opcval & 0xf) >> (opcval >> 4)))<<2;\n";
 }
 sub BTst() {
     return 
 	"   ccr &= 0xfb;\n".
-	"   ccr |= (0x1 & (~reg[opcval & 0xf] >> (reg[opcval >> 4] & 7)))<<2;\n";
+	"   ccr |= (0x1 & (~REG8(opcval & 0xf) >> (REG8(opcval >> 4) & 7)))<<2;\n";
 }
 
 ######### Branch instructions ########################
@@ -432,7 +440,7 @@ sub check_pc() {
 
 sub BRA() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  pc += (int8) opcval;\n".
+	"  BRANCH(opcval);\n".
 	check_pc();
 }
 sub BRN() {
@@ -441,72 +449,72 @@ sub BRN() {
 }
 sub BHI() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if (!(ccr & 0x5)) pc += (int8) opcval;\n".
+	"  if (!(ccr & 0x5)) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BLO() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if ((ccr & 0x5)) pc += (int8) opcval;\n".
+	"  if ((ccr & 0x5)) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BCC() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if (!(ccr & 0x1)) pc += (int8) opcval;\n".
+	"  if (!(ccr & 0x1)) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BCS() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if ((ccr & 0x1)) pc += (int8) opcval;\n".
+	"  if ((ccr & 0x1)) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BNE() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if (!(ccr & 0x4)) pc += (int8) opcval;\n".
+	"  if (!FLAG_Z) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BEQ() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if ((ccr & 0x4)) pc += (int8) opcval;\n".
+	"  if (FLAG_Z) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BVC() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if (!(ccr & 0x2)) pc += (int8) opcval;\n".
+	"  if (!(ccr & 0x2)) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BVS() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if ((ccr & 0x2)) pc += (int8) opcval;\n".
+	"  if ((ccr & 0x2)) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BPL() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if (!(ccr & 0x8)) pc += (int8) opcval;\n".
+	"  if (!FLAG_N) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BMI() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if ((ccr & 0x8)) pc += (int8) opcval;\n".
+	"  if (FLAG_N) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BGE() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if (!(((ccr >> 2) ^ ccr) & 0x2)) pc += (int8) opcval;\n".
+	"  if (!(((ccr >> 2) ^ ccr) & 0x2)) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BLT() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if (((ccr >> 2) ^ ccr) & 0x2) pc += (int8) opcval;\n".
+	"  if (((ccr >> 2) ^ ccr) & 0x2) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BGT() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if (!((((ccr >> 2)&2) ^ ccr) & 0x6)) pc += (int8) opcval;\n".
+	"  if (!((((ccr >> 2)&2) ^ ccr) & 0x6)) BRANCH(opcval);\n".
 	check_pc();
 }
 sub BLE() {
     return "   GET_WORD_CYCLES(pc); /* emulate prefetch */\n".
-	"  if ((((ccr >> 2)&2) ^ ccr) & 0x6) pc += (int8) opcval;\n".
+	"  if ((((ccr >> 2)&2) ^ ccr) & 0x6) BRANCH(opcval);\n".
 	check_pc();
 }
 
@@ -589,7 +597,7 @@ sub EepMov() {
 }
 
 sub MovB() {
-    return "   uint8 dest  = reg[(opcval>>4) & 0xf];\n".
+    return "   uint8 dest  = REG8((opcval>>4) & 0xf);\n".
 	setNZV("MOVB"). 
         setBRd();
 }
@@ -597,12 +605,12 @@ sub MovBI() {
     return
 	"   uint8 dest  = opcval;\n".
 	setNZV("MOVB"). 
-	"   reg[(opc >> 8) & 0xf] = dest;\n";
+	"   REG8((opc >> 8) & 0xf) = dest;\n";
 }
 sub MovBRI() {
     return "   uint8 dest;\n".
 	"   if (opcval & 0x80) {\n". 
-        "      dest = reg[opcval & 0xf];\n".
+        "      dest = REG8(opcval & 0xf);\n".
 	"      WRITE_BYTE(GET_REG16((opcval >> 4) & 0x7), dest);\n".
         "   } else {\n".
 	"      dest = READ_BYTE(GET_REG16(opcval >> 4));\n".
@@ -615,7 +623,7 @@ sub MovBRID() {
 	"   uint16 addr;\n".
 	"   addr = GET_WORD_CYCLES(pc) + GET_REG16((opcval >> 4) & 0x7); pc +=2;\n".
 	"   if (opcval & 0x80) {\n". 
-        "      dest = reg[opcval & 0xf];\n".
+        "      dest = REG8(opcval & 0xf);\n".
 	"      WRITE_BYTE(addr, dest);\n".
         "   } else {\n".
 	"      dest = READ_BYTE(addr);\n".
@@ -628,7 +636,7 @@ sub MovBRIP() {
 	"   cycles += 2;\n".
 	"   if (opcval & 0x80) {\n". 
 	"      uint16 addr = GET_REG16((opcval >> 4) & 0x7) - 1;\n".
-        "      dest = reg[opcval & 0xf];\n".
+        "      dest = REG8(opcval & 0xf);\n".
 	"      WRITE_BYTE(addr, dest);\n".
         "      SET_REG16((opcval >> 4) & 0x7, addr);\n".
         "   } else {\n".
@@ -644,11 +652,11 @@ sub MovBFA8() {
 	"   uint8 dest;\n".
 	"   dest = READ_BYTE((uint16)(int8)opcval);\n".
 	setNZV("MOVB"). 
-        "   reg[(opc >> 8) & 0xf] = dest;\n";
+        "   REG8((opc >> 8) & 0xf) = dest;\n";
 }
 sub MovBTA8() {
     return
-	"   uint8 dest = reg[(opc >> 8) & 0xf];\n".
+	"   uint8 dest = REG8((opc >> 8) & 0xf);\n".
 	setNZV("MOVB"). 
 	"   WRITE_BYTE((uint16)(int8)opcval, dest);\n";
 }
@@ -658,7 +666,7 @@ sub MovBA16() {
 	"   if (opcval & 0x70) goto illOpc;\n". 
 	"   addr = GET_WORD_CYCLES(pc); pc +=2;\n".
 	"   if (opcval & 0x80) {\n". 
-        "      dest = reg[opcval & 0xf];\n".
+        "      dest = REG8(opcval & 0xf);\n".
 	"      WRITE_BYTE(addr, dest);\n".
         "   } else {\n".
 	"      dest = READ_BYTE(addr);\n".
@@ -748,11 +756,11 @@ sub MovWA16() {
 ######### Flag instructions ########################
 sub StC() {
     return "   if (opcval & 0xf0) goto illOpc;\n". 
-	"   reg[opcval] = ccr;\n";
+	"   REG8(opcval) = ccr;\n";
 }
 sub LdC() {
     return "   if (opcval & 0xf0) goto illOpc;\n". 
-	"   ccr = reg[opcval];\n" .
+	"   ccr = REG8(opcval);\n" .
 	"   irq_disabled_one = 1;\n";
 }
 sub LdCI() {
@@ -833,11 +841,11 @@ sub RotR() {
 ######### Logical instructions ########################
 sub AndI() {
     "   uint8 nr = (opc >> 8) & 0xf;\n".
-	"   uint8 dest = reg[nr];\n".
+	"   uint8 dest = REG8(nr);\n".
 	"   uint8 src = opcval;\n".
 	"   dest &= src;\n".
 	setNZV("ANDB"). 
-	"   reg[nr] = dest;\n";
+	"   REG8(nr) = dest;\n";
 }
 sub And() {
     return
@@ -850,11 +858,11 @@ sub And() {
 
 sub OrI() {
     "   uint8 nr = (opc >> 8) & 0xf;\n".
-    "   uint8 dest = reg[nr];\n".
+    "   uint8 dest = REG8(nr);\n".
 	"   uint8 src = opcval;\n".
 	"   dest |= src;\n".
 	setNZV("ANDB"). 
-	"   reg[nr] = dest;\n";
+	"   REG8(nr) = dest;\n";
 }
 sub Or() {
     return
@@ -867,11 +875,11 @@ sub Or() {
 
 sub XorI() {
     "   uint8 nr = (opc >> 8) & 0xf;\n".
-	"   uint8 dest = reg[nr];\n".
+	"   uint8 dest = REG8(nr);\n".
 	"   uint8 src = opcval;\n".
 	"   dest ^= src;\n".
 	setNZV("ANDB"). 
-	"   reg[nr] = dest;\n";
+	"   REG8(nr) = dest;\n";
 }
 sub Xor() {
     return
@@ -901,19 +909,119 @@ sub Not() {
 }
 
 
+# Opcodes that use ccr directly need the pending flags first.
+sub flush_ccr($) {
+    return $_[0] =~ /\bccr\b/ ? "   FLUSH_CCR;\n" : "";
+}
+
 sub build_case($$) {
     my ($hex, $func) = @_;
+    my $code = &$func( hex $hex );
     return "case 0x$hex:  /* $func */\n".
-	qq'   MAKE_LABEL("cpuopc_$hex");\n{\n'.
-	&$func( hex $hex ).
+	qq'   MAKE_LABEL("cpuopc_$hex");\n'.
+	flush_ccr($code). "{\n".
+	$code.
 	"   break;\n}\n";
 }
 
+# Threaded code: every opcode gets a label and ends with its own copy
+# of the dispatch (NEXT_OPCODE).  The label table is emitted in the same
+# file and selected with CPU_OPCODE_TABLE.
+sub build_label($$) {
+    my ($hex, $func) = @_;
+    my $code = &$func( hex $hex );
+    return "cpuopc_$hex:  /* $func */\n".
+	qq'   MAKE_LABEL("cpuopc_$hex");\n'.
+	flush_ccr($code). "{\n".
+	$code.
+	"}\n   NEXT_OPCODE;\n";
+}
+
+# Superinstructions: a fused handler runs the first opcode of a hot
+# sequence and jumps directly to the handler of the next one (FUSE_NEXT),
+# saving one indirect jump.  The sequences are read from a profile with
+# lines "count op1 op2 [op3]" (hex first opcode bytes), as written by
+# frame_dump_profile with PROFILE_SEQUENCES.
+$max_fused = 32;
+
+# the handler label of a first opcode byte, opcode groups 2x, 3x, 8x-Fx
+# share one handler.
+sub opcode_group($) {
+    my $op = $_[0];
+    return ($op >= 0x80 || ($op & 0xe0) == 0x20) ? ($op | 0x0f) : $op;
+}
+
+# opcodes that leave the basic block can only end a sequence
+sub ends_block($) {
+    my $op = $_[0];
+    return $op == 0x01 || $op == 0x7b || ($op >= 0x40 && $op < 0x60);
+}
+
+sub read_sequences($) {
+    my ($file) = @_;
+    my (%weight, @seqs);
+    open PROFILE, "<$file" or die "$file: $!";
+    while (<PROFILE>) {
+	s/#.*//;
+	my ($count, @ops) = split;
+	next unless @ops;
+	die "$file:$.: need two or three opcodes\n" if @ops < 2 || @ops > 3;
+	$weight{join " ", map { sprintf "%02X", opcode_group(hex $_) } @ops}
+	    += $count;
+    }
+    close PROFILE;
+  seq:
+    foreach $seq (sort { $weight{$b} <=> $weight{$a} || $a cmp $b }
+		  keys %weight) {
+	my @ops = split / /, $seq;
+	foreach $i (0 .. $#ops) {
+	    next seq unless $funcs{$ops[$i]};
+	    next seq if $i < $#ops && ends_block(hex $ops[$i]);
+	}
+	push @seqs, $seq;
+	last if @seqs == $max_fused;
+    }
+    return @seqs;
+}
+
+sub fused_label(@) {
+    return "cpuopc_" . join "_", @_;
+}
+
+sub build_fused(@) {
+    my @ops = @_;
+    my $func = $funcs{$ops[0]};
+    my $code = &$func( hex $ops[0] );
+    my $label = fused_label(@ops);
+    my $next = fused_label(@ops[1 .. $#ops]);
+    return "$label:  /* " . join(" ", map { $funcs{$_} } @ops) . " */\n".
+	qq'   MAKE_LABEL("$label");\n'.
+	flush_ccr($code). "{\n".
+	$code.
+	"}\n   FUSE_NEXT($next);\n";
+}
+
+$threaded = @ARGV && $ARGV[0] eq "threaded";
+@table = ("illOpc") x 256;
+$handlers = "";
+
 while (<DATA>) {
     $_ =~ /([0-9a-fA-F][0-9a-fA-FxX])=(\w+)/ or next;
     $hex = $1;
     $func = $2;
-    if ($hex =~ /x/) {
+    if ($threaded) {
+	if ($hex =~ /x/) {
+	    for ($i = 0; $i < 16; $i++) {
+		$table[hex(substr($hex,0,1)) * 16 + $i] =
+		    "cpuopc_" . substr($hex,0,1) . "F";
+	    }
+	    $hex = substr($hex,0,1) . "F";
+	} else {
+	    $table[hex $hex] = "cpuopc_$hex";
+	}
+	$funcs{$hex} = $func;
+	$handlers .= build_label($hex, $func);
+    } elsif ($hex =~ /x/) {
 	for ($i = 0; $i < 16; $i++) {
 	    $hex = substr($hex,0,1) . sprintf("%X", $i);
 	    if ($i < 15) {
@@ -927,6 +1035,40 @@ while (<DATA>) {
     }
 }
 
+if ($threaded) {
+    @fused = $ARGV[1] ? read_sequences($ARGV[1]) : ();
+    # a triple continues with the fused handler of its last two opcodes
+    %is_fused = map { $_ => 1 } @fused;
+    foreach $seq (@fused) {
+	my @ops = split / /, $seq;
+	if (@ops == 3 && !$is_fused{"$ops[1] $ops[2]"}) {
+	    push @fused, "$ops[1] $ops[2]";
+	    $is_fused{"$ops[1] $ops[2]"} = 1;
+	}
+    }
+    # decode_block takes the first match, so triples come first
+    @fused = ((grep { tr/ // == 2 } @fused),
+	      (grep { tr/ // == 1 } @fused));
+
+    print "#if defined(CPU_OPCODE_TABLE)\n";
+    push @table, map { fused_label(split / /) } @fused;
+    for ($i = 0; $i < @table; $i += 4) {
+	print "   ", join(" ", map { "&&$_," } grep { $_ } @table[$i .. $i+3]),
+	    "\n";
+    }
+    print "#elif defined(CPU_FUSED_SEQUENCES)\n";
+    for ($i = 0; $i < @fused; $i++) {
+	my @ops = split / /, $fused[$i];
+	printf "   { %d, %d, { %s } },\n", 256 + $i, scalar @ops,
+	    join(", ", map { "0x$_" } @ops);
+    }
+    print "#else\n", $handlers;
+    foreach $seq (@fused) {
+	print build_fused(split / /, $seq);
+    }
+    print "#endif\n";
+}
+
 __DATA__
 00=Nop
 01=Sleep
@@ -22,6 +22,7 @@
 #include "h8300.h"
 #include "memory.h"
 #include "peripherals.h"
+#include "observe.h"
 
 /*
  * LCD i2c bus constants
@@ -33,11 +34,11 @@
 
 /* #define VERBOSE_LCD */
 
-static uint8 lcd_data[12];
-static int8 lcd_mode, lcd_ptr, lcd_subaddr;
-static int8 i2c_state;
-static uint8 i2c_data, i2c_bitnr;
-static uint8 port6;
+static BRICK_LOCAL uint8 lcd_data[12];
+static BRICK_LOCAL int8 lcd_mode, lcd_ptr, lcd_subaddr;
+static BRICK_LOCAL int8 i2c_state;
+static BRICK_LOCAL uint8 i2c_data, i2c_bitnr;
+static BRICK_LOCAL uint8 port6;
 
 extern void set_analog_active(unsigned char val);
 
@@ -61,9 +62,30 @@ static int lcd_save(void *buffer, int maxlen) {
     return sizeof(*data);
 }
 
-static void lcd_load(void *buffer, int len) {
+/** \brief send the whole display to the GUI
+ *
+ * Used after loading a state and when a new GUI connects to a brick
+ * forked from a checkpoint.
+ */
+void lcd_refresh(void) {
     int i;
     char out[20];
+
+    for (i = 0; i < 12; i++) {
+        sprintf(out, "L%d,%02x\n", i, lcd_data[i]);
+        periph_update(OUT_LCD + i, out);
+        OBSERVE(lcd[i], lcd_data[i]);
+    }
+    sprintf(out, "L99,%d\n", lcd_mode & 0x08 ? 1 : 0);
+    periph_update(OUT_LCD_ENABLE, out);
+    OBSERVE(lcd_enabled, lcd_mode & 0x08 ? 1 : 0);
+
+    sprintf(out, "A%d\n", port6 & 7);
+    periph_update(OUT_ANALOG, out);
+    OBSERVE(analog_active, port6 & 7);
+}
+
+static void lcd_load(void *buffer, int len) {
     lcd_save_type *data = buffer;
 
     memcpy(lcd_data, data->data, sizeof(lcd_data));
@@ -74,41 +96,32 @@ static void lcd_load(void *buffer, int len) {
     i2c_data = data->i2c_data;
     i2c_bitnr = data->i2c_bitnr;
     port6 = data->port6;
-
-    for (i = 0; i < 12; i++) {
-        sprintf(out, "L%d,%02x\n", i, lcd_data[i]);
-        write(periph_fd, out, strlen(out));
-    }
-    sprintf(out, "L99,%d\n", lcd_mode & 0x08 ? 1 : 0);
-    write(periph_fd, out, strlen(out));
-
-    sprintf(out, "A%d\n", port6 & 7);
-    write(periph_fd, out, strlen(out));
+    lcd_refresh();
 }
 
 static void lcd_display(int ptr, int data)
 {
     char out[20];
-    if (lcd_data[ptr] == data)
+    if (ptr >= sizeof(lcd_data) || lcd_data[ptr] == data)
         return;
     lcd_data[ptr] = data;
     sprintf(out, "L%d,%02x\n", ptr, data);
-    wait_peripherals();
 #ifdef VERBOSE_LCD
     printf ("%10d: %s", cycles, out);
 #endif
-    write(periph_fd, out, strlen(out));
+    periph_update(OUT_LCD + ptr, out);
+    OBSERVE(lcd[ptr], data);
 }
 
 static void lcd_enable(int data)
 {
     char out[20];
     sprintf(out, "L99,%d\n", data);
-    wait_peripherals();
 #ifdef VERBOSE_LCD
     printf ("%10d: %s", cycles, out);
 #endif
-    write(periph_fd, out, strlen(out));
+    periph_update(OUT_LCD_ENABLE, out);
+    OBSERVE(lcd_enabled, data);
 }
 
 static void set_port6(uint8 val) {
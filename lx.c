@@ -43,6 +43,7 @@ int lx_read (FILE *file, lx_header *header, int start)
         memory[start + reloc] = (val >> 8);
         memory[start + reloc + 1] = (val & 0xff);
     }
+    mem_modified(start, header->text_size + header->data_size);
     return 1;
 }
 
@@ -22,6 +22,7 @@
 #include <string.h>
 #include "h8300.h"
 #include "peripherals.h"
+#include "brick.h"
 
 /** \file main.c
  * \brief main program to start emulator and gui.
@@ -30,88 +31,160 @@
  */
 
 
-#define TRAP_EXCEPTION 5
-
-extern void periph_init(int port);
-extern void savefile_init(void);
-extern void mem_init(char *);
-extern void frame_init(void);
-extern void lcd_init(void);
-extern void t16_init(void);
-extern void t8_init(void);
-extern void sound_init(void);
-extern void btn_init(void);
-extern void ws_init(void);
-extern void ser_init(void);
-extern void db_init(void);
-extern void ad_init(void);
-extern void wdog_init(void);
-extern void firm_init(void);
-extern void motor_init(void);
-extern void bibo_init(void);
-
-
 /** \brief start emulator and GUI
  *
  * Initializes all peripherals, 
  * checks if debugging is wanted
  * and starts the emulated H8300 CPU.
+ * With "-bricks n" n bricks are started, each in its own thread; brick
+ * i connects to the GUI server at port guiserverport + i and publishes
+ * its state in the observe file with the suffix ".i".
  * \param argc 0 or 1 
  * \param argv argv[1] = "-d" to wait for debugger.
  * \return 0 always.
  */
 int main(int argc, char**argv) {
-    int guiserverport = 0;
+    brick_config config;
     int arg_index = 1;
-	char *rom_file = NULL;
-    
+    int num_bricks = 1;
+
+    memset(&config, 0, sizeof(config));
     for (arg_index = 1; arg_index < argc; arg_index++) {
         if (strcmp(argv[arg_index], "-g") == 0 || strcmp(argv[arg_index], "-d") == 0 || strcmp(argv[arg_index], "-debug") == 0 || strcmp(argv[arg_index], "--debug") == 0) {
-            db_trap = TRAP_EXCEPTION;
+            config.debug = 1;
             
         } else if (strcmp(argv[arg_index], "-guiserverport") == 0) {
             arg_index++;
-            guiserverport = atoi(argv[arg_index]);
-            printf("guiserverport=%d\n", guiserverport);
+            config.guiserverport = atoi(argv[arg_index]);
+            printf("guiserverport=%d\n", config.guiserverport);
+        } else if (strcmp(argv[arg_index], "-speed") == 0) {
+            arg_index++;
+            if (arg_index >= argc || periph_set_speed(argv[arg_index]) < 0) {
+                fprintf(stderr, "Invalid speed, use a ratio like 1, 1/4 or max\n");
+                exit(1);
+            }
+            config.speed = argv[arg_index];
+            printf("speed=%s\n", config.speed);
+        } else if (strcmp(argv[arg_index], "-quantum") == 0
+                   || strcmp(argv[arg_index], "-maxlag") == 0) {
+            int usecs = arg_index + 1 < argc ? atoi(argv[arg_index + 1]) : 0;
+            if (usecs <= 0) {
+                fprintf(stderr, "Invalid %s, use a time in usecs\n", argv[arg_index] + 1);
+                exit(1);
+            }
+            if (strcmp(argv[arg_index], "-quantum") == 0)
+                config.pace_quantum = usecs;
+            else
+                config.max_lag = usecs;
+            printf("%s=%d\n", argv[arg_index] + 1, usecs);
+            arg_index++;
+        } else if (strcmp(argv[arg_index], "-fps") == 0) {
+            arg_index++;
+            config.output_rate = arg_index < argc ? atoi(argv[arg_index]) : 0;
+            if (config.output_rate <= 0) {
+                fprintf(stderr, "Invalid frame rate\n");
+                exit(1);
+            }
+            printf("fps=%d\n", config.output_rate);
+        } else if (strcmp(argv[arg_index], "-bricks") == 0) {
+            arg_index++;
+            num_bricks = arg_index < argc ? atoi(argv[arg_index]) : 0;
+            if (num_bricks < 1) {
+                fprintf(stderr, "Invalid number of bricks\n");
+                exit(1);
+            }
+#ifndef MULTI_BRICK
+            if (num_bricks > 1) {
+                fprintf(stderr, "Compiled without MULTI_BRICK, only one brick is supported\n");
+                exit(1);
+            }
+#endif
+            printf("bricks=%d\n", num_bricks);
+        } else if (strcmp(argv[arg_index], "-record") == 0
+                   || strcmp(argv[arg_index], "-replay") == 0) {
+            if (arg_index + 1 >= argc) {
+                fprintf(stderr, "Missing journal file for %s\n", argv[arg_index]);
+                exit(1);
+            }
+            if (strcmp(argv[arg_index], "-record") == 0)
+                config.record_file = argv[arg_index + 1];
+            else
+                config.replay_file = argv[arg_index + 1];
+            printf("%s=%s\n", argv[arg_index] + 1, argv[arg_index + 1]);
+            arg_index++;
+        } else if (strcmp(argv[arg_index], "-bootcache") == 0) {
+            if (arg_index + 1 >= argc) {
+                fprintf(stderr, "Missing directory for -bootcache\n");
+                exit(1);
+            }
+            config.boot_cache = argv[++arg_index];
+            printf("bootcache=%s\n", config.boot_cache);
+        } else if (strcmp(argv[arg_index], "-observe") == 0) {
+            if (arg_index + 1 >= argc) {
+                fprintf(stderr, "Missing file for -observe\n");
+                exit(1);
+            }
+            config.observe_file = argv[++arg_index];
+            printf("observe=%s\n", config.observe_file);
+        } else if (strcmp(argv[arg_index], "-scenario") == 0) {
+            if (arg_index + 1 >= argc) {
+                fprintf(stderr, "Missing file for -scenario\n");
+                exit(1);
+            }
+            config.scenario_file = argv[++arg_index];
+            printf("scenario=%s\n", config.scenario_file);
         } else if (strcmp(argv[arg_index], "-rom") == 0) {
             arg_index++;
-            rom_file = argv[arg_index];
-            printf("rom=%s\n", rom_file);
+            config.rom_file = argv[arg_index];
+            printf("rom=%s\n", config.rom_file);
         } else {
             fprintf(stderr, "Unrecognized argument: %s\n", argv[arg_index]);
-            fprintf(stderr, "USAGE: emu -rom <file> [-guiserverport port] [[-]-debug | -d | -g]\n");
+            fprintf(stderr, "USAGE: emu -rom <file> [-guiserverport port] [-speed ratio] [-quantum usecs] [-maxlag usecs] [-fps n] [-bricks n] [-record file | -replay file] [-bootcache dir] [-observe file] [-scenario file] [[-]-debug | -d | -g]\n");
             exit(1);
         }
     }
-    
-    mem_init(rom_file);
-    frame_init();
-    ser_init();
-    db_init();
-    periph_init(guiserverport);
-    savefile_init();
-    t16_init();
-    t8_init();
-        printf("BrickEmu: Preparing to Initialize Sound\n");
-    sound_init();
-        printf("BrickEmu: Sound Initialized\n");
-    btn_init();
-        printf("BrickEmu: Buttons Initialized\n");
-    lcd_init();
-        printf("BrickEmu: LCD Initialized\n");
-    ws_init();
-    ad_init();
-    wdog_init();
-    firm_init();
-    motor_init();
-    bibo_init();
 
-        printf("BrickEmu: Initialization Complete\n");
-        
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        db_trap = TRAP_EXCEPTION;
+    if (config.record_file && config.replay_file) {
+        fprintf(stderr, "Can't record and replay at the same time\n");
+        exit(1);
+    }
+    if ((config.record_file || config.replay_file) && num_bricks > 1) {
+        fprintf(stderr, "Record and replay support only one brick\n");
+        exit(1);
+    }
+    if (config.scenario_file
+        && (config.record_file || config.replay_file || num_bricks > 1)) {
+        /* a scenario repeats itself exactly, so there is no journal */
+        fprintf(stderr, "A scenario runs one brick without record or replay\n");
+        exit(1);
+    }
+
+#ifdef MULTI_BRICK
+    if (num_bricks > 1) {
+        brick **bricks = malloc(num_bricks * sizeof(brick *));
+        const char *observe_file = config.observe_file;
+        int i;
+
+        for (i = 0; i < num_bricks; i++) {
+            if (observe_file) {
+                char *name = malloc(strlen(observe_file) + 12);
+                sprintf(name, "%s.%d", observe_file, i);
+                config.observe_file = name;
+            }
+            bricks[i] = brick_create(&config);
+            if (!bricks[i])
+                exit(1);
+            if (config.guiserverport)
+                config.guiserverport++;
+        }
+        for (i = 0; i < num_bricks; i++)
+            brick_join(bricks[i]);
+        free(bricks);
+        return 0;
     }
+#endif
 
+    brick_init(&config);
     run_cpu();
 
     return 0;
@@ -22,6 +22,7 @@
 #include <string.h>
 #include "h8300.h"
 #include "memory.h"
+#include "symbols.h"
 
 /** \file memory.c
  * \brief memory data structures and routines
@@ -56,7 +57,7 @@
  * The whole memory of the brick is addressed
  * as byte array. 
  */
-uint8  memory[65536];
+BRICK_LOCAL uint8  memory[65536];
 /** \brief 64 KB array to describe different memory types
  *
  * The memtype array is used to handle different memory types.
@@ -64,11 +65,44 @@ uint8  memory[65536];
  * there exists a corresponding index entry in the memtype array describing 
  * its type. The memtype entries are filled according to the memory map.  
  */
-uint8  memtype[65536];
-register_funcs port[0x10000 - 0xff88];
-int wait_states;
+BRICK_LOCAL uint8  memtype[65536];
+/** \brief per page summary of memtype
+ *
+ * The memory access macros look up the page of an address here.  Pages
+ * of plain RAM and ROM are accessed directly, all others through the
+ * access functions of the page.  The entries must be kept in sync with
+ * memtype, so use mem_set_type and mem_clear_type to change the latter.
+ */
+BRICK_LOCAL mem_page mem_pages[MEM_PAGES];
+/** \brief number of pages with MEMTYPE_DEBUG bits, see run_cpu */
+BRICK_LOCAL int mem_debug_pages;
+BRICK_LOCAL register_funcs port[0x10000 - 0xff88];
+BRICK_LOCAL int wait_states;
+/** \brief extra cycles of a byte or word access compared to on-chip memory
+ *
+ * These are the per page access costs of mem_pages minus 2, for the
+ * assembler cores.
+ */
+BRICK_LOCAL uint8 mem_slow_byte_cycles[MEM_PAGES];
+BRICK_LOCAL uint8 mem_slow_word_cycles[MEM_PAGES];
+
+BRICK_LOCAL char *rom_file_name = NULL;
 
-char *rom_file_name = NULL;
+/** \brief a symbol of the ROM file, see rom_image */
+typedef struct {
+    uint16 addr;
+    int16  type;
+    char  *name;
+} rom_symbol;
+
+/** \brief the ROM and its symbols as read from rom_file_name
+ *
+ * The ROM file is only read once; a reset restores the ROM and its
+ * symbols from here.  NULL until the ROM was read.
+ */
+static BRICK_LOCAL uint8 *rom_image;
+static BRICK_LOCAL rom_symbol *rom_symbols;
+static BRICK_LOCAL int rom_num_symbols;
 
 
 
@@ -128,6 +162,8 @@ void SET_BYTE(uint16 addr, uint8 val) {
 #ifdef DEBUG_MEM
     printf ("writing %04x: %02x <- %02x\n", addr & 0xffff, memory[addr], val);
 #endif
+    if ((type & MEMTYPE_CODE))
+        cpu_invalidate_code(addr, 1);
     if ((type & MEMTYPE_MOTOR)) {
         set_motor(val);
     } else if ((type & MEMTYPE_DIV)) {
@@ -152,6 +188,8 @@ void SET_WORD(uint16 addr, uint16 val) {
     printf ("writing %04x: %04x <- %04x\n", addr & 0xffff, 
             memory[addr]<<8 | memory[addr+1], val);
 #endif
+    if (((type | memtype[(uint16) (addr + 1)]) & MEMTYPE_CODE))
+        cpu_invalidate_code(addr, 2);
     memory[addr] = val >> 8;
     memory[addr+1] = val & 0xff;
     if ((type & MEMTYPE_MOTOR)) {
@@ -171,15 +209,170 @@ void SET_WORD(uint16 addr, uint16 val) {
     }
 }
 
+/** \brief get the byte at the given address, checking its memory type
+ * \param addr: 2-Byte word
+ * \returns byte
+ */
+static uint8 mem_get_byte(uint16 addr) {
+    if ((memtype[addr] & MEMTYPE_DIV))
+        return get_byte_div(addr);
+    return memory[addr];
+}
 
-/** \brief read in the ROM
+/** \brief get the word at the given address, checking its memory type
+ * \param addr: 2-Byte word
+ * \returns 2-Byte word
+ */
+static uint16 mem_get_word(uint16 addr) {
+    if ((addr & 1) || (memtype[addr] & MEMTYPE_DIV))
+        return get_word_div(addr);
+    return (memory[addr] << 8) | memory[addr + 1];
+}
+
+/** \brief access functions for pages with mixed memory types */
+static const page_funcs mixed_page_funcs = {
+    mem_get_byte, mem_get_word, SET_BYTE, SET_WORD
+};
+/** \brief access functions for I/O pages and illegal memory */
+static const page_funcs div_page_funcs = {
+    get_byte_div, get_word_div, SET_BYTE, SET_WORD
+};
+
+/** \brief compute the access costs of a page
+ *
+ * On-chip memory needs 2 cycles per access, the on-chip registers 3
+ * per byte.  External memory is accessed a byte at a time over the 8
+ * bit bus with 3 cycles plus the wait states each.
+ * \param page: the page number
+ */
+static void mem_update_cycles(int page) {
+    mem_page *p = &mem_pages[page];
+    int addr = page << MEM_PAGE_BITS;
+    int byte_cycles;
+
+    if ((memtype[addr] & MEMTYPE_FAST)) {
+        p->byte_cycles = p->word_cycles = 2;
+    } else {
+        byte_cycles = addr < ON_CHIP_START ? 3 + wait_states : 3;
+        p->byte_cycles = byte_cycles;
+        p->word_cycles = 2 * byte_cycles;
+    }
+    mem_slow_byte_cycles[page] = p->byte_cycles - 2;
+    mem_slow_word_cycles[page] = p->word_cycles - 2;
+}
+
+/** \brief set the number of wait states of external memory
+ *
+ * Recomputes the access costs of all pages.  The cached code is
+ * dropped as it contains the fetch costs.
+ */
+void mem_set_wait_states(int states) {
+    int page;
+
+    if (states == wait_states)
+        return;
+    wait_states = states;
+    for (page = 0; page < MEM_PAGES; page++)
+        mem_update_cycles(page);
+    cpu_invalidate_code(0, 0x10000);
+}
+
+/** \brief recompute the page table entry of a page from memtype
+ * \param page: the page number
+ */
+static void mem_update_page(int page) {
+    mem_page *p = &mem_pages[page];
+    const uint8 *type = memtype + (page << MEM_PAGE_BITS);
+    uint8 all = 0xff;
+    int i;
+
+    if ((p->types & MEMTYPE_DEBUG))
+        mem_debug_pages--;
+    p->types = 0;
+    for (i = 0; i < (1 << MEM_PAGE_BITS); i++) {
+        p->types |= type[i];
+        all &= type[i];
+    }
+    if ((p->types & MEMTYPE_DEBUG))
+        mem_debug_pages++;
+    p->read = (p->types & MEMTYPE_DIV) ? NULL : memory;
+    p->write = (p->types & (MEMTYPE_DIV | MEMTYPE_MOTOR | MEMTYPE_CODE))
+        ? NULL : memory;
+    p->funcs = (all & MEMTYPE_DIV) ? &div_page_funcs : &mixed_page_funcs;
+    mem_update_cycles(page);
+}
+
+/** \brief set memtype bits for a range of memory
+ * \param addr: start address
+ * \param len: number of bytes
+ * \param type: the memtype bits to set
+ */
+void mem_set_type(uint16 addr, int len, uint8 type) {
+    int i, page = -1;
+
+    for (i = addr; i < addr + len && i < 0x10000; i++) {
+        if ((memtype[i] & type) == type)
+            continue;
+        memtype[i] |= type;
+        if ((i >> MEM_PAGE_BITS) != page) {
+            if (page >= 0)
+                mem_update_page(page);
+            page = i >> MEM_PAGE_BITS;
+        }
+    }
+    if (page >= 0)
+        mem_update_page(page);
+}
+
+/** \brief clear memtype bits for a range of memory
+ * \param addr: start address
+ * \param len: number of bytes
+ * \param type: the memtype bits to clear
+ */
+void mem_clear_type(uint16 addr, int len, uint8 type) {
+    int i, page = -1;
+
+    for (i = addr; i < addr + len && i < 0x10000; i++) {
+        if (!(memtype[i] & type))
+            continue;
+        memtype[i] &= ~type;
+        if ((i >> MEM_PAGE_BITS) != page) {
+            if (page >= 0)
+                mem_update_page(page);
+            page = i >> MEM_PAGE_BITS;
+        }
+    }
+    if (page >= 0)
+        mem_update_page(page);
+}
+
+/** \brief notify that memory was changed behind the CPU's back
+ *
+ * This must be called whenever memory is modified directly instead of
+ * through SET_BYTE or SET_WORD, e.g. by the program loaders or the
+ * debugger.  It drops all predecoded code covering the range and
+ * brings the page table in sync with memtype again.
+ * \param addr: start address
+ * \param len: number of bytes changed
+ */
+void mem_modified(uint16 addr, int len) {
+    int page;
+
+    cpu_invalidate_code(addr, len);
+    if (len <= 0)
+        return;
+    for (page = addr >> MEM_PAGE_BITS;
+         page <= (addr + len - 1) >> MEM_PAGE_BITS && page < MEM_PAGES; page++)
+        mem_update_page(page);
+}
+
+/** \brief read in the ROM file
  *
- * Reads in the ROM file.
  * The file is specified by the "-rom" command-line argument.
  * The file must be in "coff", "bin", or "srec" format.
  * \return 1 on success, 0 otherwise.
  */
-int read_rom() {
+static int read_rom_file(void) {
     int result = 0;
     char *rom_file_ext = NULL;
     FILE *romfile;
@@ -194,6 +387,7 @@ int read_rom() {
             }
         } else if ((strcmp(rom_file_ext, ".bin") == 0) && (romfile = fopen(rom_file_name, "rb"))) {
             fread(memory, 0x4000, 1, romfile);
+            mem_modified(0, 0x4000);
             result = 1;
         } else if ((strcmp(rom_file_ext, ".srec") == 0) && (romfile = fopen(rom_file_name, "r"))) {
             if (srec_read(romfile, 0) >= 0) {
@@ -209,6 +403,54 @@ int read_rom() {
     return result;
 }
 
+static void add_rom_symbol(void *info, uint16 addr, int16 type, char *name) {
+    rom_symbol *sym;
+
+    rom_symbols = realloc(rom_symbols,
+                          (rom_num_symbols + 1) * sizeof(rom_symbol));
+    sym = &rom_symbols[rom_num_symbols++];
+    sym->addr = addr;
+    sym->type = type;
+    sym->name = strdup(name);
+}
+
+/** \brief read in the ROM
+ *
+ * The first call reads the ROM file and keeps a copy of the ROM and
+ * its symbols, later calls restore them from the copy.  The copy
+ * covers only the ROM area up to ROM_END; data that a srec or coff
+ * file loads above it is not restored.  The symbols must have been
+ * removed before.
+ * \return 1 on success, 0 otherwise.
+ */
+int read_rom() {
+    int i;
+
+    if (!rom_image) {
+        if (!read_rom_file())
+            return 0;
+        rom_image = malloc(ROM_END);
+        memcpy(rom_image, memory, ROM_END);
+        symbols_iterate(add_rom_symbol, NULL);
+        return 1;
+    }
+    memcpy(memory, rom_image, ROM_END);
+    mem_modified(0, ROM_END);
+    for (i = 0; i < rom_num_symbols; i++)
+        symbols_add(rom_symbols[i].addr, rom_symbols[i].type,
+                    strdup(rom_symbols[i].name));
+    return 1;
+}
+
+/** \brief get the ROM as read from the ROM file
+ *
+ * \return the size of the ROM, 0 if it wasn't read yet.
+ */
+int mem_rom_image(const uint8 **image) {
+    *image = rom_image;
+    return rom_image ? ROM_END : 0;
+}
+
 /** \brief initialize brick memory 
  * Initializes memory and reads in the ROM file.
  * \return 1 on success, 0 otherwise.
@@ -244,6 +486,8 @@ void mem_init(char *rom_file) {
         memtype[i++] = MEMTYPE_MOTOR;
     while(i < 0x10000)
         memtype[i++] = MEMTYPE_DIV;
+    for (i = 0; i < MEM_PAGES; i++)
+        mem_update_page(i);
 
 #if 0  /* Code to debug specific instructions */
     for (i = 0x9e8a ; i < 0x9eca; i+=2)
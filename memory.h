@@ -26,10 +26,14 @@
 #define MEMTYPE_LOG        0x02
 #define MEMTYPE_WRITETRAP  0x04
 #define MEMTYPE_READTRAP   0x08
+#define MEMTYPE_CODE       0x10
 #define MEMTYPE_MOTOR      0x20
 #define MEMTYPE_FAST       0x40
 #define MEMTYPE_DIV        0x80
 
+/* memtype bits that only the checked cpu loop looks at */
+#define MEMTYPE_DEBUG      (MEMTYPE_BREAKPOINT | MEMTYPE_LOG | MEMTYPE_READTRAP)
+
 typedef uint8 (*get_byte_func) (void);
 typedef void (*set_byte_func) (uint8 val);
 typedef struct {
@@ -37,41 +41,100 @@ typedef struct {
     set_byte_func set;
 } register_funcs;
 
-extern uint8 memory[65536];
-extern uint8 memtype[65536];
-extern register_funcs port[0x10000 - 0xff88];
-extern int wait_states;
+/** \brief access functions for the bytes of a page that can't be
+ *  accessed directly
+ */
+typedef struct {
+    uint8  (*get_byte) (uint16 addr);
+    uint16 (*get_word) (uint16 addr);
+    void   (*set_byte) (uint16 addr, uint8 val);
+    void   (*set_word) (uint16 addr, uint16 val);
+} page_funcs;
+
+/** \brief number of address bits covered by a page of mem_pages
+ *
+ * The boundaries between on-chip and external memory and between
+ * memory and I/O registers must be page aligned.  128 byte pages are
+ * small enough for that.
+ */
+#define MEM_PAGE_BITS 7
+#define MEM_PAGES     (0x10000 >> MEM_PAGE_BITS)
+
+/** \brief summary of the memtype entries of a page
+ *
+ * read is memory if every byte of the page can be read directly and
+ * NULL otherwise, write likewise for writing.  The other accesses go
+ * through funcs, which look at memtype.  types is the or of all memtype
+ * entries of the page, so the cpu only needs to check memtype for
+ * breakpoints and watchpoints if the page has one.  byte_cycles and
+ * word_cycles are the cost of a byte or word access, including the
+ * wait states of external memory; they are the same for reading,
+ * writing and fetching.
+ */
+typedef struct {
+    uint8 *read;
+    uint8 *write;
+    const page_funcs *funcs;
+    uint8  types;
+    uint8  byte_cycles;
+    uint8  word_cycles;
+} mem_page;
+
+extern BRICK_LOCAL uint8 memory[65536];
+extern BRICK_LOCAL uint8 memtype[65536];
+extern BRICK_LOCAL mem_page mem_pages[MEM_PAGES];
+extern BRICK_LOCAL int mem_debug_pages;
+extern BRICK_LOCAL register_funcs port[0x10000 - 0xff88];
+extern BRICK_LOCAL int wait_states;
+extern BRICK_LOCAL uint8 mem_slow_byte_cycles[MEM_PAGES];
+extern BRICK_LOCAL uint8 mem_slow_word_cycles[MEM_PAGES];
 
 extern uint8 get_byte_div(uint16 addr);
 extern uint16 get_word_div(uint16 addr);
 extern void SET_BYTE(uint16 addr, uint8 val);
 extern void SET_WORD(uint16 addr, uint16 val);
+extern void mem_modified(uint16 addr, int len);
+extern void mem_set_type(uint16 addr, int len, uint8 type);
+extern void mem_clear_type(uint16 addr, int len, uint8 type);
+extern void mem_set_wait_states(int states);
 extern int read_rom(void);
+extern int mem_rom_image(const uint8 **image);
 extern void set_motor(unsigned char val);
 
+#define MEM_PAGE(addr)   (&mem_pages[(uint16) (addr) >> MEM_PAGE_BITS])
+
 #define GET_BYTE(addr) \
-    (!(memtype[(uint16)(addr)] & MEMTYPE_DIV) ? \
-       memory[(uint16)(addr)] : get_byte_div(addr))
+    (MEM_PAGE(addr)->read ? \
+       MEM_PAGE(addr)->read[(uint16) (addr)] \
+     : MEM_PAGE(addr)->funcs->get_byte(addr))
 
 #define GET_WORD(addr) \
-    (!((addr) & 1) && !(memtype[(uint16)(addr)] & MEMTYPE_DIV) ? \
-      (memory[(uint16)(addr)] << 8) | memory[(uint16) (addr) + 1] \
-     : get_word_div(addr))
+    (!((addr) & 1) && MEM_PAGE(addr)->read ? \
+      (MEM_PAGE(addr)->read[(uint16) (addr)] << 8) \
+       | MEM_PAGE(addr)->read[(uint16) (addr) + 1] \
+     : MEM_PAGE(addr)->funcs->get_word(addr))
+
+#define PUT_BYTE(addr, val) \
+    (MEM_PAGE(addr)->write ? \
+       (void) (MEM_PAGE(addr)->write[(uint16) (addr)] = (val)) \
+     : MEM_PAGE(addr)->funcs->set_byte(addr, val))
+
+#define PUT_WORD(addr, val) \
+    (!((addr) & 1) && MEM_PAGE(addr)->write ? \
+       (void) (MEM_PAGE(addr)->write[(uint16) (addr)] = (val) >> 8, \
+               MEM_PAGE(addr)->write[(uint16) (addr) + 1] = (val) & 0xff) \
+     : MEM_PAGE(addr)->funcs->set_word(addr, val))
 
 #define GET_BYTE_CYCLES(addr) \
-    (cycles += 2 + ((~memtype[(uint16)(addr)] & MEMTYPE_FAST) >> 6), \
-     GET_BYTE(addr))
+    (cycles += MEM_PAGE(addr)->byte_cycles, GET_BYTE(addr))
 
 #define GET_WORD_CYCLES(addr) \
-    (cycles += 2 + ((~memtype[(uint16)(addr)] & MEMTYPE_FAST) >> 4), \
-     GET_WORD(addr))
+    (cycles += MEM_PAGE(addr)->word_cycles, GET_WORD(addr))
 
 #define SET_BYTE_CYCLES(addr, val) \
-    (cycles += 2 + ((~memtype[(uint16)(addr)] & MEMTYPE_FAST) >> 6), \
-     SET_BYTE(addr, val))
+    (cycles += MEM_PAGE(addr)->byte_cycles, PUT_BYTE(addr, val))
 
 #define SET_WORD_CYCLES(addr, val) \
-    (cycles += 2 + ((~memtype[(uint16)(addr)] & MEMTYPE_FAST) >> 4), \
-     SET_WORD(addr, val))
+    (cycles += MEM_PAGE(addr)->word_cycles, PUT_WORD(addr, val))
 
 #endif
@@ -3,23 +3,27 @@
 #include <string.h>
 #include "h8300.h"
 #include "peripherals.h"
+#include "observe.h"
 #include "memory.h"
 
 #define UPDATE_INTERVAL (100 * 16000)
 #define SCALER 256
 
-static cycle_count_t next_output_cycles = 0;
-static cycle_count_t motor_cycles = 0;
+static BRICK_LOCAL cycle_count_t next_output_cycles = 0;
+static BRICK_LOCAL cycle_count_t motor_cycles = 0;
 
-static cycle_count_t      on[3];
-static cycle_count_t last_on[3];
-static int      dir[3];
-static int last_dir[3];
+static BRICK_LOCAL cycle_count_t      on[3];
+static BRICK_LOCAL cycle_count_t last_on[3];
+static BRICK_LOCAL int      dir[3];
+static BRICK_LOCAL int last_dir[3];
 
-static char motor_val;
-static char  cur_analog_active;
-static char      analog_active;
-static char last_analog_active;
+static BRICK_LOCAL char motor_val;
+static BRICK_LOCAL char  cur_analog_active;
+static BRICK_LOCAL char      analog_active;
+static BRICK_LOCAL char last_analog_active;
+
+static void motor_update_time(void);
+static BRICK_LOCAL periph_event motor_event = { motor_update_time, 0, -1 };
 
 static void motor_update() {
     cycle_count_t dcycles = cycles - motor_cycles;
@@ -51,7 +55,9 @@ static void motor_update_time() {
             on[i] /= UPDATE_INTERVAL / SCALER;
             if (dir[i] != last_dir[i] || on[i] != last_on[i]) {
                 sprintf(out, "M%1d,%1d,%d\n", i, dir[i], on[i]);
-                write(periph_fd, out, strlen(out));
+                periph_update(OUT_MOTOR + i, out);
+                OBSERVE(motor_dir[i], dir[i]);
+                OBSERVE(motor_on[i], on[i]);
                 last_on[i] = on[i];
                 last_dir[i] = dir[i];
             }
@@ -62,15 +68,14 @@ static void motor_update_time() {
         analog_changed = analog_active ^ last_analog_active;
         if (analog_changed) {
             sprintf(out, "A%d\n", analog_active & 7);
-            write(periph_fd, out, strlen(out));
+            periph_update(OUT_ANALOG, out);
+            OBSERVE(analog_active, analog_active & 7);
             last_analog_active = analog_active;
         }
         analog_active = cur_analog_active;
     }
 
-    if (next_timer_cycle > next_output_cycles) {
-        next_timer_cycle = next_output_cycles;
-    }
+    periph_schedule(&motor_event, next_output_cycles);
 }
 
 void set_analog_active(unsigned char val) {
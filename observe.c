@@ -0,0 +1,88 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "observe.h"
+
+/** \file observe.c
+ * \brief publish the state of the brick in shared memory
+ *
+ * The peripherals store their state with OBSERVE where they also tell
+ * the GUI about it, synchronize_time stores the CPU counters.  Every
+ * change is a few stores and two memory barriers, no system call.
+ */
+
+BRICK_LOCAL observe_state *observe;
+
+int observe_init(const char *path) {
+    observe_state *state;
+    int fd;
+
+    if (!path) {
+        state = mmap(NULL, sizeof(observe_state), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (state == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+    } else {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+        if (ftruncate(fd, sizeof(observe_state)) < 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        state = mmap(NULL, sizeof(observe_state), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+        close(fd);
+        if (state == MAP_FAILED) {
+            perror(path);
+            return -1;
+        }
+    }
+    /* a brick forked from a checkpoint starts with the parent's state */
+    if (observe) {
+        memcpy(state, observe, sizeof(observe_state));
+        munmap(observe, sizeof(observe_state));
+        state->seq = 0;
+    }
+    state->magic = OBSERVE_MAGIC;
+    state->version = OBSERVE_VERSION;
+    state->size = sizeof(observe_state);
+    observe = state;
+    return 0;
+}
+
+void observe_begin(void) {
+    observe->seq++;
+    __sync_synchronize();
+}
+
+void observe_end(void) {
+    __sync_synchronize();
+    observe->seq++;
+}
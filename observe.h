@@ -0,0 +1,105 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#ifndef _OBSERVE_H_
+#define  _OBSERVE_H_
+
+#include "types.h"
+
+/** \file observe.h
+ * \brief publish the state of the brick in shared memory
+ *
+ * With "-observe file" the emulator maps file, e.g. one in /dev/shm,
+ * and keeps an observe_state in it up to date.  Observers map the
+ * file read-only and read it at any rate without talking to the
+ * emulator.
+ *
+ * The state is protected by a sequence lock: seq is odd while the
+ * emulator changes the state.  A reader copies the state and uses the
+ * copy only if seq was even and didn't change in between.
+ */
+
+#define OBSERVE_MAGIC   0x4272456f /* "BrEo" */
+#define OBSERVE_VERSION 1
+
+/** \brief the layout of the observe file
+ *
+ * All numbers are in host byte order.  The layout has no padding; new
+ * fields are only appended and increase size.
+ */
+typedef struct {
+    uint32 magic;
+    uint32 version;
+    /** \brief size of this structure */
+    uint32 size;
+    /** \brief sequence lock, odd while the state changes */
+    volatile uint32 seq;
+    uint64 cycles;
+    /** \brief cycles skipped in idle loops */
+    uint64 idle_cycles;
+    /** \brief real time in usecs the CPU was running */
+    uint64 real_usecs;
+    /** \brief largest lag behind real time in usecs */
+    uint64 max_lag;
+    /** \brief target speed in 1/1000, 0 when unthrottled */
+    uint32 target_speed;
+    uint16 pc;
+    /** \brief the segments of the LCD, as sent in the L lines */
+    uint8 lcd[12];
+    uint8 lcd_enabled;
+    /** \brief the buttons, the bit of a pressed button is clear */
+    uint8 buttons;
+    /** \brief bit mask of the active sensors */
+    uint8 analog_active;
+    /** \brief motor direction and power 0-256, as sent in the M lines */
+    uint8 motor_dir[3];
+    uint16 motor_on[3];
+    /** \brief the A/D converter values */
+    uint16 sensors[8];
+    uint16 reserved;
+} observe_state;
+
+/** \brief the mapped state or NULL if the brick isn't observed */
+extern BRICK_LOCAL observe_state *observe;
+
+/** \brief map the observe file
+ *
+ * A brick that was observed before stops writing the old file.  If
+ * path is NULL the state is kept in private memory, so the emulator
+ * itself can watch it, e.g. the scenario runner.
+ * \returns 0 on success, -1 if the file can't be mapped.
+ */
+extern int observe_init(const char *path);
+
+/** \brief begin and end a change of the state */
+extern void observe_begin(void);
+extern void observe_end(void);
+
+/** \brief set one field of the observed state, e.g.
+ * OBSERVE(lcd[ptr], data)
+ */
+#define OBSERVE(field, value) do {              \
+        if (observe) {                          \
+            observe_begin();                    \
+            observe->field = (value);           \
+            observe_end();                      \
+        }                                       \
+    } while (0)
+
+#endif
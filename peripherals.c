@@ -21,17 +21,27 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <netinet/in.h> /* for htonx/ntohx */
 #include "h8300.h"
 #include "socket.h"
 #include "memory.h"
 #include "peripherals.h"
+#include "debugger.h"
 #include "frame.h"
+#include "brick.h"
+#include "replay.h"
+#include "observe.h"
+#include "scenario.h"
 
-extern int monitorport;
-extern int debuggerfd;
+extern BRICK_LOCAL int monitorport;
+extern BRICK_LOCAL int debuggerfd;
 
 /** \file peripherals.c
  * \brief routines controlling interaction with the environment
@@ -72,44 +82,117 @@ extern int debuggerfd;
 /** \brief counter that holds the number of real-time usecs corresponding to
  * lastcycles
  *
- * This contains the number of real-time usecs since EPOCH modulo 2^32 that
- * corresponds to the time when processor had executed lastcycles cycles.
+ * This contains the time of the monotonic clock in usecs (see
+ * periph_clock) that corresponds to the time when processor had executed
+ * lastcycles cycles.
  */
-static cycle_count_t lastusecs;
+static BRICK_LOCAL cycle_count_t lastusecs;
 
 /** \brief counter that holds the last number of cycles.
  * 
  * This is updated in synchronized_time together with lastusecs.
  */
-static cycle_count_t lastcycles;
+static BRICK_LOCAL cycle_count_t lastcycles;
 
 /** \brief time in usecs for the next sleep
  *
  * Only if lastusecs > nextsleep we actually start sleeping and/or wait
- * for input.  For performance reasons we only sleep if more than a
- * millisecond simulated time has passed.
+ * for input.  For performance reasons we only sleep if more than
+ * pace_quantum usecs have passed.
  */
-static cycle_count_t nextsleep;
+static BRICK_LOCAL cycle_count_t nextsleep;
+
+/** \brief the pacing parameters, see periph_set_pacing */
+static BRICK_LOCAL cycle_count_t pace_quantum = PACE_QUANTUM,
+    max_lag = MAX_LAG;
+
+/** \brief the largest lag behind real time seen so far in usecs */
+static BRICK_LOCAL cycle_count_t max_lag_seen;
+
+/** \brief the current slow down as fraction slow_down_num / slow_down_den
+ *
+ * This is the number of real-time usecs per usec of simulated time.  It
+ * starts with SLOW_DOWN and can be changed with periph_set_speed.  If
+ * slow_down_num is 0 the emulator runs unthrottled, i.e. as fast as the
+ * host allows.
+ */
+static BRICK_LOCAL cycle_count_t slow_down_num = 1000 * SLOW_DOWN,
+    slow_down_den = 1000;
+
+/** \brief the part of the real time, in 1/slow_down_den usecs, that was
+ * not yet added to lastusecs
+ *
+ * Without it every sync would round down and a ratio a/b would run too
+ * fast, or not be paced at all if less than b usecs pass per sync.
+ */
+static BRICK_LOCAL cycle_count_t slow_down_rem;
 
 
 /** \brief System Control Register (SYSCR)
  *
  * 8 Bit register controlling the operation of the chip
  */
-static uint8  syscr;
+static BRICK_LOCAL uint8  syscr;
 
 /** \brief The number of real-time usecs when simulation started.
  * 
- * This holds the number of usecs since EPOCH modulo 2^32 when simulation
+ * This holds the time of the monotonic clock when simulation
  * started.  When CPU is freezed, startusecs is increased by the number of
  * freezed usecs.
  *
  * In any case the real-time that matches the current simulated time is
  * startusecs + (cycles / CYCLES_PER_USECS) * SLOW_DOWN.
  *
- * startusecs is only used for debugging purposes.  It can be removed later.
+ * startusecs is only used for debugging purposes and the speed report
+ * of periph_exit.
+ */
+static BRICK_LOCAL cycle_count_t startusecs;
+
+/** \brief maximum length of a state line and of the output queue */
+#define OUT_LINE_MAX  16
+#define OUT_QUEUE_MAX 4096
+
+/** \brief the output to the GUI
+ *
+ * A state change, e.g. of an LCD segment, is only stored in its slot.
+ * Once per frame, and whenever the CPU is stopped, the slots that
+ * differ from what was queued before are appended to out_queue; a
+ * slot that changes several times in a frame is sent once with its
+ * last value.  Replies to commands are appended at once.  The queue
+ * is written with non-blocking sends.  If the GUI doesn't keep up the
+ * rest stays queued and slots that don't fit are sent in a later
+ * frame, so a slow GUI only misses intermediate states and never
+ * slows down the emulation.  Only a reply that doesn't fit in the full
+ * queue is dropped.
+ */
+static BRICK_LOCAL char out_slot[OUT_SLOTS][OUT_LINE_MAX];
+static BRICK_LOCAL char out_queued[OUT_SLOTS][OUT_LINE_MAX];
+static BRICK_LOCAL char out_queue[OUT_QUEUE_MAX];
+static BRICK_LOCAL int out_len;
+/** \brief the slot to look at first in the next frame
+ *
+ * When the queue fills up, the next frame continues after the last
+ * slot that was queued, so every slot gets its turn.
  */
-static cycle_count_t startusecs;
+static BRICK_LOCAL int out_next;
+/** \brief usecs between two frames and the time of the last frame */
+static BRICK_LOCAL cycle_count_t out_interval = 1000000 / OUTPUT_RATE,
+    out_usecs;
+
+/** \brief size of the receive buffer for the GUI commands */
+#define IN_BUF_MAX 4096
+
+/** \brief the input from the GUI
+ *
+ * Every wakeup for the GUI socket does one read into in_buf.  The
+ * commands are lines, so everything up to the last newline is
+ * complete and is dispatched at once; the handlers get their bytes
+ * from in_buf[in_pos..in_end) through periph_recv.  A partial line
+ * stays in the buffer until the rest arrives, so a slowly sent
+ * command never blocks the CPU.
+ */
+static BRICK_LOCAL char in_buf[IN_BUF_MAX];
+static BRICK_LOCAL int in_len, in_pos, in_end;
 
 
 /** \brief flag to mark the CPU as stopped
@@ -119,39 +202,455 @@ static cycle_count_t startusecs;
  * doesn't perform any cycles while stopped.  When the CPU continues
  * processing, the value is set back to 0.
  */
-static int stopped;
+static BRICK_LOCAL int stopped;
+
+/** \brief the current time in usecs
+ *
+ * Uses the monotonic clock, which doesn't jump when the wall clock is
+ * set.
+ */
+static cycle_count_t periph_clock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (cycle_count_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
 /** \brief flag to mark the CPU as sleeping
  * When the CPU is sleeping caused by a sleep instruction,
  * the value is set to 1 to mark the CPU as sleeping. When 
  * the CPU continues processing, the value is set back to 0.
  */
-static int sleeping;
+static BRICK_LOCAL int sleeping;
 
 /** \brief peripheral socket file descriptor
  * File descriptor of the socket used for the communication
  * with the peripherals.
  */
-int periph_fd;
+BRICK_LOCAL int periph_fd;
 
 /** \brief array to hold all peripherals 
  *
  * This array is used to register the different
  * kinds of peripherals (buttons, sensors etc.)
  */
-peripheral_ops peripherals[100];
+BRICK_LOCAL peripheral_ops peripherals[100];
 
 /** \brief number of registered peripherals
  * This counter is incremented each time a
  * peripheral is registered.
  */
-int num_peripherals;
+BRICK_LOCAL int num_peripherals;
+
+/** \brief maximum number of scheduled peripheral deadlines per queue
+ */
+#define MAX_PERIPH_EVENTS 32
+
+/** \brief binary min heap of peripheral deadlines
+ *
+ * heap[0] is the next deadline; the children of heap[i] are
+ * heap[2i+1] and heap[2i+2].  Every event knows its slot in the
+ * heap, so it can be rescheduled or cancelled in O(log n).
+ */
+typedef struct event_queue {
+    periph_event *heap[MAX_PERIPH_EVENTS];
+    int count;
+} event_queue;
+
+/** \brief the deadlines of the peripherals
+ *
+ * event_queues[1] holds the deadlines that may raise a NMI, these
+ * are checked even when interrupts are disabled; event_queues[0]
+ * holds all others.
+ */
+static BRICK_LOCAL event_queue event_queues[2];
+
+/** \brief the cycle when check_irq runs at the latest
+ *
+ * Even if no peripheral has a deadline, check_irq must run from time
+ * to time to synchronize with real time and read the input from the
+ * GUI.
+ */
+static BRICK_LOCAL cycle_count_t next_sync_cycle;
+
+/** \brief the interrupt vectors that are taken even if the I bit is set
+ *
+ * These are the reset (vector 0) and the NMI (vector 3).
+ */
+#define IRQ_NMI_MASK 0x0f
+
+/** \brief bit mask of the requested interrupt vectors
+ *
+ * Bit n is set if the interrupt with vector n is requested.  The lower
+ * the vector, the higher the priority.
+ */
+static BRICK_LOCAL uint64 irq_pending;
+
+/** \brief the acknowledge routines of the interrupt vectors
+ *
+ */
+static BRICK_LOCAL void (*irq_ack[64]) (int vector);
+
+/** \brief the cycle when the interrupt was requested
+ *
+ * Used to measure the interrupt latency.
+ */
+static BRICK_LOCAL cycle_count_t irq_raised_cycle[64];
 
 /** \brief file descriptor set for the communication with the peripherals
  * Set of file descriptors used by SELECT to check for peripheral events.
  *
  */
-static fd_set rdfds;
+static BRICK_LOCAL fd_set rdfds;
+
+/** \brief compute next_timer_cycle and next_nmi_cycle from the deadlines
+ *
+ * A requested interrupt is due immediately.  While the I bit of ccr is
+ * set the CPU only looks at next_nmi_cycle.
+ */
+static void periph_update_next_cycle(void) {
+    cycle_count_t next = next_sync_cycle;
+
+    if (event_queues[1].count && event_queues[1].heap[0]->cycle < next)
+        next = event_queues[1].heap[0]->cycle;
+    if ((irq_pending & IRQ_NMI_MASK) && cycles < next)
+        next = cycles;
+    next_nmi_cycle = next;
+    if (event_queues[0].count && event_queues[0].heap[0]->cycle < next)
+        next = event_queues[0].heap[0]->cycle;
+    if (irq_pending && cycles < next)
+        next = cycles;
+    next_timer_cycle = next;
+}
+
+/** \brief put event into slot of the queue and restore the heap order
+ *
+ * The event moves up while its deadline is earlier than its parent's
+ * and down while it is later than one of its children.
+ */
+static void queue_place(event_queue *queue, int slot, periph_event *event) {
+    periph_event **heap = queue->heap;
+
+    while (slot > 0 && event->cycle < heap[(slot - 1) / 2]->cycle) {
+        heap[slot] = heap[(slot - 1) / 2];
+        heap[slot]->slot = slot;
+        slot = (slot - 1) / 2;
+    }
+    while (2 * slot + 1 < queue->count) {
+        int child = 2 * slot + 1;
+        if (child + 1 < queue->count
+            && heap[child + 1]->cycle < heap[child]->cycle)
+            child++;
+        if (heap[child]->cycle >= event->cycle)
+            break;
+        heap[slot] = heap[child];
+        heap[slot]->slot = slot;
+        slot = child;
+    }
+    heap[slot] = event;
+    event->slot = slot;
+}
+
+/** \brief remove event from the queue, without updating next_timer_cycle
+ *
+ */
+static void queue_remove(periph_event *event) {
+    event_queue *queue = &event_queues[event->nmi];
+    int slot = event->slot;
+
+    event->slot = -1;
+    if (--queue->count > slot)
+        queue_place(queue, slot, queue->heap[queue->count]);
+}
+
+void periph_schedule(periph_event *event, cycle_count_t cycle) {
+    event_queue *queue = &event_queues[event->nmi];
+
+    event->cycle = cycle;
+    if (event->slot < 0) {
+        if (queue->count >= MAX_PERIPH_EVENTS) {
+            printf("Too many peripheral events!\n");
+            exit(1);
+        }
+        queue_place(queue, queue->count++, event);
+    } else
+        queue_place(queue, event->slot, event);
+    periph_update_next_cycle();
+}
+
+void periph_cancel(periph_event *event) {
+    if (event->slot >= 0) {
+        queue_remove(event);
+        periph_update_next_cycle();
+    }
+}
+
+void irq_set(int vector, int pending) {
+    uint64 bit = (uint64) 1 << vector;
+
+    if (pending) {
+        if (!(irq_pending & bit)) {
+            irq_pending |= bit;
+            irq_raised_cycle[vector] = cycles;
+            periph_update_next_cycle();
+        }
+    } else if (irq_pending & bit) {
+        irq_pending &= ~bit;
+        periph_update_next_cycle();
+    }
+}
+
+void irq_set_ack(int vector, void (*ack) (int vector)) {
+    irq_ack[vector] = ack;
+}
+
+/** \brief run the peripherals whose deadline is reached
+ *
+ * Takes every event that is due out of the queues and calls its
+ * update_time.  The peripheral schedules its next deadline there.
+ * If an interrupt is still pending it is scheduled for the current
+ * cycle again, so the events are collected first; otherwise this
+ * would never end.
+ */
+static void periph_run_events(void) {
+    periph_event *due[2 * MAX_PERIPH_EVENTS];
+    int i, count = 0;
+
+    for (i = 0; i < 2; i++) {
+        event_queue *queue = &event_queues[i];
+        while (queue->count && queue->heap[0]->cycle <= cycles) {
+            due[count] = queue->heap[0];
+            queue_remove(due[count++]);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (due[i]->update_time)
+            due[i]->update_time();
+    }
+    periph_update_next_cycle();
+}
+
+void periph_set_output_rate(int rate) {
+    out_interval = rate > 0 ? 1000000 / rate : 0;
+}
+
+/** \brief write as much of the output queue as the GUI takes */
+static void out_send(void) {
+    ssize_t n;
+
+    if (!out_len)
+        return;
+    n = send(periph_fd, out_queue, out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK)
+        n = write(periph_fd, out_queue, out_len);
+    if (n <= 0)
+        return;
+    out_len -= n;
+    memmove(out_queue, out_queue + n, out_len);
+}
+
+/** \brief queue the changed state slots and send the queue */
+static void periph_flush_output(void) {
+    int i, n, len;
+
+    out_send();
+    for (n = 0; n < OUT_SLOTS; n++) {
+        i = (out_next + n) % OUT_SLOTS;
+        if (strcmp(out_slot[i], out_queued[i]) == 0)
+            continue;
+        len = strlen(out_slot[i]);
+        if (out_len + len > OUT_QUEUE_MAX) {
+            out_next = i;
+            break;
+        }
+        memcpy(out_queue + out_len, out_slot[i], len);
+        out_len += len;
+        strcpy(out_queued[i], out_slot[i]);
+    }
+    out_send();
+}
+
+/** \brief forget what was sent, e.g. when a new GUI connects */
+static void periph_reset_output(void) {
+    memset(out_queued, 0, sizeof(out_queued));
+    out_len = 0;
+    out_next = 0;
+}
+
+void periph_update(int slot, const char *msg) {
+    if (replay_mode == REPLAY_PLAY)
+        return;
+    strncpy(out_slot[slot], msg, OUT_LINE_MAX - 1);
+}
+
+void periph_write(const char *msg) {
+    int len = strlen(msg);
+
+    if (replay_mode == REPLAY_PLAY)
+        return;
+    if (out_len + len > OUT_QUEUE_MAX) {
+        fprintf(stderr, "GUI doesn't read its output, dropping %s", msg);
+        return;
+    }
+    memcpy(out_queue + out_len, msg, len);
+    out_len += len;
+    out_send();
+}
+
+/** \brief print the simulated and real time and the speed reached */
+void periph_print_speed(void) {
+    cycle_count_t real = (stopped ? 0 : periph_clock()) - startusecs;
+
+    if (real > 0 && replay_mode != REPLAY_PLAY) {
+        printf("%.3f s simulated in %.3f s, speed %.3f (target ",
+               (double) cycles / CYCLES_PER_USEC / 1000000.0,
+               (double) real / 1000000.0,
+               (double) cycles / CYCLES_PER_USEC / real);
+        if (slow_down_num)
+            printf("%.3f", (double) slow_down_den / slow_down_num);
+        else
+            printf("max");
+        printf("), max lag %.1f ms\n", max_lag_seen / 1000.0);
+    }
+}
+
+/** \brief print the statistics and stop the brick */
+static void periph_exit(const char *reason) {
+    printf("%s\n", reason);
+    periph_print_speed();
+    printf("%llu of %llu cycles skipped in idle loops\n",
+           (unsigned long long) idle_cycles_skipped,
+           (unsigned long long) cycles);
+    frame_dump_profile();
+    savefile_flush();
+    periph_flush_output();
+    brick_exit(0);
+}
+
+int periph_recv(void *buf, int len) {
+    if (len > in_end - in_pos)
+        len = in_end - in_pos;
+    memcpy(buf, in_buf + in_pos, len);
+    in_pos += len;
+    return len;
+}
+
+/** \brief forget the received input, e.g. when a new GUI connects */
+static void periph_reset_input(void) {
+    in_len = in_pos = in_end = 0;
+}
+
+/** \brief pass one command to its peripheral
+ *
+ * When replaying the command comes from the journal, otherwise from
+ * the complete lines in in_buf.
+ */
+static void periph_run_command(void) {
+    char id;
+    int i;
+
+    if (replay_read(periph_fd, &id, 1) <= 0) {
+        /* an empty command in the journal */
+        replay_end_command();
+        periph_exit("GUI closed!");
+    }
+    for (i = 0; i < num_peripherals; i++) {
+        if (peripherals[i].id == id)
+            peripherals[i].read_fd(periph_fd);
+    }
+    replay_end_command();
+}
+
+/** \brief run the complete commands in in_buf */
+static void periph_run_input(void) {
+    for (in_end = in_len; in_end > in_pos; in_end--) {
+        if (in_buf[in_end - 1] == '\n' || in_buf[in_end - 1] == '\r')
+            break;
+    }
+    /* a checkpoint child resets the input, which ends the loop */
+    while (in_pos < in_end)
+        periph_run_command();
+    if (in_len == IN_BUF_MAX && in_pos == 0) {
+        fprintf(stderr, "GUI command too long, dropped\n");
+        in_pos = in_len;
+    }
+    in_len -= in_pos;
+    memmove(in_buf, in_buf + in_pos, in_len);
+    in_pos = in_end = 0;
+}
+
+void periph_command(const char *cmd) {
+    int len = strlen(cmd);
+
+    if (in_len + len > IN_BUF_MAX) {
+        fprintf(stderr, "GUI input full, dropping %s", cmd);
+        return;
+    }
+    memcpy(in_buf + in_len, cmd, len);
+    in_len += len;
+    periph_run_input();
+}
+
+/** \brief receive what the GUI sent and run the complete commands */
+static void periph_read_command(void) {
+    ssize_t n;
+
+    n = read(periph_fd, in_buf + in_len, IN_BUF_MAX - in_len);
+    if (n == 0) {
+        /* journals the close as an empty command */
+        replay_end_command();
+        periph_exit("GUI closed!");
+    }
+    if (n < 0)
+        return;
+    in_len += n;
+    periph_run_input();
+}
+
+/** \brief take the input of the current poll from the journal
+ *
+ * Replaying doesn't wait for real time.  While the CPU is stopped
+ * only the debugger can continue it, unless the journal has another
+ * command for the GUI.
+ */
+static void replay_time(void) {
+    int due = replay_next_command();
+
+    if (due > 0) {
+        /* the commands received by one read share their poll */
+        do
+            periph_run_command();
+        while (replay_next_command() > 0);
+    } else if (stopped && debuggerfd >= 0) {
+        FD_SET(debuggerfd, &rdfds);
+        if (select(debuggerfd + 1, &rdfds, NULL, NULL, NULL) > 0)
+            db_handlefd();
+    } else if (stopped) {
+        if (due < 0)
+            periph_exit("Replay finished!");
+        printf("Replay diverged: CPU stopped at cycle %llu without input\n",
+               (unsigned long long) cycles);
+        brick_exit(1);
+    }
+}
+
+/** \brief publish the CPU counters, see observe.h
+ *
+ * real is the time in usecs the CPU was running.
+ */
+static void periph_observe(cycle_count_t real) {
+    if (!observe)
+        return;
+    observe_begin();
+    observe->cycles = cycles;
+    observe->idle_cycles = idle_cycles_skipped;
+    observe->real_usecs = real;
+    observe->max_lag = max_lag_seen;
+    observe->target_speed =
+        slow_down_num ? 1000 * slow_down_den / slow_down_num : 0;
+    observe->pc = pc;
+    observe_end();
+}
 
 /** \brief synchronize the emulator’s time with the real time
  *
@@ -166,9 +665,18 @@ static fd_set rdfds;
  */
 static void synchronize_time(void) {
     struct timeval timeval;
-    cycle_count_t  tosleep;
+    cycle_count_t  tosleep, now;
+    fd_set wrfds;
     int   maxfd;
     
+    if (!stopped)
+        replay_polls++;
+    if (replay_mode == REPLAY_PLAY) {
+        periph_observe(0);
+        replay_time();
+        return;
+    }
+
     /* The result of this operation is expected to be positive
      * (c.f. the "+=" assignment statements that then follow this one)
      */
@@ -178,48 +686,71 @@ static void synchronize_time(void) {
      * and lastcycles as if exactly usecs micro seconds have passed since
      * the last call.
      */
-    lastusecs += usecs * SLOW_DOWN;
+    if (slow_down_num) {
+        slow_down_rem += usecs * slow_down_num;
+        lastusecs += slow_down_rem / slow_down_den;
+        slow_down_rem %= slow_down_den;
+    } else
+        lastusecs += usecs;
     lastcycles += usecs * CYCLES_PER_USEC;
 
     if ((lastusecs > nextsleep) || stopped) {
-        gettimeofday(&timeval, NULL);
-
-
-        cycle_count_t timeval_usec = timeval.tv_sec * 1000000 + timeval.tv_usec;
-        tosleep = (lastusecs > timeval_usec) ? (lastusecs - timeval_usec) : 0;
+        now = periph_clock();
+        periph_observe((stopped ? 0 : now) - startusecs);
+        /* when unthrottled we only poll for input */
+        tosleep = 0;
+        if (slow_down_num && !stopped) {
+            if (lastusecs > now) {
+                tosleep = lastusecs - now;
+            } else {
+                /* we are behind real time.  Catch up by running
+                 * unthrottled, but if the lag is too large, e.g. after
+                 * the host was suspended, drop it instead of racing.
+                 */
+                if (now - lastusecs > max_lag_seen)
+                    max_lag_seen = now - lastusecs;
+                if (now - lastusecs > max_lag)
+                    lastusecs = now;
+            }
+        }
 #ifdef DEBUG_TIMER
-        else
-            printf("simulated time: %8.2f  (%" CYCLE_COUNT_F " cycles) sleeping %" CYCLE_COUNT_F " usec\n", 
-                   (lastusecs-startusecs)/1000000.0, lastcycles, tosleep);
+        printf("simulated time: %8.2f  (%" CYCLE_COUNT_F " cycles) sleeping %" CYCLE_COUNT_F " usec\n", 
+               (lastusecs-startusecs)/1000000.0, lastcycles, tosleep);
 #endif
         
-        FD_SET(periph_fd, &rdfds);
-        maxfd = periph_fd + 1;
+        if (stopped || now - out_usecs >= out_interval) {
+            periph_flush_output();
+            out_usecs = now;
+        }
+
+        FD_ZERO(&wrfds);
+        maxfd = 0;
+        if (scenario_running) {
+            /* no GUI, the input comes from the scenario */
+            if (stopped)
+                scenario_standby();
+        } else {
+            FD_SET(periph_fd, &rdfds);
+            if (out_len)
+                FD_SET(periph_fd, &wrfds);
+            maxfd = periph_fd + 1;
+        }
         FD_SET(debuggerfd, &rdfds);
         if (debuggerfd >= maxfd)
             maxfd = debuggerfd + 1;
-        timeval.tv_sec = 0;
-        timeval.tv_usec = tosleep;
-        if (select(maxfd, &rdfds, NULL, NULL, 
-                   stopped ? NULL : &timeval) > 0) {
-            if (FD_ISSET(periph_fd, &rdfds)) {
-                char id;
-                int i;
-                if (read(periph_fd, &id, 1) <= 0) {
-                    printf("GUI closed!\n");
-                    frame_dump_profile();
-                    exit(0);
-                }
-                for (i = 0; i < num_peripherals; i++) {
-                    if (peripherals[i].id == id)
-                        peripherals[i].read_fd(periph_fd);
-                }
-            }
+        timeval.tv_sec = tosleep / 1000000;
+        timeval.tv_usec = tosleep % 1000000;
+        if (select(maxfd, &rdfds, &wrfds, NULL, 
+                   stopped && !scenario_running ? NULL : &timeval) > 0) {
+            if (FD_ISSET(periph_fd, &wrfds))
+                out_send();
+            if (FD_ISSET(periph_fd, &rdfds))
+                periph_read_command();
             if (debuggerfd >= 0 && FD_ISSET(debuggerfd, &rdfds)) {
                 db_handlefd();
             }
         }
-        nextsleep = lastusecs + 1000;
+        nextsleep = lastusecs + pace_quantum;
     }
 }
 
@@ -235,12 +766,10 @@ static void synchronize_time(void) {
 
 void stop_time(void) {
     if (!stopped++) {
-        struct timeval current_time;
-        gettimeofday(&current_time, NULL);
+        cycle_count_t now = periph_clock();
 
-        cycle_count_t timeval_usec = (current_time.tv_sec * 1000000 + current_time.tv_usec);
-        lastusecs -= timeval_usec;
-        startusecs -= timeval_usec;
+        lastusecs -= now;
+        startusecs -= now;
     }
 }
 
@@ -253,17 +782,79 @@ void stop_time(void) {
 
 void cont_time(void) {
     if (!--stopped) {
-        struct timeval current_time;
-        gettimeofday(&current_time, NULL);
+        cycle_count_t now = periph_clock();
 
-        cycle_count_t timeval_usec = (current_time.tv_sec * 1000000 + current_time.tv_usec);
-        lastusecs += timeval_usec;
-        startusecs += timeval_usec;
+        lastusecs += now;
+        startusecs += now;
         nextsleep = lastusecs;
     }
 }
 
 
+/** \brief set the ratio of simulated time to real time
+ *
+ * The ratio is given as "a" or "a/b", e.g. "1" to run in real time, "2"
+ * to run twice as fast or "1/4" to run with a quarter of the speed.
+ * "0", "max" or "unthrottled" let the emulator run as fast as it can;
+ * the CPU still sleeps until the next event, but the emulator no longer
+ * waits for real time to catch up.
+ *
+ * \returns 0 on success, -1 if the ratio can't be parsed.
+ */
+int periph_set_speed(const char *ratio) {
+    unsigned long sim, real = 1;
+    char *end;
+
+    if (strcmp(ratio, "max") == 0 || strcmp(ratio, "unthrottled") == 0) {
+        sim = 0;
+    } else {
+        sim = strtoul(ratio, &end, 10);
+        if (end == ratio)
+            return -1;
+        if (*end == '/') {
+            ratio = end + 1;
+            real = strtoul(ratio, &end, 10);
+            if (end == ratio || real == 0)
+                return -1;
+        }
+        if (*end)
+            return -1;
+    }
+    if (sim == 0) {
+        slow_down_num = 0;
+        slow_down_den = 1;
+    } else {
+        slow_down_num = real;
+        slow_down_den = sim;
+    }
+    slow_down_rem = 0;
+
+    /* start over with the new ratio at the current real time.  While
+     * stopped lastusecs is relative to the time of stop_time.
+     */
+    if (stopped) {
+        lastusecs = 0;
+    } else {
+        lastusecs = periph_clock();
+    }
+    lastcycles = cycles;
+    nextsleep = lastusecs;
+    return 0;
+}
+
+/** \brief set the pacing of the emulator
+ *
+ * quantum is the simulated time in usecs between two checks of the
+ * real time; max_lag is how far in usecs the emulator may fall behind
+ * real time before it gives up catching up.  0 keeps the current value.
+ */
+void periph_set_pacing(int quantum, int lag) {
+    if (quantum > 0)
+        pace_quantum = quantum;
+    if (lag > 0)
+        max_lag = lag;
+}
+
 /** \brief make processor time match real time and update peripheral times
 
  *
@@ -292,12 +883,13 @@ void wait_peripherals(void)
 void do_reset(void) {
     int i;
     irq_disabled_one = 1;
+    cpu_flush_ccr();
     ccr = 0x80;
     for (i = 0; i < num_peripherals; i++) {
         if(peripherals[i].reset)
             peripherals[i].reset();
     }
-    /* Clear all symbols and reread rom file and its symbols. */
+    /* Clear all symbols and restore the rom and its symbols. */
     symbols_removeall();
     read_rom();
     wait_peripherals();
@@ -316,35 +908,34 @@ void do_reset(void) {
  */
 
 int check_irq(void) {
-    int i;
     int selirq;
+    uint64 pending;
 
-    /* reset next_cycle */
-    next_timer_cycle = add_to_cycle('T', cycles, MAX_AUTONOMOUS_CYCLES);
-    next_nmi_cycle = add_to_cycle('I', cycles, MAX_AUTONOMOUS_CYCLES);
-
-    /* Make processor time match real time */
-    wait_peripherals();
+    /* come back after MAX_AUTONOMOUS_CYCLES at the latest */
+    next_sync_cycle = add_to_cycle('T', cycles, MAX_AUTONOMOUS_CYCLES);
 
-    selirq = 255;
-    /* Check whether an interrupt wants to fire */
-    for (i = 0; i < num_peripherals; i++) {
-        int irq;
-
-        if(peripherals[i].check_irq) {
-            irq = peripherals[i].check_irq();
-            if (irq < selirq)
-                selirq = irq;
-        }
-    }
+    /* Make processor time match real time, then update only the
+     * peripherals whose deadline is reached.
+     */
+    synchronize_time();
+    periph_run_events();
 
-    if (selirq < (ccr & 0x80 ? 4 : 255)) {
+    /* Check whether an interrupt wants to fire.  While the I bit is
+     * set only reset and NMI may.
+     */
+    pending = irq_pending & (ccr & 0x80 ? IRQ_NMI_MASK : ~(uint64) 0);
+    if (pending) {
         uint16 sp;
         cycle_count_t irqcycles, tmpcycles;
         /* IRQ was selected, fire it */
+        selirq = __builtin_ctzll(pending);
 #ifdef VERBOSE_IRQ
-        printf("%" CYCLE_COUNT_F ": IRQ %d fired!\n", cycles, selirq);
+        printf("%" CYCLE_COUNT_F ": IRQ %d fired after %" CYCLE_COUNT_F
+               " cycles!\n", cycles, selirq,
+               cycles - irq_raised_cycle[selirq]);
 #endif
+        if (irq_ack[selirq])
+            irq_ack[selirq](selirq);
         if (selirq == 0) {
             /* reset was caused, probably by watchdog.
              * next_nmi_cycle is the cycle when reset is finished.
@@ -355,6 +946,7 @@ int check_irq(void) {
         }
 
         irqcycles = cycles;
+        cpu_flush_ccr();
         GET_WORD_CYCLES(pc); /* simulate lookahead */
         sp = GET_REG16(7)-4;
         SET_WORD_CYCLES(sp + 2, pc);
@@ -382,6 +974,7 @@ int check_irq(void) {
 void periph_handletrap(void) {
     /* freeze CPU */
     stop_time();
+    scenario_trap();
     db_handletrap();
     
     while (db_trap) {
@@ -488,6 +1081,7 @@ void register_peripheral(peripheral_ops ops) {
     peripherals[num_peripherals++] = ops;
 }
 
+
 /** \brief set the value of the SYSCR register 
  *
  */
@@ -518,13 +1112,17 @@ typedef struct {
 
 static int periph_save(void *buffer, int maxlen) {
     periph_save_type *data = buffer;
-    memcpy(data->reg, reg, sizeof(data->reg));
+    int i;
+
+    cpu_flush_ccr();
+    for (i = 0; i < 16; i++)
+        data->reg[i] = REG8(i);
     data->pc = htons(sleeping ? pc - 2 : pc);
     data->ccr = ccr;
     data->wait_states = htonl(wait_states);
-    data->cycles = htonl(cycles);
-    data->next_timer_cycle = htonl(next_timer_cycle);
-    data->next_nmi_cycle = htonl(next_nmi_cycle);
+    data->cycles = hton64(cycles);
+    data->next_timer_cycle = hton64(next_timer_cycle);
+    data->next_nmi_cycle = hton64(next_nmi_cycle);
     data->syscr = syscr;
     data->db_trap = htonl(db_trap);
     return sizeof(*data);
@@ -532,24 +1130,131 @@ static int periph_save(void *buffer, int maxlen) {
 
 static void periph_load(void *buffer, int len) {
     periph_save_type *data = buffer;
+    int i;
 
-    memcpy(reg, data->reg, sizeof(data->reg));
+    for (i = 0; i < 16; i++)
+        REG8(i) = data->reg[i];
     pc = ntohs(data->pc);
+    cpu_flush_ccr();
     ccr = data->ccr;
     syscr = data->syscr;
-    wait_states = ntohl(data->wait_states);
-    cycles = ntohl(data->cycles);
-    next_timer_cycle = ntohl(data->next_timer_cycle);
-    next_nmi_cycle = ntohl(data->next_nmi_cycle);
+    mem_set_wait_states(ntohl(data->wait_states));
+    cycles = ntoh64(data->cycles);
+    next_timer_cycle = ntoh64(data->next_timer_cycle);
+    next_nmi_cycle = ntoh64(data->next_nmi_cycle);
     db_trap = ntohl(data->db_trap);
     sleeping = 0;
     lastcycles = cycles;
     lastusecs = 0;
 }
 
+/** \brief continue as a brick forked from a checkpoint
+ *
+ * The child talks to the GUI over conn and writes its output to the
+ * directory dir.  It gets its own IR server connection and debugging
+ * server, so it doesn't interfere with its siblings.
+ */
+static void periph_checkpoint_child(int conn, const char *dir) {
+    char path[1040];
+    int log;
+
+    close(periph_fd);
+    periph_fd = conn;
+    FD_ZERO(&rdfds);
+    periph_reset_input();
+    periph_reset_output();
+    mkdir(dir, 0777);
+    snprintf(path, sizeof(path), "%s/observe", dir);
+    if (observe && observe_init(path) < 0)
+        brick_exit(1);
+    snprintf(path, sizeof(path), "%s/emu.log", dir);
+    log = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (log >= 0) {
+        fflush(stdout);
+        fflush(stderr);
+        dup2(log, 1);
+        dup2(log, 2);
+        close(log);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+    ser_reconnect();
+    db_restart();
+    lcd_refresh();
+}
+
+/** \brief serve the current state as checkpoint
+ *
+ * Sends "PC<port>" to the GUI and then forks a copy of the brick for
+ * every connection to port.  The copies share the memory of this
+ * process copy-on-write, so they start without booting again.  Copy n
+ * writes its output to the directory name-n.  This process only
+ * serves the checkpoint until its GUI closes.
+ */
+static void periph_checkpoint(int fd, const char *name) {
+    char buf[1024];
+    int server, port, conn, n;
+    fd_set fds, wfds;
+    pid_t pid;
+
+    if (replay_mode != REPLAY_OFF) {
+        fprintf(stderr, "Checkpoints don't support record and replay\n");
+        return;
+    }
+    server = create_anon_socket(&port);
+    if (server < 0) {
+        printf("Can't create checkpoint socket!\n");
+        return;
+    }
+    sprintf(buf, "PC%d\n", port);
+    periph_write(buf);
+    printf("Checkpoint %s served on port %d.\n", name, port);
+
+    savefile_flush();
+    periph_flush_output();
+    stop_time();
+    for (n = 0;; ) {
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+        FD_ZERO(&fds);
+        FD_ZERO(&wfds);
+        FD_SET(server, &fds);
+        FD_SET(fd, &fds);
+        /* the GUI still has to get the port and the pending output */
+        if (out_len)
+            FD_SET(fd, &wfds);
+        if (select((server > fd ? server : fd) + 1, &fds, &wfds, NULL,
+                   NULL) <= 0)
+            continue;
+        if (FD_ISSET(fd, &wfds))
+            out_send();
+        if (FD_ISSET(fd, &fds) && read(fd, buf, sizeof(buf)) <= 0)
+            periph_exit("GUI closed!");
+        if (!FD_ISSET(server, &fds))
+            continue;
+        conn = accept_socket(server);
+        if (conn < 0)
+            continue;
+        snprintf(buf, sizeof(buf), "%s-%d", name, n++);
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            close(server);
+            periph_checkpoint_child(conn, buf);
+            break;
+        }
+        if (pid < 0)
+            perror("fork");
+        else
+            printf("Checkpoint %s: started %s (pid %d).\n",
+                   name, buf, (int) pid);
+        close(conn);
+    }
+    cont_time();
+}
+
 static void periph_read_fd(int fd) {
     char cmd;
-    read(fd, &cmd, 1);
+    replay_read(fd, &cmd, 1);
     switch (cmd) {
     case 'R':
         do_reset();
@@ -558,8 +1263,37 @@ static void periph_read_fd(int fd) {
     case 'D': 
         {
             char buf[20];
-            int len = sprintf(buf, "PD%d\n", monitorport);
-            write(fd, buf, len);
+            sprintf(buf, "PD%d\n", monitorport);
+            periph_write(buf);
+            break;
+        }
+    case 'S':
+        {
+            /* PS<ratio>: set the speed, see periph_set_speed */
+            char ratio[20];
+            int len = 0;
+            do {
+                if (replay_read(fd, ratio + len, 1) <= 0)
+                    break;
+            } while (ratio[len] != '\n' && ratio[len] != '\r'
+                     && ++len < (int) sizeof(ratio) - 1);
+            ratio[len] = 0;
+            if (periph_set_speed(ratio) < 0)
+                fprintf(stderr, "Invalid speed: %s\n", ratio);
+            break;
+        }
+    case 'C':
+        {
+            /* PC<name>: serve the current state as checkpoint */
+            char name[256];
+            int len = 0;
+            do {
+                if (replay_read(fd, name + len, 1) <= 0)
+                    break;
+            } while (name[len] != '\n' && name[len] != '\r'
+                     && ++len < (int) sizeof(name) - 1);
+            name[len] = 0;
+            periph_checkpoint(fd, name);
             break;
         }
     }
@@ -581,13 +1315,16 @@ peripheral_ops periph = {
  * 3. Accept a socket connection from the GUI program
  */
 void periph_init(int guiserverport) {
-    struct timeval current_time;
     int server_fd;
     int guiport;
     char *gui;
     char cmd[1024];
 
-    if (guiserverport == 0) {
+    if (replay_mode == REPLAY_PLAY || scenario_running) {
+        /* the input comes from the journal or the scenario, the
+         * output is discarded */
+        periph_fd = open("/dev/null", O_RDWR);
+    } else if (guiserverport == 0) {
         /* the emulator is the server for the gui,
            create the server socket, start the gui
            and let the gui connect                   */
@@ -615,8 +1352,7 @@ void periph_init(int guiserverport) {
 
     cycles = lastcycles = 0;
     
-    gettimeofday(&current_time, NULL);
-    lastusecs = (current_time.tv_sec * 1000000 + current_time.tv_usec);
+    lastusecs = periph_clock();
     nextsleep = startusecs = lastusecs;
     
     port[0xc4 - 0x88].get = get_syscr;
@@ -43,11 +43,32 @@ typedef struct peripheral_ops {
     void (*reset) (void);
     void (*update_time) (void);
     void (*read_fd) (int fd);
-    int  (*check_irq) (void);
     int  (*save_data) (void *data, int maxlen);
     void (*load_data) (void *data, int len);
 } peripheral_ops;
 
+/** \brief a deadline of a peripheral
+ *
+ * A peripheral that needs to do something at a certain cycle, e.g. a
+ * timer that reaches its compare value, owns one of these and
+ * schedules it with periph_schedule.  When cycles reaches the deadline
+ * check_irq calls update_time of this event only, instead of polling
+ * every peripheral.  Pending interrupts are requested with irq_set
+ * instead.
+ *
+ * Initialize it as { update_time, nmi, -1 }.
+ */
+typedef struct periph_event {
+    /** \brief called when the deadline is reached, may be NULL */
+    void (*update_time) (void);
+    /** \brief 1 if the deadline may raise a NMI */
+    int  nmi;
+    /** \brief position in the event queue, -1 if not scheduled */
+    int  slot;
+    /** \brief cycle of the deadline */
+    cycle_count_t cycle;
+} periph_event;
+
 /** \brief The number cycles per micro second.
  *
  * This constant specifies the cycles per micro second.  If you increase this
@@ -58,14 +79,44 @@ typedef struct peripheral_ops {
 /** \brief The slow down
  *
  * This constant specifies the ratio of simulated time to real time.  It
- * must be a simple fraction a/b without parenthesis.
+ * must be a simple fraction a/b without parenthesis.  It is only the
+ * default, see periph_set_speed.
  */
 #define SLOW_DOWN 1
 
+/** \brief The default pacing quantum
+ *
+ * The simulated time in usecs between two checks of the real time, see
+ * periph_set_pacing.  Smaller values give less timing jitter but cost
+ * more system calls.
+ */
+#define PACE_QUANTUM 1000
+
+/** \brief The default lag tolerance
+ *
+ * If the emulator falls more than this many usecs behind real time it
+ * doesn't try to catch up, see periph_set_pacing.
+ */
+#define MAX_LAG 100000
+
+/** \brief The default frame rate of the GUI output
+ *
+ * State changes are sent to the GUI this many times per second of
+ * real time, see periph_set_output_rate and periph_update.
+ */
+#define OUTPUT_RATE 100
+
+/** \brief the state slots of the GUI output, see periph_update */
+#define OUT_LCD        0   /* 12 bytes of segments */
+#define OUT_LCD_ENABLE 12
+#define OUT_MOTOR      13  /* 3 motors */
+#define OUT_ANALOG     16
+#define OUT_SLOTS      17
+
 /** \brief socket file descriptor for communication with peripherals
  * 
  */
-extern int periph_fd;
+extern BRICK_LOCAL int periph_fd;
 /** \brief retain current system time when CPU starts sleeping and mark CPU as stopped
  *
  * The routine is called by cpu_sleep. It sets the stopusecs
@@ -81,6 +132,43 @@ extern void stop_time(void);
  * is sleeping.
  */
 extern void cont_time(void);
+/** \brief set the ratio of simulated time to real time
+ *
+ * The ratio is "a" or "a/b"; "max" or "0" runs unthrottled.
+ * \returns 0 on success, -1 if the ratio can't be parsed.
+ */
+extern int periph_set_speed(const char *ratio);
+/** \brief set the pacing quantum and the lag tolerance in usecs
+ *
+ * 0 keeps the current value.
+ */
+extern void periph_set_pacing(int quantum, int lag);
+/** \brief set the frame rate of the GUI output in frames per second
+ *
+ * 0 sends the state at every check of the real time.
+ */
+extern void periph_set_output_rate(int rate);
+/** \brief print the simulated and real time and the speed reached */
+extern void periph_print_speed(void);
+/** \brief change a state of the GUI, e.g. a segment of the LCD
+ *
+ * msg is the line that describes the new state of the slot.  It is
+ * sent with the next frame, unless the slot changes again before.
+ */
+extern void periph_update(int slot, const char *msg);
+/** \brief send a reply to a GUI command, in order and at once */
+extern void periph_write(const char *msg);
+/** \brief take up to len bytes of the GUI command being dispatched
+ *
+ * Returns the number of bytes copied to buf, 0 at the end of the
+ * received commands.
+ */
+extern int periph_recv(void *buf, int len);
+/** \brief run a GUI command, e.g. from a scenario
+ *
+ * cmd is one or more complete lines of the GUI protocol.
+ */
+extern void periph_command(const char *cmd);
 /** \brief make processor time match real time and update peripheral times
  *
  * Uses synchronize time to make the processors time match real time.
@@ -137,10 +225,52 @@ extern cycle_count_t add_to_cycle(char, cycle_count_t, int32);
  */
 extern void register_peripheral(peripheral_ops ops);
 
+/** \brief schedule or reschedule the deadline of a peripheral
+ *
+ * Sets the deadline of event to cycle, replacing an earlier
+ * deadline of the same event.  The CPU calls check_irq as soon as
+ * cycles reaches the deadline.
+ */
+extern void periph_schedule(periph_event *event, cycle_count_t cycle);
+
+/** \brief cancel the deadline of a peripheral
+ *
+ * Removes event from the event queue, if it is scheduled.
+ */
+extern void periph_cancel(periph_event *event);
+
+/** \brief raise or withdraw an interrupt request
+ *
+ * Peripherals call this whenever the flags or enable bits behind an
+ * interrupt vector change.  check_irq takes the requested interrupt
+ * with the lowest vector.
+ */
+extern void irq_set(int vector, int pending);
+
+/** \brief register the acknowledge routine of an interrupt
+ *
+ * ack is called when the CPU takes the interrupt.  Edge triggered
+ * interrupts use it to withdraw their request.
+ */
+extern void irq_set_ack(int vector, void (*ack) (int vector));
+
 /**
  * Handle special nop opcodes to print debugging messages that
  * appear in brickOS programs.
  */
 extern void debug_printf(void);
 
+/** \brief register the save file commands and set the boot state
+ * cache directory, see savefile.c */
+extern void savefile_init(const char *cache);
+
+/** \brief wait until the last save file is written, see savefile.c */
+extern void savefile_flush(void);
+
+/** \brief connect to the IR server again, see serial.c */
+extern void ser_reconnect(void);
+
+/** \brief send the whole LCD to the GUI again, see lcd.c */
+extern void lcd_refresh(void);
+
 #endif
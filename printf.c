@@ -95,6 +95,7 @@
 #include "memory.h"
 #include "h8300.h"
 #include "peripherals.h"
+#include "scenario.h"
 
 /* format read states */
 #define DP_S_DEFAULT 0
@@ -347,6 +348,7 @@ void debug_printf(void) {
     }
     
     printf("Program said: `%s'\n", buffer);
+    scenario_printf(buffer);
 }
 
 static void fmtstr(char *buffer, size_t *currlen, size_t maxlen,
@@ -0,0 +1,240 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "h8300.h"
+#include "replay.h"
+#include "peripherals.h"
+#include "brick.h"
+
+/** \file replay.c
+ * \brief record and replay the external inputs of the brick
+ *
+ * The journal is a text file with one line per input:
+ *
+ *   cycles poll source data
+ *
+ * where source is G for a command from the GUI and S for a byte from
+ * the IR server, and data are the bytes in hex.  A G line without
+ * data means that the GUI closed the connection.
+ *
+ * The GUI is polled by synchronize_time, the IR server by the serial
+ * port.  When replaying, an input is applied at the poll with the
+ * recorded number, so it hits exactly the same instruction even if
+ * several polls happen in the same cycle.  While the CPU is stopped
+ * the polls are not counted, since their number depends on real time.
+ * Inputs from the debugger are not recorded.
+ */
+
+BRICK_LOCAL int replay_mode;
+BRICK_LOCAL cycle_count_t replay_polls;
+
+/** \brief the journal file */
+static BRICK_LOCAL FILE *journal;
+
+/** \brief the bytes of the current GUI command
+ *
+ * When recording these are the bytes read so far, when replaying the
+ * bytes that replay_read returns.
+ */
+static BRICK_LOCAL uint8 *command;
+static BRICK_LOCAL int command_len, command_pos, command_size;
+
+/** \brief the next journal entry when replaying
+ *
+ * next_valid is 1 if the entry is valid, 0 before the first entry is
+ * read and -1 at the end of the journal.
+ */
+static BRICK_LOCAL int next_valid;
+static BRICK_LOCAL cycle_count_t next_cycles, next_poll;
+static BRICK_LOCAL char next_source;
+static BRICK_LOCAL uint8 *next_data;
+static BRICK_LOCAL int next_len, next_size;
+
+static void append(uint8 **buf, int *len, int *size, uint8 val) {
+    if (*len == *size) {
+        *size = *size ? 2 * *size : 64;
+        *buf = realloc(*buf, *size);
+        if (!*buf) {
+            perror("replay");
+            exit(1);
+        }
+    }
+    (*buf)[(*len)++] = val;
+}
+
+static int hexval(int ch) {
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    return -1;
+}
+
+static void journal_write(char source, const uint8 *data, int len) {
+    int i;
+
+    fprintf(journal, "%llu %llu %c ", (unsigned long long) cycles,
+            (unsigned long long) replay_polls, source);
+    for (i = 0; i < len; i++)
+        fprintf(journal, "%02x", data[i]);
+    putc('\n', journal);
+    fflush(journal);
+}
+
+/** \brief read the next entry of the journal into next_*
+ *
+ */
+static void journal_next(void) {
+    unsigned long long c, p;
+    int ch, hi, lo;
+
+    if (fscanf(journal, "%llu %llu %c", &c, &p, &next_source) != 3) {
+        printf("Replay: end of journal at cycle %llu\n",
+               (unsigned long long) cycles);
+        next_valid = -1;
+        return;
+    }
+    next_cycles = c;
+    next_poll = p;
+    next_len = 0;
+    while ((ch = getc(journal)) == ' ')
+        ;
+    while (ch != '\n' && ch != EOF) {
+        hi = hexval(ch);
+        lo = hexval(getc(journal));
+        if (hi < 0 || lo < 0) {
+            printf("Replay: journal is corrupt\n");
+            brick_exit(1);
+        }
+        append(&next_data, &next_len, &next_size, hi << 4 | lo);
+        ch = getc(journal);
+    }
+    next_valid = 1;
+}
+
+/** \brief check whether the next entry belongs to the current poll
+ *
+ * \returns 1 if it does, 0 if it belongs to a later poll and -1 at the
+ * end of the journal.
+ */
+static int journal_due(char source) {
+    if (!next_valid)
+        journal_next();
+    if (next_valid < 0)
+        return -1;
+    if (next_poll < replay_polls) {
+        printf("Replay diverged: input of poll %llu missed at poll %llu\n",
+               (unsigned long long) next_poll,
+               (unsigned long long) replay_polls);
+        brick_exit(1);
+    }
+    if (next_poll != replay_polls || next_source != source)
+        return 0;
+    /* the input came while the CPU was stopped after this poll */
+    if (next_cycles > cycles)
+        return 0;
+    if (next_cycles != cycles)
+        printf("Replay diverged: input of cycle %llu applied at cycle %llu\n",
+               (unsigned long long) next_cycles,
+               (unsigned long long) cycles);
+    return 1;
+}
+
+int replay_open(const char *path, int mode) {
+    journal = fopen(path, mode == REPLAY_PLAY ? "r" : "w");
+    if (!journal) {
+        perror(path);
+        return -1;
+    }
+    replay_mode = mode;
+    return 0;
+}
+
+int replay_read(int fd, void *buf, int len) {
+    int i;
+
+    switch (replay_mode) {
+    case REPLAY_PLAY:
+        if (command_len == 0)
+            return 0;
+        if (command_pos == command_len) {
+            printf("Replay: GUI command too short\n");
+            brick_exit(1);
+        }
+        if (len > command_len - command_pos)
+            len = command_len - command_pos;
+        memcpy(buf, command + command_pos, len);
+        command_pos += len;
+        return len;
+
+    case REPLAY_RECORD:
+        len = periph_recv(buf, len);
+        for (i = 0; i < len; i++)
+            append(&command, &command_len, &command_size, ((uint8 *) buf)[i]);
+        return len;
+
+    default:
+        return periph_recv(buf, len);
+    }
+}
+
+void replay_end_command(void) {
+    if (replay_mode == REPLAY_RECORD)
+        journal_write('G', command, command_len);
+    command_len = command_pos = 0;
+}
+
+int replay_next_command(void) {
+    int i, due = journal_due('G');
+
+    if (due > 0) {
+        command_len = command_pos = 0;
+        for (i = 0; i < next_len; i++)
+            append(&command, &command_len, &command_size, next_data[i]);
+        journal_next();
+    }
+    return due;
+}
+
+int replay_read_serial(int fd, uint8 *buf) {
+    int len;
+
+    replay_polls++;
+    switch (replay_mode) {
+    case REPLAY_PLAY:
+        if (journal_due('S') <= 0)
+            return 0;
+        *buf = next_data[0];
+        journal_next();
+        return 1;
+
+    case REPLAY_RECORD:
+        len = read(fd, buf, 1);
+        if (len > 0)
+            journal_write('S', buf, 1);
+        return len;
+
+    default:
+        return read(fd, buf, 1);
+    }
+}
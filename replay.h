@@ -0,0 +1,86 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#ifndef _REPLAY_H_
+#define  _REPLAY_H_
+
+#include "types.h"
+
+/** \file replay.h
+ * \brief record and replay the external inputs of the brick
+ *
+ * In record mode every command from the GUI and every byte from the
+ * IR server is written to a journal together with the cycle when it
+ * was applied.  In replay mode the emulator reads its input from the
+ * journal instead, without any socket and without waiting for real
+ * time, and so repeats the recorded execution exactly.
+ */
+
+#define REPLAY_OFF    0
+#define REPLAY_RECORD 1
+#define REPLAY_PLAY   2
+
+/** \brief REPLAY_OFF, REPLAY_RECORD or REPLAY_PLAY */
+extern BRICK_LOCAL int replay_mode;
+
+/** \brief number of input polls so far
+ *
+ * Incremented whenever the emulator looks for input while the CPU is
+ * running.  Together with cycles it identifies the point where an
+ * input was applied.
+ */
+extern BRICK_LOCAL cycle_count_t replay_polls;
+
+/** \brief open the journal for recording or replaying
+ *
+ * \returns 0 on success, -1 if the file can't be opened.
+ */
+extern int replay_open(const char *path, int mode);
+
+/** \brief read from the GUI connection
+ *
+ * The read_fd routines of the peripherals use this instead of read.
+ * It takes the data from the received command and records it, or
+ * takes it from the journal when replaying.  Returns 0 at the end of
+ * the command.
+ */
+extern int replay_read(int fd, void *buf, int len);
+
+/** \brief end a command from the GUI
+ *
+ * Writes everything read since the last call as one journal entry.
+ */
+extern void replay_end_command(void);
+
+/** \brief check for a GUI command when replaying
+ *
+ * \returns 1 if the journal has a GUI command for the current poll,
+ * that replay_read will return, 0 if not and -1 at the end of the
+ * journal.
+ */
+extern int replay_next_command(void);
+
+/** \brief read one byte from the IR server
+ *
+ * Counts as a poll of its own.
+ * \returns 1 if a byte was read, 0 or -1 otherwise.
+ */
+extern int replay_read_serial(int fd, uint8 *buf);
+
+#endif
@@ -18,34 +18,233 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h> /* for htonx/ntohx */
 #include <zlib.h>
 #include "types.h"
 #include "peripherals.h"
+#include "replay.h"
 #include "memory.h"
 #include "h8300.h"
 #include "symbols.h"
 
 #define MAX_PATHNAME_LEN 4096
-#define SAVEFILE_MAGIC "BrEmuSF0"
+
+/** \brief the layout of save files
+ *
+ * A save file starts with a savefile_header, padded to SAVEFILE_ALIGN
+ * bytes.  A full save file follows with memory and memtype, so both
+ * are page aligned if the file is mapped, and then with the records.
+ * A delta file has no memory; its records name the full save file it
+ * is based on, together with the mem_crc of that file, and hold the
+ * pages of memory that changed.  Every
+ * record starts with a savefile_record and is followed by len bytes
+ * of data; a REC_END record ends the file.  All numbers are stored in
+ * network byte order and every part has a crc32 checksum, so a
+ * damaged file is refused instead of loaded.
+ *
+ * The file may be gzip compressed; uncompressed files are mapped
+ * into memory instead of read.
+ */
+#define SAVEFILE_MAGIC   "BrEmuSav"
+#define SAVEFILE_VERSION 2
+#define SAVEFILE_ALIGN   4096
+#define SAVEFILE_DELTA   1
+
+typedef struct {
+    char   magic[8];
+    uint32 version;
+    uint32 flags;
+    /** \brief file offset of memory and memtype, 0 in delta files */
+    uint32 mem_offset;
+    uint32 mem_crc;
+    uint32 records_offset;
+    uint32 records_len;
+    /** \brief checksum of the fields above */
+    uint32 header_crc;
+} savefile_header;
+
+typedef struct {
+    uint8  kind;
+    char   id;
+    uint16 reserved;
+    uint32 len;
+    uint32 crc;
+} savefile_record;
+
+#define REC_END        0
+#define REC_SYMBOLS    1
+#define REC_PERIPHERAL 2
+#define REC_BASE       3
+#define REC_PAGE       4
+
+/** \brief maximum size of the state of a peripheral */
+#define PERIPH_DATA_MAX 512
+
+/** \brief number of address bits covered by a page of a delta file */
+#define DELTA_PAGE_BITS 8
+#define DELTA_PAGE_SIZE (1 << DELTA_PAGE_BITS)
+#define DELTA_PAGES     (0x10000 >> DELTA_PAGE_BITS)
 
 /** \brief array to hold all peripherals 
  *
  * This array is used to register the different
  * kinds of peripherals (buttons, sensors etc.)
  */
-extern peripheral_ops peripherals[100];
+extern BRICK_LOCAL peripheral_ops peripherals[100];
 
 /** \brief number of registered peripherals
  * This counter is incremented each time a
  * peripheral is registered.
  */
-extern int num_peripherals;
+extern BRICK_LOCAL int num_peripherals;
+
+/** \brief memory and memtype of the base snapshot
+ *
+ * A delta file only contains the pages that differ from the full
+ * snapshot that was last saved or loaded.  Its contents are kept here,
+ * so finding the changed pages is a plain comparison and the cpu
+ * write paths need no bookkeeping.  NULL until the first full snapshot.
+ */
+static BRICK_LOCAL uint8 *base_memory, *base_memtype;
+
+/** \brief file name of the base snapshot */
+static BRICK_LOCAL char base_path[MAX_PATHNAME_LEN+1];
+
+/** \brief mem_crc of the base snapshot
+ *
+ * Only known after loading; after saving the writer thread computes
+ * it, so the first delta file computes it again from base_memory.
+ */
+static BRICK_LOCAL uint32 base_crc;
+static BRICK_LOCAL int base_crc_known;
 
-static void save_symbol(gzFile *file, 
-                               uint16 addr, int16 type, char* name)
+/** \brief a save file captured in memory
+ *
+ * Saving only stops the brick while its state is copied into such a
+ * buffer; a writer thread compresses and writes it afterwards.  mode
+ * is the gzopen mode, NULL to write the file uncompressed.
+ */
+typedef struct {
+    char  path[MAX_PATHNAME_LEN+1];
+    const char *mode;
+    uint8 *data;
+    int   len;
+    int   size;
+} snapshot;
+
+/** \brief the writer thread of the last save, if writer_running */
+static BRICK_LOCAL pthread_t writer;
+static BRICK_LOCAL int writer_running;
+
+static void snap_put(snapshot *snap, const void *data, int len) {
+    if (snap->len + len > snap->size) {
+        while (snap->len + len > snap->size)
+            snap->size = snap->size ? 2 * snap->size : 0x10000;
+        snap->data = realloc(snap->data, snap->size);
+    }
+    memcpy(snap->data + snap->len, data, len);
+    snap->len += len;
+}
+
+/** \brief append zeros up to the next multiple of align */
+static void snap_pad(snapshot *snap, int align) {
+    static const uint8 zeros[SAVEFILE_ALIGN];
+
+    snap_put(snap, zeros, (align - snap->len % align) % align);
+}
+
+/** \brief start a record, its length and checksum are set by rec_end
+ *
+ * \return the offset of the record in the snapshot.
+ */
+static int rec_begin(snapshot *snap, int kind, char id) {
+    savefile_record rec;
+    int offset = snap->len;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = kind;
+    rec.id = id;
+    snap_put(snap, &rec, sizeof(rec));
+    return offset;
+}
+
+static void rec_end(snapshot *snap, int offset) {
+    savefile_record *rec = (savefile_record *) (snap->data + offset);
+    uint8 *data = snap->data + offset + sizeof(*rec);
+    int len = snap->len - offset - sizeof(*rec);
+
+    rec->len = htonl(len);
+    rec->crc = htonl(crc32(0, data, len));
+}
+
+static void *savefile_writer(void *arg) {
+    snapshot *snap = arg;
+    savefile_header *header = (savefile_header *) snap->data;
+    gzFile file;
+    FILE *raw;
+
+    /* checksum memory here, it takes too long for the brick to wait */
+    if (header->mem_offset)
+        header->mem_crc = htonl(crc32(0, snap->data + ntohl(header->mem_offset),
+                                      sizeof(memory) + sizeof(memtype)));
+    header->header_crc = htonl(crc32(0, snap->data,
+                                     offsetof(savefile_header, header_crc)));
+
+    if (!snap->mode) {
+        raw = fopen(snap->path, "wb");
+        if (!raw) {
+            perror(snap->path);
+        } else {
+            if (fwrite(snap->data, 1, snap->len, raw) != snap->len)
+                printf("Could not write %s\n", snap->path);
+            fclose(raw);
+        }
+    } else {
+        file = gzopen(snap->path, snap->mode);
+        if (!file) {
+            perror(snap->path);
+        } else {
+            if (gzwrite(file, snap->data, snap->len) != snap->len)
+                printf("Could not write %s\n", snap->path);
+            gzclose(file);
+        }
+    }
+    free(snap->data);
+    free(snap);
+    return NULL;
+}
+
+/** \brief wait until the last save file is completely written
+ *
+ * Called before a save file is read or the next one is written, and
+ * before the emulator exits or forks.
+ */
+void savefile_flush(void) {
+    if (writer_running) {
+        pthread_join(writer, NULL);
+        writer_running = 0;
+    }
+}
+
+/** \brief hand a captured save file to a new writer thread */
+static void savefile_write(snapshot *snap) {
+    savefile_flush();
+    if (pthread_create(&writer, NULL, savefile_writer, snap) == 0)
+        writer_running = 1;
+    else
+        savefile_writer(snap);
+}
+
+static void save_symbol(snapshot *snap,
+                        uint16 addr, int16 type, char* name)
 {
     struct {
         uint16 addr;
@@ -58,11 +257,11 @@ static void save_symbol(gzFile *file,
     sym_entry.addr = ntohs(addr);
     sym_entry.type = ntohs(type);
     sym_entry.namelen = ntohs(namelen);
-    gzwrite(file, &sym_entry, sizeof(sym_entry));
-    gzwrite(file, name, namelen);
+    snap_put(snap, &sym_entry, sizeof(sym_entry));
+    snap_put(snap, name, namelen);
 }
 
-static void load_symbols(gzFile *file)
+static void load_symbols(const uint8 *data, int len)
 {
     struct {
         uint16 addr;
@@ -70,122 +269,543 @@ static void load_symbols(gzFile *file)
         int16  namelen;
     } sym_entry;
     char *name;
-    
-    for (;;) {
-        gzread(file, &sym_entry, sizeof(sym_entry));
-        if (!sym_entry.addr && !sym_entry.type && !sym_entry.namelen)
-            break;
+    int pos = 0;
+
+    while (pos + sizeof(sym_entry) <= len) {
+        memcpy(&sym_entry, data + pos, sizeof(sym_entry));
+        pos += sizeof(sym_entry);
         sym_entry.namelen = ntohs(sym_entry.namelen);
+        if (sym_entry.namelen < 0 || pos + sym_entry.namelen > len)
+            break;
         name = malloc(sym_entry.namelen + 1);
-        gzread(file, name, sym_entry.namelen);
+        memcpy(name, data + pos, sym_entry.namelen);
         name[sym_entry.namelen] = 0;
+        pos += sym_entry.namelen;
         symbols_add(ntohs(sym_entry.addr), ntohs(sym_entry.type), name);
     }
 }
 
-static void savefile_save(char *path) {
-    gzFile *file;
-    struct {
-        char   pad;
-        char   id;
-        uint16 len;
-        char   buffer[512];
-    } block;
+/** \brief remember the current memory as base for delta files */
+static void set_base(char *path) {
+    if (!base_memory) {
+        base_memory = malloc(sizeof(memory));
+        base_memtype = malloc(sizeof(memtype));
+    }
+    memcpy(base_memory, memory, sizeof(memory));
+    memcpy(base_memtype, memtype, sizeof(memtype));
+    snprintf(base_path, sizeof(base_path), "%s", path);
+    base_crc_known = 0;
+}
+
+/** \brief check if a page differs from the base snapshot
+ *
+ * The code bits of memtype only tell which instructions were decoded;
+ * they are cleared on load anyway, so they don't make a page dirty.
+ */
+static int page_changed(int page) {
+    int addr = page << DELTA_PAGE_BITS;
     int i;
-    int len;
 
-    stop_time();
-    file = gzopen(path, "wb9");
-    gzwrite(file, SAVEFILE_MAGIC, 8);
-    gzwrite(file, memory, sizeof(memory));
-    gzwrite(file, memtype, sizeof(memtype));
+    if (memcmp(memory + addr, base_memory + addr, DELTA_PAGE_SIZE) != 0)
+        return 1;
+    for (i = addr; i < addr + DELTA_PAGE_SIZE; i++) {
+        if ((memtype[i] ^ base_memtype[i]) & ~MEMTYPE_CODE)
+            return 1;
+    }
+    return 0;
+}
+
+/** \brief start a new save file, to be filled while time is stopped
+ *
+ * The header is completed by snap_finish.
+ */
+static snapshot *snap_new(char *path, const char *mode, int flags) {
+    snapshot *snap = calloc(1, sizeof(snapshot));
+    savefile_header header;
+
+    snprintf(snap->path, sizeof(snap->path), "%s", path);
+    snap->mode = mode;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SAVEFILE_MAGIC, 8);
+    header.version = htonl(SAVEFILE_VERSION);
+    header.flags = htonl(flags);
+    snap_put(snap, &header, sizeof(header));
+    snap_pad(snap, SAVEFILE_ALIGN);
+    return snap;
+}
 
-    symbols_iterate((symbols_iterate_func) save_symbol, file);
-    save_symbol(file, 0, 0, "");
+/** \brief capture symbols and peripherals and end the records */
+static void snap_finish(snapshot *snap, int records_offset) {
+    savefile_header *header;
+    char buffer[PERIPH_DATA_MAX];
+    int i, len, rec;
+
+    rec = rec_begin(snap, REC_SYMBOLS, 0);
+    symbols_iterate((symbols_iterate_func) save_symbol, snap);
+    rec_end(snap, rec);
 
     for (i = 0; i < num_peripherals; i++) {
         if (!peripherals[i].save_data)
             continue;
-        len = peripherals[i].save_data(block.buffer, sizeof(block.buffer));
-        block.id = peripherals[i].id;
-        block.len = ntohs(len);
-        gzwrite(file, &block.id, len+sizeof(block.len)+sizeof(block.id));
-    }
-    block.id = 0;
-    gzwrite(file, &block.id, sizeof(block.id));
-    gzclose(file);
+        len = peripherals[i].save_data(buffer, sizeof(buffer));
+        rec = rec_begin(snap, REC_PERIPHERAL, peripherals[i].id);
+        snap_put(snap, buffer, len);
+        rec_end(snap, rec);
+    }
+    rec_end(snap, rec_begin(snap, REC_END, 0));
+
+    header = (savefile_header *) snap->data;
+    header->records_offset = htonl(records_offset);
+    header->records_len = htonl(snap->len - records_offset);
+}
+
+/** \brief save the state in a full save file
+ *
+ * mode is the gzopen mode, NULL for an uncompressed file.
+ */
+static void savefile_save(char *path, const char *mode) {
+    snapshot *snap = snap_new(path, mode, 0);
+
+    stop_time();
+    ((savefile_header *) snap->data)->mem_offset = htonl(snap->len);
+    snap_put(snap, memory, sizeof(memory));
+    snap_put(snap, memtype, sizeof(memtype));
+    snap_finish(snap, snap->len);
+    set_base(path);
     cont_time();
+    savefile_write(snap);
 }
 
+/** \brief save the pages changed since the base snapshot
+ *
+ * Only a few pages change between the checkpoints of a long running
+ * program, so this is written with the fastest compression level.
+ */
+static void savefile_save_delta(char *path) {
+    snapshot *snap;
+    uint32 val32;
+    uint16 val;
+    int page, pages = 0;
+    int records, rec;
 
-static void savefile_load(char *path) {
-    gzFile *file;
-    char buffer[512];
-    uint16 len;
-    int i;
+    if (!base_memory) {
+        printf("No base snapshot, saving a full one\n");
+        savefile_save(path, "wb9");
+        return;
+    }
+
+    if (!base_crc_known) {
+        base_crc = crc32(crc32(0, base_memory, sizeof(memory)),
+                         base_memtype, sizeof(memtype));
+        base_crc_known = 1;
+    }
 
+    snap = snap_new(path, "wb1", SAVEFILE_DELTA);
+    records = snap->len;
     stop_time();
-    file = gzopen(path, "rb");
-    gzread(file, buffer, 8);
-    if (memcmp(buffer, SAVEFILE_MAGIC, 8) != 0) {
-        printf("Wrong file type!\n");
+    rec = rec_begin(snap, REC_BASE, 0);
+    val32 = htonl(base_crc);
+    snap_put(snap, &val32, sizeof(val32));
+    snap_put(snap, base_path, strlen(base_path));
+    rec_end(snap, rec);
+    for (page = 0; page < DELTA_PAGES; page++) {
+        if (!page_changed(page))
+            continue;
+        rec = rec_begin(snap, REC_PAGE, 0);
+        val = htons(page);
+        snap_put(snap, &val, sizeof(val));
+        snap_put(snap, memory + (page << DELTA_PAGE_BITS), DELTA_PAGE_SIZE);
+        snap_put(snap, memtype + (page << DELTA_PAGE_BITS), DELTA_PAGE_SIZE);
+        rec_end(snap, rec);
+        pages++;
+    }
+    snap_finish(snap, records);
+    cont_time();
+    printf("Saved %d changed pages against %s\n", pages, base_path);
+    savefile_write(snap);
+}
+
+/** \brief a save file read into memory */
+typedef struct {
+    uint8 *data;
+    size_t len;
+    int    mapped;
+    savefile_header header;
+} save_image;
+
+/** \brief map or read a save file and check all its checksums
+ *
+ * \return 0 on success, -1 if the file can't be used.
+ */
+static int image_open(save_image *image, char *path) {
+    struct stat st;
+    savefile_header *header = &image->header;
+    savefile_record rec;
+    uint32 pos, end;
+    char magic[8];
+    gzFile file;
+    int fd, n;
+
+    memset(image, 0, sizeof(*image));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (read(fd, magic, 8) == 8 && memcmp(magic, SAVEFILE_MAGIC, 8) == 0
+        && fstat(fd, &st) == 0) {
+        image->len = st.st_size;
+        image->data = mmap(NULL, image->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image->data == MAP_FAILED) {
+            perror(path);
+            image->data = NULL;
+            close(fd);
+            return -1;
+        }
+        image->mapped = 1;
+        close(fd);
+    } else {
+        close(fd);
+        file = gzopen(path, "rb");
+        if (!file) {
+            perror(path);
+            return -1;
+        }
+        image->data = malloc(SAVEFILE_ALIGN);
+        while ((n = gzread(file, image->data + image->len,
+                           SAVEFILE_ALIGN)) > 0) {
+            image->len += n;
+            image->data = realloc(image->data, image->len + SAVEFILE_ALIGN);
+        }
         gzclose(file);
-        return;
     }
-    gzread(file, memory, sizeof(memory));
-    gzread(file, memtype, sizeof(memtype));
-    load_symbols(file);
 
-    while (!gzeof(file)) {
-        char id;
-        gzread(file, &id, 1);
-        if (id == 0)
-            break;
-        gzread(file, &len, sizeof(len));
-        len = ntohs(len);
-        if (len > sizeof(buffer)) {
-            printf("Too much info for peripheral %c", id);
-            goto exit;
+    if (image->len < sizeof(*header)) {
+        printf("%s is not a save file!\n", path);
+        return -1;
+    }
+    memcpy(header, image->data, sizeof(*header));
+    if (memcmp(header->magic, "BrEmuS", 6) == 0
+        && memcmp(header->magic, SAVEFILE_MAGIC, 8) != 0) {
+        printf("%s is from an older version and can't be loaded!\n", path);
+        return -1;
+    }
+    if (memcmp(header->magic, SAVEFILE_MAGIC, 8) != 0) {
+        printf("%s is not a save file!\n", path);
+        return -1;
+    }
+    if (ntohl(header->header_crc)
+        != crc32(0, image->data, offsetof(savefile_header, header_crc)))
+        goto corrupt;
+    header->version = ntohl(header->version);
+    header->flags = ntohl(header->flags);
+    header->mem_offset = ntohl(header->mem_offset);
+    header->mem_crc = ntohl(header->mem_crc);
+    header->records_offset = ntohl(header->records_offset);
+    header->records_len = ntohl(header->records_len);
+    if (header->version != SAVEFILE_VERSION) {
+        printf("%s has unknown version %d!\n", path, header->version);
+        return -1;
+    }
+
+    if (!(header->flags & SAVEFILE_DELTA)) {
+        if (header->mem_offset < sizeof(*header)
+            || image->len < sizeof(memory) + sizeof(memtype)
+            || header->mem_offset > image->len - sizeof(memory) - sizeof(memtype)
+            || header->mem_crc != crc32(0, image->data + header->mem_offset,
+                                        sizeof(memory) + sizeof(memtype)))
+            goto corrupt;
+    }
+
+    pos = header->records_offset;
+    end = pos + header->records_len;
+    if (pos < sizeof(*header) || end < pos || end > image->len)
+        goto corrupt;
+    for (;;) {
+        if (end - pos < sizeof(rec))
+            goto corrupt;
+        memcpy(&rec, image->data + pos, sizeof(rec));
+        pos += sizeof(rec);
+        rec.len = ntohl(rec.len);
+        if (rec.len > end - pos
+            || ntohl(rec.crc) != crc32(0, image->data + pos, rec.len))
+            goto corrupt;
+        if ((rec.kind == REC_PERIPHERAL && rec.len > PERIPH_DATA_MAX)
+            || (rec.kind == REC_PAGE && rec.len != 2 + 2 * DELTA_PAGE_SIZE)
+            || (rec.kind == REC_BASE
+                && (rec.len < 4 || rec.len > 4 + MAX_PATHNAME_LEN)))
+            goto corrupt;
+        pos += rec.len;
+        if (rec.kind == REC_END)
+            return 0;
+    }
+
+ corrupt:
+    printf("%s is corrupt!\n", path);
+    return -1;
+}
+
+static void image_close(save_image *image) {
+    if (!image->data)
+        return;
+    if (image->mapped)
+        munmap(image->data, image->len);
+    else
+        free(image->data);
+    image->data = NULL;
+}
+
+/** \brief find the next record of a kind in a checked image
+ *
+ * Starts after the record at *pos, or at the first one if *pos is 0.
+ *
+ * \return the record data, NULL if there is none.
+ */
+static uint8 *image_record(save_image *image, int kind, uint32 *pos,
+                           savefile_record *rec) {
+    uint32 p = *pos ? *pos : image->header.records_offset;
+
+    if (*pos) {
+        memcpy(rec, image->data + p, sizeof(*rec));
+        p += sizeof(*rec) + ntohl(rec->len);
+    }
+    for (;;) {
+        memcpy(rec, image->data + p, sizeof(*rec));
+        rec->len = ntohl(rec->len);
+        if (rec->kind == kind) {
+            *pos = p;
+            return image->data + p + sizeof(*rec);
         }
-        gzread(file, &buffer, len);
+        if (rec->kind == REC_END)
+            return NULL;
+        p += sizeof(*rec) + rec->len;
+    }
+}
 
+/** \brief load symbols and peripherals, common to all save files */
+static void load_state(save_image *image) {
+    savefile_record rec;
+    union {
+        char   buffer[PERIPH_DATA_MAX];
+        uint64 align;
+    } data;
+    uint32 pos = 0;
+    uint8 *p;
+    int i;
+
+    p = image_record(image, REC_SYMBOLS, &pos, &rec);
+    if (p)
+        load_symbols(p, rec.len);
+
+    pos = 0;
+    while ((p = image_record(image, REC_PERIPHERAL, &pos, &rec))) {
+        /* the data in a mapped file may be unaligned */
+        memcpy(data.buffer, p, rec.len);
         for (i = 0; i < num_peripherals; i++) {
-            if (id == peripherals[i].id) {
-                peripherals[i].load_data(buffer, len);
+            if (rec.id == peripherals[i].id) {
+                peripherals[i].load_data(data.buffer, rec.len);
                 break;
             }
         }
     }
+}
+
+/** \brief load a full or delta save file
+ *
+ * Both the file and the base of a delta file are checked completely
+ * before anything is changed, so a bad file leaves the brick alone.
+ * \return 0 on success, -1 if the file wasn't loaded.
+ */
+static int savefile_load(char *path) {
+    save_image image, base;
+    savefile_record rec;
+    char base_name[MAX_PATHNAME_LEN+1];
+    uint32 pos = 0, crc;
+    uint8 *p;
+    int page;
+    int result = -1;
+
+    savefile_flush();
+    base.data = NULL;
+    if (image_open(&image, path) < 0)
+        goto exit;
+
+    if (image.header.flags & SAVEFILE_DELTA) {
+        p = image_record(&image, REC_BASE, &pos, &rec);
+        if (!p) {
+            printf("%s names no base file!\n", path);
+            goto exit;
+        }
+        crc = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        memcpy(base_name, p + 4, rec.len - 4);
+        base_name[rec.len - 4] = 0;
+        if (image_open(&base, base_name) < 0)
+            goto exit;
+        if (base.header.flags & SAVEFILE_DELTA) {
+            printf("%s is not a full save file!\n", base_name);
+            goto exit;
+        }
+        if (base.header.mem_crc != crc) {
+            printf("%s has changed since %s was saved!\n", base_name, path);
+            goto exit;
+        }
+    }
 
+    stop_time();
+    /* Drop translated code while memtype still marks what was decoded. */
+    cpu_invalidate_code(0, sizeof(memory));
+    if (base.data) {
+        memcpy(memory, base.data + base.header.mem_offset, sizeof(memory));
+        memcpy(memtype, base.data + base.header.mem_offset + sizeof(memory),
+               sizeof(memtype));
+        set_base(base_name);
+        base_crc = base.header.mem_crc;
+        base_crc_known = 1;
+        pos = 0;
+        while ((p = image_record(&image, REC_PAGE, &pos, &rec))) {
+            page = ((p[0] << 8) | p[1]) & (DELTA_PAGES - 1);
+            memcpy(memory + (page << DELTA_PAGE_BITS), p + 2,
+                   DELTA_PAGE_SIZE);
+            memcpy(memtype + (page << DELTA_PAGE_BITS),
+                   p + 2 + DELTA_PAGE_SIZE, DELTA_PAGE_SIZE);
+        }
+    } else {
+        memcpy(memory, image.data + image.header.mem_offset, sizeof(memory));
+        memcpy(memtype, image.data + image.header.mem_offset + sizeof(memory),
+               sizeof(memtype));
+        set_base(path);
+        base_crc = image.header.mem_crc;
+        base_crc_known = 1;
+    }
+    mem_modified(0, sizeof(memory));
+    load_state(&image);
     frame_init();
     cont_time();
+    result = 0;
  exit:
-    gzclose(file);
-    return;
+    image_close(&base);
+    image_close(&image);
+    return result;
+}
+
+/** \brief directory of the boot state cache, NULL if there is none */
+static BRICK_LOCAL const char *boot_cache;
+
+/** \brief cache file for the boot state of the last lookup that failed */
+static BRICK_LOCAL char boot_path[MAX_PATHNAME_LEN+1];
+
+/** \brief add a file to a FNV-1a hash
+ *
+ * \return 0 on success, -1 if the file can't be read.
+ */
+static int hash_file(uint64 *hash, const char *name) {
+    uint8 buffer[4096];
+    FILE *file;
+    size_t i, n;
+
+    file = fopen(name, "rb");
+    if (!file) {
+        perror(name);
+        return -1;
+    }
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        for (i = 0; i < n; i++)
+            *hash = (*hash ^ buffer[i]) * 0x100000001b3ULL;
+    }
+    fclose(file);
+    /* separate the files, so moving bytes between them changes the hash */
+    *hash = (*hash ^ 0xff) * 0x100000001b3ULL;
+    return 0;
+}
+
+/** \brief load the boot state of the ROM and the given files
+ *
+ * files is the firmware, optionally followed by programs, separated
+ * by ';'.  The state is looked up in the boot cache by a hash of the
+ * contents of the ROM and the files.  If it isn't there, the client
+ * boots the brick and then sends "CB" to store the state.
+ * \return 1 if the state was loaded, 0 otherwise.
+ */
+static int boot_lookup(char *files) {
+    const uint8 *rom;
+    uint64 hash = 0xcbf29ce484222325ULL;
+    char *name, *next;
+    int i, len;
+
+    boot_path[0] = 0;
+    if (!boot_cache)
+        return 0;
+    len = mem_rom_image(&rom);
+    for (i = 0; i < len; i++)
+        hash = (hash ^ rom[i]) * 0x100000001b3ULL;
+    for (name = files; name; name = next) {
+        next = strchr(name, ';');
+        if (next)
+            *next++ = 0;
+        if (hash_file(&hash, name) < 0)
+            return 0;
+    }
+    snprintf(boot_path, sizeof(boot_path), "%s/boot-%016llx.bsf",
+             boot_cache, (unsigned long long) hash);
+    if (access(boot_path, R_OK) != 0 || savefile_load(boot_path) < 0)
+        return 0;
+    printf("Boot state loaded from %s\n", boot_path);
+    boot_path[0] = 0;
+    return 1;
+}
+
+/** \brief store the current state as boot state of the last lookup */
+static void boot_store(void) {
+    if (!boot_path[0])
+        return;
+    savefile_save(boot_path, NULL);
+    printf("Boot state saved to %s\n", boot_path);
+    boot_path[0] = 0;
 }
 
 static void savefile_read_fd(int fd) {
-    char buf[1];
+    char buf[8];
     char filename[MAX_PATHNAME_LEN+1];
 
     /* read in next byte: id */
-    read(fd, buf, 1);
+    replay_read(fd, buf, 1);
 
     /* read in filename */
     int len = 0;
     do {
-        len += read(fd, filename + len, 1);
-    } while (filename[len-1] != '\n' && filename[len-1] != '\r');
-    filename[len-1] = 0;
+        if (replay_read(fd, filename + len, 1) <= 0)
+            break;
+    } while (filename[len] != '\n' && filename[len] != '\r'
+             && ++len < MAX_PATHNAME_LEN);
+    filename[len] = 0;
 
 
     switch (buf[0]) {
         case 'L':
         case 'l':
             savefile_load(filename);
+            break;
         case 'S':
         case 's':
-            savefile_save(filename);
+            savefile_save(filename, "wb9");
+            break;
+        case 'R':
+        case 'r':
+            savefile_save(filename, NULL);
+            break;
+        case 'D':
+        case 'd':
+            savefile_save_delta(filename);
+            break;
+        case 'K':
+        case 'k':
+            sprintf(buf, "CK%d\n", boot_lookup(filename));
+            periph_write(buf);
+            break;
+        case 'B':
+        case 'b':
+            boot_store();
+            break;
     }
 }
 
@@ -194,6 +814,11 @@ static peripheral_ops savefile = {
     read_fd: savefile_read_fd
 };
 
-void savefile_init() {
+/** \brief register the save file commands
+ *
+ * \param cache directory of the boot state cache or NULL.
+ */
+void savefile_init(const char *cache) {
+    boot_cache = cache;
     register_peripheral(savefile);
 }
@@ -0,0 +1,531 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "h8300.h"
+#include "memory.h"
+#include "peripherals.h"
+#include "observe.h"
+#include "scenario.h"
+#include "brick.h"
+
+/** \file scenario.c
+ * \brief run the brick headless from a scenario file
+ *
+ * A scenario file has one entry per line; empty lines and lines
+ * starting with # are ignored.  An input starts with the emulated
+ * time when it is applied, e.g. 1500, 1500ms, 1.5s, 200us or 24000c
+ * (cycles); a time without unit is in ms.
+ *
+ *   time button on|run|view|prgm press|release
+ *   time sensor 1|2|3|battery value
+ *   time sensor 1|2|3|battery ramp from to duration
+ *   time sensor 1|2|3|battery square low high period duration
+ *   time firmware file
+ *   time program slot file
+ *   time ir hexbytes
+ *   time gui command
+ *
+ * Sensor values are 0-1023.  A ramp or square wave is applied as one
+ * value per millisecond.  gui sends a command of the GUI protocol, see
+ * gui_commands; commands without their arguments are refused.
+ * ir bytes are received by the serial port as if sent over IR.
+ *
+ * The conditions that end the run are
+ *
+ *   pass|fail lcd pattern
+ *   pass|fail printf text
+ *   pass|fail pc address
+ *   pass|fail watchdog
+ *   timeout time
+ *
+ * pattern is the 12 bytes of the LCD segments in hex, as in the L
+ * lines of the GUI protocol, with x for a digit that doesn't matter.
+ * printf matches a line printed with debug_printf that contains text.
+ * pc is the address of an instruction in hex; every other trap ends
+ * the run with fail and prints the state of the CPU.  timeout ends
+ * the run at the given time; use cycles for a cycle budget.
+ */
+
+/** \brief distance of the values of a waveform and of the LCD checks */
+#define SCENARIO_TICK (1000 * CYCLES_PER_USEC)
+#define MAX_CONDITIONS 32
+
+#define COND_LCD      0
+#define COND_PRINTF   1
+#define COND_PC       2
+#define COND_WATCHDOG 3
+
+/** \brief an input at a point of time */
+typedef struct {
+    cycle_count_t cycle;
+    /** \brief position in the file, keeps inputs of the same time in
+     * order */
+    int order;
+    /** \brief 'G' for a GUI command, 'S' for IR bytes */
+    char source;
+    int len;
+    char *data;
+} scenario_input;
+
+/** \brief a condition that ends the run */
+typedef struct {
+    int kind;
+    /** \brief SCENARIO_PASS or SCENARIO_FAIL */
+    int result;
+    /** \brief the line of the file, for the report */
+    char *line;
+    /** \brief the text of a printf condition */
+    char *text;
+    uint16 pc;
+    uint8 lcd[12], lcd_mask[12];
+} scenario_condition;
+
+BRICK_LOCAL int scenario_running;
+
+static BRICK_LOCAL scenario_input *inputs;
+static BRICK_LOCAL int num_inputs, inputs_size, next_input;
+static BRICK_LOCAL scenario_condition conditions[MAX_CONDITIONS];
+static BRICK_LOCAL int num_conditions;
+static BRICK_LOCAL cycle_count_t timeout;
+static BRICK_LOCAL char *timeout_line;
+
+/** \brief the IR connection: the serial port reads ir_fds[0], the
+ * scenario writes to ir_fds[1] */
+static BRICK_LOCAL int ir_fds[2];
+
+static void scenario_update_time(void);
+/* the inputs are due even while interrupts are disabled */
+static BRICK_LOCAL periph_event scenario_event = { scenario_update_time, 1, -1 };
+
+/** \brief print the result and stop the brick */
+static void scenario_finish(int result, const char *condition) {
+    static const char *names[] = { "pass", "error", "fail", "timeout" };
+
+    printf("scenario: result=%s cycles=%llu ms=%.3f condition=%s\n",
+           names[result], (unsigned long long) cycles,
+           (double) cycles / CYCLES_PER_USEC / 1000.0, condition);
+    periph_print_speed();
+    fflush(stdout);
+    brick_exit(result);
+}
+
+static int parse_time(const char *str, cycle_count_t *cycle) {
+    char *end;
+    double time = strtod(str, &end);
+
+    if (end == str || time < 0)
+        return -1;
+    if (strcmp(end, "c") == 0)
+        *cycle = time;
+    else if (strcmp(end, "us") == 0)
+        *cycle = time * CYCLES_PER_USEC;
+    else if (*end == 0 || strcmp(end, "ms") == 0)
+        *cycle = time * 1000 * CYCLES_PER_USEC;
+    else if (strcmp(end, "s") == 0)
+        *cycle = time * 1000000 * CYCLES_PER_USEC;
+    else
+        return -1;
+    return 0;
+}
+
+static void add_input(cycle_count_t cycle, char source,
+                      const char *data, int len) {
+    scenario_input *input;
+
+    if (num_inputs == inputs_size) {
+        inputs_size = inputs_size ? 2 * inputs_size : 256;
+        inputs = realloc(inputs, inputs_size * sizeof(scenario_input));
+    }
+    input = &inputs[num_inputs];
+    input->cycle = cycle;
+    input->order = num_inputs++;
+    input->source = source;
+    input->len = len;
+    input->data = malloc(len + 1);
+    memcpy(input->data, data, len);
+    input->data[len] = 0;
+}
+
+static void add_command(cycle_count_t cycle, const char *cmd) {
+    add_input(cycle, 'G', cmd, strlen(cmd));
+}
+
+static int compare_inputs(const void *a, const void *b) {
+    const scenario_input *ia = a, *ib = b;
+
+    if (ia->cycle != ib->cycle)
+        return ia->cycle < ib->cycle ? -1 : 1;
+    return ia->order - ib->order;
+}
+
+/** \brief the GUI commands a scenario may send and the least number
+ * of characters of their arguments
+ *
+ * PC is missing, as a checkpoint server waits for connections until
+ * its GUI closes.
+ */
+static const struct {
+    const char *name;
+    int args;
+} gui_commands[] = {
+    { "A", 4 }, { "B", 2 }, { "F", 1 },
+    { "OL", 2 }, { "OA", 2 }, { "ON", 1 }, { "OM", 0 }, { "OP", 0 },
+    { "OO", 0 }, { "OT", 0 }, { "OC", 0 },
+    { "PR", 0 }, { "PD", 0 }, { "PS", 1 },
+    { "CL", 1 }, { "CS", 1 }, { "CR", 1 }, { "CD", 1 }, { "CK", 1 },
+    { "CB", 0 }
+};
+
+/** \brief check that cmd is a known GUI command with its arguments */
+static int check_gui_command(const char *cmd) {
+    int i, len;
+
+    for (i = 0; i < sizeof(gui_commands) / sizeof(gui_commands[0]); i++) {
+        len = strlen(gui_commands[i].name);
+        if (strncmp(cmd, gui_commands[i].name, len) == 0)
+            return strlen(cmd + len) < gui_commands[i].args ? -1 : 0;
+    }
+    return -1;
+}
+
+/** \brief parse the sensor values starting at time */
+static int parse_sensor(cycle_count_t cycle, const char *args) {
+    static const char *names[] = { "3", "2", "1", "battery" };
+    char name[16], wave[16], cmd[16];
+    int channel, pos, from, to;
+    cycle_count_t period, duration, t;
+    char str[2][32];
+
+    if (sscanf(args, "%15s %n", name, &pos) < 1)
+        return -1;
+    for (channel = 0; channel < 4; channel++) {
+        if (strcmp(name, names[channel]) == 0)
+            break;
+    }
+    if (channel == 4)
+        return -1;
+    args += pos;
+
+    if (sscanf(args, "%d", &from) == 1 && sscanf(args, "%*d %1s", wave) < 1) {
+        if (from < 0 || from > 1023)
+            return -1;
+        sprintf(cmd, "A%d%03x\n", channel, from);
+        add_command(cycle, cmd);
+    } else if (sscanf(args, "ramp %d %d %31s", &from, &to, str[0]) == 3) {
+        if (from < 0 || from > 1023 || to < 0 || to > 1023
+            || parse_time(str[0], &duration) < 0)
+            return -1;
+        for (t = 0; t <= duration; t += SCENARIO_TICK) {
+            sprintf(cmd, "A%d%03x\n", channel, (int)
+                    (from + (to - from) * (double) t / (duration ? duration : 1)));
+            add_command(cycle + t, cmd);
+        }
+    } else if (sscanf(args, "square %d %d %31s %31s",
+                      &from, &to, str[0], str[1]) == 4) {
+        if (from < 0 || from > 1023 || to < 0 || to > 1023
+            || parse_time(str[0], &period) < 0 || period < 2
+            || parse_time(str[1], &duration) < 0)
+            return -1;
+        for (t = 0; t < duration; t += period / 2) {
+            sprintf(cmd, "A%d%03x\n", channel,
+                    (t / (period / 2)) % 2 ? to : from);
+            add_command(cycle + t, cmd);
+        }
+    } else
+        return -1;
+    return 0;
+}
+
+/** \brief parse an input line: time what args */
+static int parse_input(const char *time, const char *what, const char *args) {
+    static const char *buttons = "ORVP";
+    static const char *button_names[] = { "on", "run", "view", "prgm" };
+    char cmd[4200], name[16], state[16];
+    cycle_count_t cycle;
+    int i, slot, pos;
+
+    if (parse_time(time, &cycle) < 0)
+        return -1;
+    if (strcmp(what, "button") == 0) {
+        if (sscanf(args, "%15s %15s", name, state) < 2)
+            return -1;
+        for (i = 0; i < 4; i++) {
+            if (strcmp(name, button_names[i]) == 0)
+                break;
+        }
+        if (i == 4 || (strcmp(state, "press") && strcmp(state, "release")))
+            return -1;
+        sprintf(cmd, "B%c%c\n", buttons[i], state[0] == 'p' ? '1' : '0');
+        add_command(cycle, cmd);
+    } else if (strcmp(what, "sensor") == 0) {
+        return parse_sensor(cycle, args);
+    } else if (strcmp(what, "firmware") == 0) {
+        if (!*args)
+            return -1;
+        snprintf(cmd, sizeof(cmd), "F%s\n", args);
+        add_command(cycle, cmd);
+    } else if (strcmp(what, "program") == 0) {
+        if (sscanf(args, "%d %n", &slot, &pos) < 1 || slot < 0 || slot > 7
+            || !args[pos])
+            return -1;
+        snprintf(cmd, sizeof(cmd), "OL%d%s\n", slot, args + pos);
+        add_command(cycle, cmd);
+    } else if (strcmp(what, "ir") == 0) {
+        int len = strlen(args);
+        unsigned int byte;
+
+        if (len == 0 || len % 2 || len / 2 > sizeof(cmd))
+            return -1;
+        for (i = 0; i < len / 2; i++) {
+            if (sscanf(args + 2 * i, "%2x", &byte) < 1)
+                return -1;
+            cmd[i] = byte;
+        }
+        add_input(cycle, 'S', cmd, len / 2);
+    } else if (strcmp(what, "gui") == 0) {
+        if (check_gui_command(args) < 0)
+            return -1;
+        snprintf(cmd, sizeof(cmd), "%s\n", args);
+        add_command(cycle, cmd);
+    } else
+        return -1;
+    return 0;
+}
+
+/** \brief parse a condition line: pass|fail what args */
+static int parse_condition(const char *line, int result,
+                           const char *what, const char *args) {
+    scenario_condition *cond;
+    unsigned int value;
+    int i;
+
+    if (num_conditions == MAX_CONDITIONS)
+        return -1;
+    cond = &conditions[num_conditions];
+    memset(cond, 0, sizeof(*cond));
+    cond->result = result;
+    if (strcmp(what, "lcd") == 0) {
+        if (strlen(args) != 24)
+            return -1;
+        cond->kind = COND_LCD;
+        for (i = 0; i < 24; i++) {
+            int shift = i % 2 ? 0 : 4;
+            if (args[i] == 'x' || args[i] == 'X')
+                continue;
+            if (sscanf(args + i, "%1x", &value) < 1)
+                return -1;
+            cond->lcd[i / 2] |= value << shift;
+            cond->lcd_mask[i / 2] |= 0xf << shift;
+        }
+    } else if (strcmp(what, "printf") == 0) {
+        if (!*args)
+            return -1;
+        cond->kind = COND_PRINTF;
+        cond->text = strdup(args);
+    } else if (strcmp(what, "pc") == 0) {
+        if (sscanf(args, "%x", &value) < 1 || value > 0xffff || (value & 1))
+            return -1;
+        cond->kind = COND_PC;
+        cond->pc = value;
+    } else if (strcmp(what, "watchdog") == 0 && !*args) {
+        cond->kind = COND_WATCHDOG;
+    } else
+        return -1;
+    cond->line = strdup(line);
+    num_conditions++;
+    return 0;
+}
+
+int scenario_open(const char *path) {
+    char line[4096], word[2][64];
+    int lineno = 0, pos, len, err;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        lineno++;
+        len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'
+                           || line[len - 1] == ' '))
+            line[--len] = 0;
+        pos = 0;
+        word[1][0] = 0;
+        if (sscanf(line, "%63s %n%63s %n", word[0], &pos, word[1], &pos) < 1
+            || word[0][0] == '#')
+            continue;
+
+        if (strcmp(word[0], "pass") == 0)
+            err = parse_condition(line, SCENARIO_PASS, word[1], line + pos);
+        else if (strcmp(word[0], "fail") == 0)
+            err = parse_condition(line, SCENARIO_FAIL, word[1], line + pos);
+        else if (strcmp(word[0], "timeout") == 0) {
+            err = line[pos] || parse_time(word[1], &timeout) < 0
+                || timeout == 0 ? -1 : 0;
+            timeout_line = strdup(line);
+        } else
+            err = parse_input(word[0], word[1], line + pos);
+        if (err < 0) {
+            fprintf(stderr, "%s:%d: invalid line: %s\n", path, lineno, line);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    qsort(inputs, num_inputs, sizeof(scenario_input), compare_inputs);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ir_fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    fcntl(ir_fds[1], F_SETFL, O_NONBLOCK);
+    /* the LCD is checked in the observed state */
+    if (!observe && observe_init(NULL) < 0)
+        return -1;
+    scenario_running = 1;
+    return 0;
+}
+
+int scenario_serial_fd(void) {
+    return ir_fds[0];
+}
+
+/** \brief apply the next input */
+static void scenario_input_next(void) {
+    scenario_input *input = &inputs[next_input++];
+
+    if (input->source == 'G')
+        periph_command(input->data);
+    else if (write(ir_fds[1], input->data, input->len) != input->len)
+        fprintf(stderr, "scenario: IR input dropped\n");
+}
+
+/** \brief set the breakpoints of the pc conditions
+ *
+ * Loading a firmware or program can clear them, so this is repeated
+ * every tick.
+ */
+static void scenario_set_breakpoints(void) {
+    int i;
+
+    for (i = 0; i < num_conditions; i++) {
+        uint16 pc = conditions[i].pc;
+        if (conditions[i].kind == COND_PC
+            && !(memtype[pc] & MEMTYPE_BREAKPOINT)) {
+            mem_set_type(pc, 1, MEMTYPE_BREAKPOINT);
+            cpu_invalidate_code(pc, 2);
+        }
+    }
+}
+
+static void scenario_check_lcd(void) {
+    int i, j;
+
+    for (i = 0; i < num_conditions; i++) {
+        if (conditions[i].kind != COND_LCD)
+            continue;
+        for (j = 0; j < 12; j++) {
+            if ((observe->lcd[j] ^ conditions[i].lcd[j])
+                & conditions[i].lcd_mask[j])
+                break;
+        }
+        if (j == 12)
+            scenario_finish(conditions[i].result, conditions[i].line);
+    }
+}
+
+static void scenario_update_time(void) {
+    cycle_count_t next;
+
+    while (next_input < num_inputs && inputs[next_input].cycle <= cycles)
+        scenario_input_next();
+    scenario_check_lcd();
+    if (timeout && cycles >= timeout)
+        scenario_finish(SCENARIO_TIMEOUT, timeout_line);
+    scenario_set_breakpoints();
+
+    next = cycles + SCENARIO_TICK;
+    if (next_input < num_inputs && inputs[next_input].cycle < next)
+        next = inputs[next_input].cycle;
+    if (timeout && timeout < next)
+        next = timeout;
+    periph_schedule(&scenario_event, next);
+}
+
+void scenario_start(void) {
+    /* like the GUI commands the inputs are applied after a poll */
+    scenario_set_breakpoints();
+    periph_schedule(&scenario_event, 0);
+}
+
+void scenario_printf(const char *line) {
+    int i;
+
+    if (!scenario_running)
+        return;
+    for (i = 0; i < num_conditions; i++) {
+        if (conditions[i].kind == COND_PRINTF
+            && strstr(line, conditions[i].text))
+            scenario_finish(conditions[i].result, conditions[i].line);
+    }
+}
+
+void scenario_watchdog(void) {
+    int i;
+
+    if (!scenario_running)
+        return;
+    for (i = 0; i < num_conditions; i++) {
+        if (conditions[i].kind == COND_WATCHDOG)
+            scenario_finish(conditions[i].result, conditions[i].line);
+    }
+}
+
+void scenario_trap(void) {
+    char reason[32];
+    int i;
+
+    if (!scenario_running)
+        return;
+    for (i = 0; i < num_conditions; i++) {
+        if (conditions[i].kind == COND_PC && conditions[i].pc == pc)
+            scenario_finish(conditions[i].result, conditions[i].line);
+    }
+    sprintf(reason, "trap %d at %04x", db_trap, pc);
+    dump_state();
+    scenario_finish(SCENARIO_FAIL, reason);
+}
+
+/** While the CPU is in software standby the emulated time stands
+ * still, so the next input is applied at once.
+ */
+void scenario_standby(void) {
+    if (next_input == num_inputs)
+        scenario_finish(SCENARIO_TIMEOUT, "standby without input");
+    scenario_input_next();
+}
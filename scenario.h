@@ -0,0 +1,71 @@
+/* Emulator for LEGO RCX Brick, Copyright (C) 2003 Jochen Hoenicke.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; see the file COPYING.LESSER.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#ifndef _SCENARIO_H_
+#define  _SCENARIO_H_
+
+#include "types.h"
+
+/** \file scenario.h
+ * \brief run the brick headless from a scenario file
+ *
+ * A scenario gives the inputs of the brick at fixed points of the
+ * emulated time and the conditions that end the run.  Instead of the
+ * GUI and the IR server the brick gets its input from the scenario.
+ * At the end the emulator prints one line
+ *
+ *   scenario: result=pass cycles=123456 ms=7.716 condition=...
+ *
+ * and exits with SCENARIO_PASS, SCENARIO_FAIL or SCENARIO_TIMEOUT.
+ * The file format is described in scenario.c.
+ */
+
+#define SCENARIO_PASS    0
+#define SCENARIO_ERROR   1
+#define SCENARIO_FAIL    2
+#define SCENARIO_TIMEOUT 3
+
+/** \brief 1 if the brick runs a scenario */
+extern BRICK_LOCAL int scenario_running;
+
+/** \brief read the scenario
+ *
+ * Call before the peripherals are initialized.
+ * \returns 0 on success, -1 if the file can't be read or is invalid.
+ */
+extern int scenario_open(const char *path);
+
+/** \brief the file descriptor the serial port uses instead of the IR
+ * server */
+extern int scenario_serial_fd(void);
+
+/** \brief schedule the first input; call after the peripherals are
+ * initialized */
+extern void scenario_start(void);
+
+/** \brief tell the scenario about a line the program printed */
+extern void scenario_printf(const char *line);
+/** \brief tell the scenario that the watchdog reset the brick */
+extern void scenario_watchdog(void);
+/** \brief tell the scenario that the CPU stopped at a trap */
+extern void scenario_trap(void);
+/** \brief tell the scenario that the CPU sleeps until an input comes */
+extern void scenario_standby(void);
+
+#endif
@@ -31,6 +31,8 @@
 #include "h8300.h"
 #include "memory.h"
 #include "peripherals.h"
+#include "replay.h"
+#include "scenario.h"
 
 /* #define VERBOSE_SERIAL */
 
@@ -57,22 +59,26 @@
 #define SSR_MPB  0x02
 #define SSR_MPBT 0x01
 
-int ser_cycles;
+BRICK_LOCAL int ser_cycles;
 
 #ifdef VERBOSE_SERIAL
-int first = 1, last = 1;
-uint32 next_debug_out = 0;
-uint8  serd[100000];
-uint32 serc[100000];
-uint8  serb[100000];
+BRICK_LOCAL int first = 1, last = 1;
+BRICK_LOCAL uint32 next_debug_out = 0;
+BRICK_LOCAL uint8  serd[100000];
+BRICK_LOCAL uint32 serc[100000];
+BRICK_LOCAL uint8  serb[100000];
 #endif
 
-int serfd;
+BRICK_LOCAL int serfd;
 
-static int8 receiving;
+static BRICK_LOCAL int8 receiving;
 
-static uint8  rdr, tdr, smr, scr, ssr, readssr, brr, stcr;
-static cycle_count_t rx_cycle, tx_cycle;
+static BRICK_LOCAL uint8  rdr, tdr, smr, scr, ssr, readssr, brr, stcr;
+static BRICK_LOCAL cycle_count_t rx_cycle, tx_cycle;
+
+static void ser_check_next_cycle(void);
+static void ser_update_time(void);
+static BRICK_LOCAL periph_event ser_event = { ser_update_time, 0, -1 };
 
 /* Hook to add ftoa/b listeners */
 #define SET_FTOA(v) do {} while(0)
@@ -117,6 +123,7 @@ static void ser_load(void *buffer, int len) {
     stcr = data->stcr;
     ser_update_cycles();
     tx_cycle = add_to_cycle('t', cycles, ser_cycles);
+    ser_check_next_cycle();
 }
 
 static void ser_reset() {
@@ -127,10 +134,12 @@ static void ser_reset() {
     receiving = 0;
     ser_update_cycles();
     tx_cycle = cycles;
+    ser_check_next_cycle();
 }
 
 static void ser_check_next_cycle() {
     uint32 next = ser_cycles;
+    int irqs;
 
 #ifdef VERBOSE_SERIAL
     if ((int32)(cycles - next_debug_out) >= 0) {
@@ -148,11 +157,13 @@ static void ser_check_next_cycle() {
     }
 #endif
 
-    if (scr & ssr & (SSR_RDRF | SSR_TDRE | SSR_TEND)) {
-        /* interrupt is pending */
-        next_timer_cycle = cycles;
-        return;
-    }
+    irqs = scr & ssr & (SSR_RDRF | SSR_TDRE | SSR_TEND);
+#ifdef DEBUG_SERIAL
+    if (irqs) printf("ser_check_next_cycle(%02x, %02x, %02x)\n", scr, ssr, irqs);
+#endif
+    irq_set(RXI_HANDLER, irqs & SSR_RDRF);
+    irq_set(TXI_HANDLER, irqs & SSR_TDRE);
+    irq_set(TEI_HANDLER, irqs & SSR_TEND);
 
     if (rx_cycle != cycles && (uint32) (rx_cycle - cycles) < next
         && (scr & SSR_RDRF)) {
@@ -168,9 +179,7 @@ static void ser_check_next_cycle() {
     }
 #endif
 
-    if ((int32) next < (int32) (next_timer_cycle - cycles)) {
-        next_timer_cycle = add_to_cycle('q', cycles, next);
-    }
+    periph_schedule(&ser_event, add_to_cycle('q', cycles, next));
 }
 
 static void ser_update_time() {
@@ -189,7 +198,7 @@ static void ser_update_time() {
     if ((int32) (cycles - rx_cycle) >= 0) {
         uint8 buf;
       /*      printf("%10d: update_time (%10d)\n", cycles, rx_cycle);  */
-        if (receiving) {
+        if (receiving && replay_mode != REPLAY_PLAY) {
             /* wait for 5 ms in case there was some lag due to external
              * processes.
              */
@@ -201,7 +210,7 @@ static void ser_update_time() {
             FD_SET(serfd, &rdfds);
             select(serfd+1, &rdfds, NULL, NULL, &timeval);
         }
-        if (read(serfd, &buf, 1) > 0 && (scr & SCR_RE)) {
+        if (replay_read_serial(serfd, &buf) > 0 && (scr & SCR_RE)) {
 #ifdef VERBOSE_SERIAL
             serd[last] = 0;
             serc[last] = cycles;
@@ -226,26 +235,10 @@ static void ser_update_time() {
     ser_check_next_cycle();
 }
 
-static int ser_check_irq() {
-    int irqs;
-
-    irqs = scr & ssr & (SSR_RDRF | SSR_TDRE | SSR_TEND);
-#ifdef DEBUG_SERIAL
-    if (irqs) printf("check_irq(%02x, %02x, %02x)\n", scr, ssr, irqs);
-#endif
-    if (irqs & SSR_RDRF)
-        return RXI_HANDLER;
-    if (irqs & SSR_TDRE)
-        return TXI_HANDLER;
-    if (irqs & SSR_TEND)
-        return TEI_HANDLER;
-    return 255;
-}
-
-
 static void set_SMR(uint8 val) {
     smr = val;
     ser_update_cycles();
+    ser_check_next_cycle();
 }
 static uint8 get_SMR(void) {
     return smr;
@@ -253,6 +246,7 @@ static uint8 get_SMR(void) {
 static void set_BRR(uint8 val) {
     brr = val;
     ser_update_cycles();
+    ser_check_next_cycle();
 }
 static uint8 get_BRR(void) {
     return brr;
@@ -316,7 +310,6 @@ peripheral_ops serial = {
     id: 'S',
     reset: ser_reset,
     update_time: ser_update_time,
-    check_irq: ser_check_irq,
     load_data: ser_load,
     save_data: ser_save
 };
@@ -338,18 +331,41 @@ int connect_server() {
     return sockfd;
 }
 
-void ser_init() {
-    printf("Connecting to IR-Server...");
+/** \brief connect to the IR server again
+ *
+ * A brick forked from a checkpoint calls this, so that it doesn't
+ * share the connection with its parent and siblings.
+ */
+void ser_reconnect(void) {
+    close(serfd);
     serfd = connect_server();
     if (serfd < 0) {
-        system("./ir-server");
+        printf ("Can't connect to IR-Server!\n");
+        abort();
+    }
+    fcntl(serfd, F_SETFL, O_NONBLOCK);
+}
+
+void ser_init() {
+    if (replay_mode == REPLAY_PLAY) {
+        /* the input comes from the journal, the output is discarded */
+        serfd = open("/dev/null", O_RDWR);
+    } else if (scenario_running) {
+        /* the input comes from the scenario, the output is discarded */
+        serfd = scenario_serial_fd();
+    } else {
+        printf("Connecting to IR-Server...");
         serfd = connect_server();
         if (serfd < 0) {
-            printf ("Can't connect to IR-Server!\n");
-            abort();
+            system("./ir-server");
+            serfd = connect_server();
+            if (serfd < 0) {
+                printf ("Can't connect to IR-Server!\n");
+                abort();
+            }
         }
+        printf("Connected to IR-Server via %d.\n", serfd);
     }
-    printf("Connected to IR-Server via %d.\n", serfd);
 
     fcntl(serfd, F_SETFL, O_NONBLOCK);
 
@@ -181,6 +181,7 @@ int srec_read (FILE *file, int start) {
         /* Process s-record data */
         if (srec.type == 1) {
             memcpy(&memory[srec.addr], &srec.data, srec.count);
+            mem_modified(srec.addr, srec.count);
         }
         /* Process image starting address */
         else if (srec.type == 9) {
@@ -31,7 +31,7 @@ struct symbol {
 };
 
 
-static struct symbol *root;
+static BRICK_LOCAL struct symbol *root;
 
 /*
 // top down splay routine.
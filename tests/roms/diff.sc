@@ -0,0 +1,4 @@
+# Scenario of the differential test ROMs, see difftest.sh.  They stop
+# at a trap long before the timeout; the scenario then prints the state
+# of the CPU and exits with 2 (fail).
+timeout 1s
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Differential test of the cpu cores.
+#
+# Builds the emulator with threaded dispatch, with the switch, with
+# lazy flags and, on x86_64, with the assembler core, which doesn't
+# skip idle loops, and with the assembler core and the JIT.  Then runs
+# every diff-*.srec ROM headless in each build and compares the final
+# state of the CPU, the RAM checksum in r5 and the cycle count.  The
+# cycles skipped in idle loops are printed, but not compared, nor are
+# the memory types of the code at pc, which only the C core marks.
+#
+# usage: difftest.sh [make arguments for all builds]
+
+roms=$(cd "$(dirname "$0")" && pwd)
+src=$(cd "$roms/../.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+builds="threaded switch lazy"
+[ "$(uname -m)" = x86_64 ] && builds="$builds asm jit"
+
+for build in $builds; do
+    case $build in
+    switch) args="CPPFLAGS=-DNO_THREADED_DISPATCH" ;;
+    lazy)   args="LAZY_FLAGS=yes" ;;
+    asm)    args="MACHINE=x86_64 JIT=no" ;;
+    jit)    args="MACHINE=x86_64" ;;
+    *)      args= ;;
+    esac
+    mkdir "$tmp/$build"
+    (cd "$src" && cp *.c *.h *.pl *.dat *.S Makefile Makefile.sub "$tmp/$build")
+    echo "building $build"
+    if ! make -C "$tmp/$build" emu SOUND=mute $args "$@" \
+            > "$tmp/$build.log" 2>&1; then
+        cat "$tmp/$build.log"
+        exit 1
+    fi
+done
+
+failed=0
+for rom in "$roms"/diff-*.srec; do
+    name=$(basename "$rom")
+    for build in $builds; do
+        (cd "$tmp/$build" && ./emu -rom "$rom" -scenario "$roms/diff.sc") \
+            2>/dev/null | sed -n '/^  R0:/,$p' \
+            | sed -e 's/ *\[[0-9a-f ]*\]$//' -e '/ s simulated in /d' \
+            > "$tmp/$build.out"
+    done
+    cycles=$(sed -n 's/.* cycles=\([0-9]*\) .*/\1/p' "$tmp/threaded.out")
+    skipped=$(sed -n 's/.*skipped: *//p' "$tmp/threaded.out")
+    result="$name: $cycles cycles, $skipped skipped in idle loops"
+    grep -v 'idle cycles skipped' "$tmp/threaded.out" > "$tmp/expected"
+    differs=
+    for build in $builds; do
+        if [ ! -s "$tmp/expected" ] \
+            || ! grep -v 'idle cycles skipped' "$tmp/$build.out" \
+                | cmp -s - "$tmp/expected"; then
+            result="$result, $build differs"
+            differs="$differs $build"
+            failed=1
+        fi
+    done
+    echo "$result"
+    for build in $differs; do
+        diff "$tmp/threaded.out" "$tmp/$build.out"
+    done
+done
+exit $failed
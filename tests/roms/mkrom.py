@@ -0,0 +1,446 @@
+#!/usr/bin/env python3
+"""Generate the test ROMs of brickEmu in SREC format.
+
+  mkrom.py diff SEED [idle]   random program for the differential test
+  mkrom.py loop               minimal ROM for the scenario tests
+
+A differential test ROM runs a random sequence of opcodes in a loop
+while timer A of the 16 bit timer interrupts it, patches and runs code
+in RAM, optionally waits in an idle loop for 40 timer interrupts, adds
+up the RAM in r5 and stops at a trap.  The same seed always gives the
+same ROM, so the checked-in ROMs can be made again with
+
+  for s in 1 2 3 4 5 6; do
+      ./mkrom.py diff $s $([ $((s % 3)) = 0 ] && echo idle) > diff-$s.srec
+  done
+
+The minimal ROM loop.srec counts r0 down from 1000 and then spins at
+0x010e forever.
+"""
+import random
+import sys
+
+TIMER_PERIOD = 0x0180
+ITERATIONS = 60
+OPCODES_PER_ITERATION = 120
+
+
+class Asm:
+    """A minimal H8/300 assembler with labels."""
+
+    def __init__(self):
+        self.code = bytearray()
+        self.labels = {}
+        self.fixups = []
+
+    def label(self, name):
+        self.labels[name] = len(self.code)
+
+    def b(self, *bs):
+        for x in bs:
+            self.code.append(x & 0xff)
+
+    def w(self, v):
+        self.b(v >> 8, v)
+
+    def nop(self): self.b(0x00, 0x00)
+    def trap(self): self.b(0x57, 0x30)
+    def movb(self, rs, rd): self.b(0x0c, (rs << 4) | rd)
+    def movw(self, rs, rd): self.b(0x0d, (rs << 4) | rd)
+    def movbi(self, imm, rd): self.b(0xf0 | rd, imm)
+    def movwi(self, imm, rd): self.b(0x79, rd); self.w(imm)
+    def addb(self, rs, rd): self.b(0x08, (rs << 4) | rd)
+    def addw(self, rs, rd): self.b(0x09, (rs << 4) | rd)
+    def addbi(self, imm, rd): self.b(0x80 | rd, imm)
+    def addx(self, rs, rd): self.b(0x0e, (rs << 4) | rd)
+    def addxi(self, imm, rd): self.b(0x90 | rd, imm)
+    def subb(self, rs, rd): self.b(0x18, (rs << 4) | rd)
+    def subw(self, rs, rd): self.b(0x19, (rs << 4) | rd)
+    def subx(self, rs, rd): self.b(0x1e, (rs << 4) | rd)
+    def subxi(self, imm, rd): self.b(0xb0 | rd, imm)
+    def cmpb(self, rs, rd): self.b(0x1c, (rs << 4) | rd)
+    def cmpw(self, rs, rd): self.b(0x1d, (rs << 4) | rd)
+    def cmpbi(self, imm, rd): self.b(0xa0 | rd, imm)
+    def orb(self, rs, rd): self.b(0x14, (rs << 4) | rd)
+    def xorb(self, rs, rd): self.b(0x15, (rs << 4) | rd)
+    def andb(self, rs, rd): self.b(0x16, (rs << 4) | rd)
+    def orbi(self, imm, rd): self.b(0xc0 | rd, imm)
+    def xorbi(self, imm, rd): self.b(0xd0 | rd, imm)
+    def andbi(self, imm, rd): self.b(0xe0 | rd, imm)
+    def notb(self, rd): self.b(0x17, rd)
+    def negb(self, rd): self.b(0x17, 0x80 | rd)
+    def inc(self, rd): self.b(0x0a, rd)
+    def dec(self, rd): self.b(0x1a, rd)
+    def adds(self, n, rd): self.b(0x0b, (0x80 if n == 2 else 0) | rd)
+    def subs(self, n, rd): self.b(0x1b, (0x80 if n == 2 else 0) | rd)
+    def shll(self, rd): self.b(0x10, rd)
+    def shal(self, rd): self.b(0x10, 0x80 | rd)
+    def shlr(self, rd): self.b(0x11, rd)
+    def shar(self, rd): self.b(0x11, 0x80 | rd)
+    def rotxl(self, rd): self.b(0x12, rd)
+    def rotl(self, rd): self.b(0x12, 0x80 | rd)
+    def rotxr(self, rd): self.b(0x13, rd)
+    def rotr(self, rd): self.b(0x13, 0x80 | rd)
+    def mulxu(self, rs, rd): self.b(0x50, (rs << 4) | rd)
+    def divxu(self, rs, rd): self.b(0x51, (rs << 4) | rd)
+    def daa(self, rd): self.b(0x0f, rd)
+    def das(self, rd): self.b(0x1f, rd)
+    def stc(self, rd): self.b(0x02, rd)
+    def ldc(self, rs): self.b(0x03, rs)
+    def orc(self, imm): self.b(0x04, imm)
+    def xorc(self, imm): self.b(0x05, imm)
+    def andc(self, imm): self.b(0x06, imm)
+    def bset(self, bit, rd): self.b(0x70, (bit << 4) | rd)
+    def bnot(self, bit, rd): self.b(0x71, (bit << 4) | rd)
+    def bclr(self, bit, rd): self.b(0x72, (bit << 4) | rd)
+    def btst(self, bit, rd): self.b(0x73, (bit << 4) | rd)
+    def bor(self, bit, rd): self.b(0x74, (bit << 4) | rd)
+    def bxor(self, bit, rd): self.b(0x75, (bit << 4) | rd)
+    def band(self, bit, rd): self.b(0x76, (bit << 4) | rd)
+    def bld(self, bit, rd): self.b(0x77, (bit << 4) | rd)
+    def bst(self, bit, rd): self.b(0x67, (bit << 4) | rd)
+    # mov.x @(d,rs),rd and mov.x rs,@(d,rd)
+    def movb_ldd(self, d, rs, rd): self.b(0x6e, (rs << 4) | rd); self.w(d)
+    def movb_std(self, rs, d, rd): self.b(0x6e, 0x80 | (rd << 4) | rs); self.w(d)
+    def movw_ldd(self, d, rs, rd): self.b(0x6f, (rs << 4) | rd); self.w(d)
+    def movw_std(self, rs, d, rd): self.b(0x6f, 0x80 | (rd << 4) | rs); self.w(d)
+    # mov.w @rs+,rd and mov.w rs,@-rd
+    def movw_ldp(self, rs, rd): self.b(0x6d, (rs << 4) | rd)
+    def movw_stm(self, rs, rd): self.b(0x6d, 0x80 | (rd << 4) | rs)
+    def push(self, r): self.movw_stm(r, 7)
+    def pop(self, r): self.movw_ldp(7, r)
+    # mov.x @aa:16,rd and mov.x rs,@aa:16
+    def movb_lda(self, a, rd): self.b(0x6a, rd); self.w(a)
+    def movb_sta(self, rs, a): self.b(0x6a, 0x80 | rs); self.w(a)
+    def movw_lda(self, a, rd): self.b(0x6b, rd); self.w(a)
+    def movw_sta(self, rs, a): self.b(0x6b, 0x80 | rs); self.w(a)
+    def btst_abs(self, bit, a8): self.b(0x7e, a8); self.b(0x73, bit << 4)
+    def bset_ind(self, bit, r): self.b(0x7d, r << 4); self.b(0x70, bit << 4)
+    def btst_ind(self, bit, r): self.b(0x7c, r << 4); self.b(0x73, bit << 4)
+
+    def rel8(self, op, target):
+        self.fixups.append((len(self.code) + 1, 'rel8', target))
+        self.b(op, 0)
+
+    def bra(self, t): self.rel8(0x40, t)
+    def bne(self, t): self.rel8(0x46, t)
+    def beq(self, t): self.rel8(0x47, t)
+    def blo(self, t): self.rel8(0x43, t)
+
+    def abs16(self, op, t):
+        self.b(op, 0)
+        self.fixups.append((len(self.code), 'abs16', t))
+        self.w(0)
+
+    def jmp(self, t): self.abs16(0x5a, t)
+    def jsr(self, t): self.abs16(0x5e, t)
+    def jmp_r(self, r): self.b(0x59, r << 4)
+    def rts(self): self.b(0x54, 0x70)
+    def rte(self): self.b(0x56, 0x70)
+
+    def resolve(self):
+        for off, kind, t in self.fixups:
+            addr = self.labels[t] if isinstance(t, str) else t
+            if kind == 'rel8':
+                d = addr - (off + 1)
+                assert -128 <= d < 128, (t, d)
+                self.code[off] = d & 0xff
+            else:
+                self.code[off] = (addr >> 8) & 0xff
+                self.code[off + 1] = addr & 0xff
+        return bytearray(self.code)
+
+
+def prologue(a):
+    """Reset vector, stack and timer A interrupt every TIMER_PERIOD."""
+    a.w(0x0100)
+    a.code.extend(b'\0' * (0x100 - 2))
+    a.movwi(0xff80, 7)
+    a.movwi(0x0000, 0)
+    a.movw_sta(0, 0xfd90)
+    a.movbi(0xf7, 0)
+    a.movb_sta(0, 0xff91)            # TCSR: clear the flags
+    a.movbi(0x00, 0)
+    a.movb_sta(0, 0xff97)            # TOCR: select OCRA
+    a.movbi(TIMER_PERIOD >> 8, 0)
+    a.movb_sta(0, 0xff94)
+    a.movbi(TIMER_PERIOD & 0xff, 0)
+    a.movb_sta(0, 0xff95)
+    a.movbi(0x01, 0)
+    a.movb_sta(0, 0xff91)            # TCSR: clear counter on match A
+    a.movbi(0x00, 0)
+    a.movb_sta(0, 0xff96)            # TCR: clock / 2
+    a.movbi(0x09, 0)
+    a.movb_sta(0, 0xff90)            # TIER: OCIEA
+    a.andc(0x7f)
+
+
+def irq_handler(a):
+    """Count the interrupts in 0xfd90."""
+    a.label('ocia')
+    a.push(0)
+    a.movw_lda(0xfd90, 0)
+    a.adds(1, 0)
+    a.movw_sta(0, 0xfd90)
+    a.movb_lda(0xff91, 0)
+    a.movbi(0xf7, 0)
+    a.movb_sta(0, 0xff91)
+    a.pop(0)
+    a.rte()
+
+
+OPS = ['movb', 'movw', 'movbi', 'movwi', 'addb', 'addw', 'addbi', 'addx',
+       'addxi', 'subb', 'subw', 'subx', 'subxi', 'cmpb', 'cmpw', 'cmpbi',
+       'orb', 'xorb', 'andb', 'orbi', 'xorbi', 'andbi', 'notb', 'negb',
+       'inc', 'dec', 'adds', 'subs', 'shll', 'shal', 'shlr', 'shar',
+       'rotxl', 'rotl', 'rotxr', 'rotr', 'mulxu', 'divxu', 'daa', 'das',
+       'stc', 'ldc', 'orc', 'andc', 'xorc', 'bset', 'bclr', 'bnot', 'btst',
+       'bld', 'bst', 'band', 'bor', 'bxor', 'mem', 'mem', 'mem', 'branch',
+       'branch', 'call', 'bitmem', 'nop', 'brn', 'bra', 'jmpr']
+
+# r5 is scratch, r6 the data pointer and r7 the stack pointer
+WREGS = [0, 1, 2, 3, 4]
+BREGS = [0, 1, 2, 3, 4, 8, 9, 10, 11, 12]
+
+
+def random_op(a, rnd, depth, nlabel):
+    op = rnd.choice(OPS)
+    br = lambda: rnd.choice(BREGS)
+    wr = lambda: rnd.choice(WREGS)
+
+    def new_label():
+        nlabel[0] += 1
+        return 'L%d' % nlabel[0]
+
+    if op in ('movb', 'addb', 'addx', 'subb', 'subx', 'cmpb', 'orb', 'xorb',
+              'andb'):
+        getattr(a, op)(br(), br())
+    elif op in ('movw', 'addw', 'subw', 'cmpw'):
+        getattr(a, op)(wr(), wr())
+    elif op in ('movbi', 'addbi', 'addxi', 'subxi', 'cmpbi', 'orbi', 'xorbi',
+                'andbi'):
+        getattr(a, op)(rnd.randrange(256), br())
+    elif op == 'movwi':
+        a.movwi(rnd.randrange(65536), wr())
+    elif op in ('notb', 'negb', 'inc', 'dec', 'shll', 'shal', 'shlr', 'shar',
+                'rotxl', 'rotl', 'rotxr', 'rotr', 'daa', 'das', 'stc'):
+        getattr(a, op)(br())
+    elif op in ('adds', 'subs'):
+        getattr(a, op)(rnd.choice([1, 2]), wr())
+    elif op in ('mulxu', 'divxu'):
+        getattr(a, op)(br(), wr())
+    elif op == 'ldc':
+        a.ldc(br())
+        a.andc(0x7f)                 # keep the interrupts enabled
+    elif op in ('orc', 'xorc'):
+        getattr(a, op)(rnd.randrange(256) & 0x6f)
+    elif op == 'andc':
+        a.andc(rnd.randrange(256) & 0x7f)
+    elif op in ('bset', 'bclr', 'bnot', 'btst', 'bld', 'bst', 'band', 'bor',
+                'bxor'):
+        getattr(a, op)(rnd.randrange(8), br())
+    elif op == 'mem':
+        k = rnd.randrange(8)
+        d = rnd.randrange(0, 0x40) * 2
+        if k == 0:
+            a.movb_ldd(d + rnd.randrange(2), 6, br())
+        elif k == 1:
+            a.movb_std(br(), d + rnd.randrange(2), 6)
+        elif k == 2:
+            a.movw_ldd(d, 6, wr())
+        elif k == 3:
+            a.movw_std(wr(), d, 6)
+        elif k == 4:
+            a.push(wr())
+            random_op(a, rnd, depth, nlabel)
+            a.pop(wr())
+        elif k == 5:
+            a.movw_sta(wr(), 0x8100 + d)
+        elif k == 6:
+            a.movw_lda(0x8100 + d, wr())
+        else:
+            a.movb_lda(0xfe00 + d, br())
+    elif op == 'bitmem':
+        k = rnd.randrange(3)
+        if k == 0:
+            a.bset_ind(rnd.randrange(8), 6)
+        elif k == 1:
+            a.btst_ind(rnd.randrange(8), 6)
+        else:
+            a.btst_abs(rnd.randrange(8), 0x40 + rnd.randrange(0x20))
+    elif op == 'branch' and depth < 2:
+        # a forward Bcc with a random condition
+        lbl = new_label()
+        a.rel8(0x40 | rnd.randrange(16), lbl)
+        for _ in range(rnd.randrange(1, 5)):
+            random_op(a, rnd, depth + 1, nlabel)
+        a.label(lbl)
+    elif op == 'nop':
+        a.nop()
+    elif op == 'brn':
+        a.b(0x41, rnd.randrange(256) & 0xfe)
+    elif op == 'bra':
+        lbl = new_label()
+        a.bra(lbl)
+        a.movbi(rnd.randrange(256), br())
+        a.label(lbl)
+    elif op == 'jmpr':
+        lbl = new_label()
+        a.b(0x79, 5)
+        a.fixups.append((len(a.code), 'abs16', lbl))
+        a.w(0)
+        if rnd.randrange(2):
+            a.jmp_r(5)
+        else:
+            a.jmp(lbl)
+        a.movbi(rnd.randrange(256), br())
+        a.label(lbl)
+    elif op == 'call' and depth < 1:
+        a.jsr('sub%d' % rnd.randrange(4))
+    else:
+        a.nop()
+
+
+def self_modifying_code(a):
+    """Run add.b #1,r0l; rts at 0x9000 in a loop and patch it."""
+    a.movwi(0x8801, 1)
+    a.movw_sta(1, 0x9000)
+    a.movwi(0x5470, 1)
+    a.movw_sta(1, 0x9002)
+    a.movwi(0, 0)
+    a.movbi(50, 2)
+    a.label('smc1')
+    a.jsr(0x9000)
+    a.dec(2)
+    a.bne('smc1')
+    # patch the immediate byte
+    a.movbi(0x03, 1)
+    a.movb_sta(1, 0x9001)
+    a.movbi(50, 2)
+    a.label('smc2')
+    a.jsr(0x9000)
+    a.dec(2)
+    a.bne('smc2')
+    # patch the whole instruction with a word write: add.b #5,r0h
+    a.movwi(0x8005, 1)
+    a.movw_sta(1, 0x9000)
+    a.movbi(20, 2)
+    a.label('smc3')
+    a.jsr(0x9000)
+    a.dec(2)
+    a.bne('smc3')
+    # patch the rts with a push: add.b #1,r1l
+    a.movwi(0x9002, 3)
+    a.movwi(0x8901, 1)
+    a.movw_stm(1, 3)
+    a.movbi(20, 2)
+    a.label('smc4')
+    a.jsr(0x9000)
+    a.dec(2)
+    a.bne('smc4')
+    a.movw_sta(0, 0xfd94)
+
+
+def idle_wait(a):
+    """Spin on the interrupt counter until it advanced 40 ticks."""
+    a.movw_lda(0xfd90, 1)
+    a.movwi(40, 2)
+    a.addw(2, 1)
+    a.label('idle')
+    a.movw_lda(0xfd90, 0)
+    a.cmpw(1, 0)
+    a.blo('idle')
+
+
+def checksum(a):
+    """Add up the words of the RAM the program uses in r5."""
+    a.movwi(0, 5)
+    for start, end in ((0x8000, 0xa000), (0xfd80, 0xff80)):
+        lbl = 'sum%04x' % start
+        a.movwi(start, 6)
+        a.movwi(end, 3)
+        a.label(lbl)
+        a.movw_ldp(6, 4)
+        a.addw(4, 5)
+        a.cmpw(3, 6)
+        a.bne(lbl)
+
+
+def diff_rom(seed, idle=False):
+    rnd = random.Random(seed)
+    a = Asm()
+    prologue(a)
+    a.movwi(0xfe40, 6)
+    a.movwi(ITERATIONS, 0)
+    a.movw_sta(0, 0xfd92)
+    a.label('loop')
+    nlabel = [0]
+    for _ in range(OPCODES_PER_ITERATION):
+        random_op(a, rnd, 0, nlabel)
+    a.movw_lda(0xfd92, 0)
+    a.subs(1, 0)
+    a.movw_sta(0, 0xfd92)
+    a.movwi(0, 1)
+    a.cmpw(1, 0)
+    a.beq('done')
+    a.jmp('loop')
+    a.label('done')
+    self_modifying_code(a)
+    if idle:
+        idle_wait(a)
+    checksum(a)
+    a.trap()
+    for i in range(4):
+        a.label('sub%d' % i)
+        for _ in range(rnd.randrange(2, 8)):
+            random_op(a, rnd, 1, nlabel)
+        a.rts()
+    irq_handler(a)
+    rom = a.resolve()
+    # vector 16 is OCIA
+    rom[32] = a.labels['ocia'] >> 8
+    rom[33] = a.labels['ocia'] & 0xff
+    return rom
+
+
+def loop_rom():
+    a = Asm()
+    a.w(0x0100)
+    a.code.extend(b'\0' * (0x100 - 2))
+    a.movwi(0xff80, 7)
+    a.movwi(1000, 0)
+    a.label('loop')
+    a.subs(1, 0)
+    a.movw(0, 0)
+    a.bne('loop')
+    a.label('done')
+    a.bra('done')
+    assert a.labels['done'] == 0x010e
+    return a.resolve()
+
+
+def srec(rom, out):
+    """Write the non-zero 16 byte lines of rom as S1 records."""
+    for addr in range(0, len(rom), 16):
+        data = rom[addr:addr + 16]
+        if not any(data):
+            continue
+        rec = bytes([len(data) + 3, addr >> 8, addr & 0xff]) + data
+        out.write('S1%s%02X\n' % (rec.hex().upper(), ~sum(rec) & 0xff))
+    out.write('S9030000FC\n')
+
+
+def main(argv):
+    if len(argv) >= 3 and argv[1] == 'diff':
+        rom = diff_rom(int(argv[2]), len(argv) > 3 and argv[3] == 'idle')
+    elif len(argv) == 2 and argv[1] == 'loop':
+        rom = loop_rom()
+    else:
+        sys.stderr.write(__doc__)
+        return 1
+    srec(rom, sys.stdout)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
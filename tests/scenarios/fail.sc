@@ -0,0 +1,4 @@
+# Run with tests/roms/loop.srec: reaching 010e fails the run (exit 2).
+fail pc 010e
+fail watchdog
+timeout 1s
@@ -0,0 +1,6 @@
+# Run with tests/roms/loop.srec: the ROM reaches the end of its loop
+# at 010e long before the timeout, so the scenario passes (exit 0).
+0 button run press
+200us button run release
+pass pc 010e
+timeout 1s
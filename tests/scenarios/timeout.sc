@@ -0,0 +1,6 @@
+# Run with tests/roms/loop.srec: the ROM never gets to 0200, so the
+# run ends at the timeout (exit 3).
+0 gui PS1
+5ms sensor 1 ramp 0 1023 20ms
+pass pc 0200
+timeout 50ms
@@ -1,9 +1,10 @@
 """BrickEmu server tests"""
 
 from unittest import mock
-from emu_server import (EmuServer, find_free_port, SENSOR_2, MOTOR_A_REV, MOTOR_A_FWD, SENSOR_2_ACTIVE, MOTOR_A, DIR_FWD,
+from emu_server import (EmuServer, BrickObserver, OBSERVE_FORMAT, OBSERVE_MAGIC, OBSERVE_VERSION, find_free_port, SENSOR_2, MOTOR_A_REV, MOTOR_A_FWD, SENSOR_2_ACTIVE, MOTOR_A, DIR_FWD,
                         DIR_REV)
 import socket
+import struct
 import pytest
 import time
 
@@ -43,6 +44,103 @@ class TestBrickEmuServer:
         emu_obj._set_firmware()
         emu_obj.conn.send.assert_has_calls(expected_calls)
 
+    @mock.patch("emu_server.socket.socket.send", mock.Mock())
+    def test_boot_firmware_cached(self):
+        emu_obj.conn = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        emu_obj.set_firmware_path("/some/path")
+        emu_obj.set_boot_cache(True)
+
+        with mock.patch.object(emu_obj, "_socket_recv", side_effect=["L0,00", "CK1"]):
+            emu_obj._boot_firmware()
+        emu_obj.conn.send.assert_called_once_with(b"CK/some/path\n")
+        emu_obj.set_boot_cache(False)
+
+    @mock.patch("emu_server.socket.socket.send", mock.Mock())
+    @mock.patch("emu_server.time.sleep", mock.Mock())
+    def test_boot_firmware_uncached(self):
+        expected_calls = (mock.call(b"CK/some/path\n"),
+                          mock.call(b"PR\r\n"),
+                          mock.call(b"BO1\r\n"),
+                          mock.call(b"BO0\r\n"),
+                          mock.call(b"F/some/path\n\n"),
+                          mock.call(b"OO\r\n"),
+                          mock.call(b"CB\n"))
+        emu_obj.conn = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        emu_obj.set_firmware_path("/some/path")
+        emu_obj.set_boot_cache(True)
+
+        with mock.patch.object(emu_obj, "_socket_recv", side_effect=["CK0", "L0,00", "OO1"]):
+            emu_obj._boot_firmware()
+        emu_obj.conn.send.assert_has_calls(expected_calls)
+        emu_obj.set_boot_cache(False)
+
+    @mock.patch("emu_server.socket.socket.send", mock.Mock())
+    def test_set_speed(self):
+        emu_obj.conn = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+
+        emu_obj.set_speed("max")
+        emu_obj.conn.send.assert_called_with(b"PSmax\r\n")
+        emu_obj.set_speed("1/4")
+        emu_obj.conn.send.assert_called_with(b"PS1/4\r\n")
+
+    @mock.patch("emu_server.socket.socket.send", mock.Mock())
+    def test_checkpoint(self):
+        emu_obj.conn = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+
+        emu_obj.checkpoint("booted")
+        emu_obj.conn.send.assert_called_with(b"PCbooted\r\n")
+
+    def test_checkpoint_port(self):
+        emu_obj.flush()
+        emu_obj.out_queue.put("L0,00")
+        emu_obj.out_queue.put("PC4711")
+
+        assert emu_obj.checkpoint_port() == 4711
+        assert emu_obj.checkpoint_port(timeout=0.1) is None
+
+
+def observe_data(seq, cycles):
+    return struct.pack(OBSERVE_FORMAT, OBSERVE_MAGIC, OBSERVE_VERSION, 96, seq, cycles, 0, 0, 0, 1000, 0x1234,
+                       b"\x02" + b"\0" * 11, 1, 0xfe, 5, b"\x02\x00\x03", 256, 0, 0, *range(8))
+
+
+class TestBrickObserver:
+
+    def test_snapshot(self, tmp_path):
+        path = tmp_path / "observe"
+        path.write_bytes(observe_data(4, 123456))
+        observer = BrickObserver(str(path))
+        state = observer.snapshot()
+        observer.close()
+
+        assert state["cycles"] == 123456
+        assert state["pc"] == 0x1234
+        assert state["target_speed"] == 1000
+        assert state["lcd_state"][1] is True
+        assert state["lcd_state"][0] is False
+        assert state["buttons"] == 0xfe
+        assert state["motor_dir"] == [2, 0, 3]
+        assert state["motor_on"] == [256, 0, 0]
+        assert state["sensors"] == list(range(8))
+
+    def test_snapshot_retries_while_writing(self, tmp_path):
+        path = tmp_path / "observe"
+        path.write_bytes(observe_data(0, 0))
+        observer = BrickObserver(str(path))
+        observer.map = mock.MagicMock()
+        # odd seq, then seq changed while copying, then consistent
+        observer.map.__getitem__.side_effect = [observe_data(5, 1), observe_data(6, 2), observe_data(8, 2)[12:16],
+                                                observe_data(8, 3), observe_data(8, 3)[12:16]]
+
+        assert observer.snapshot()["cycles"] == 3
+
+    def test_not_an_observe_file(self, tmp_path):
+        path = tmp_path / "observe"
+        path.write_bytes(b"\0" * 96)
+
+        with pytest.raises(ValueError):
+            BrickObserver(str(path))
+
 
 def emu_available():
     return True if pytest.emu else False
@@ -0,0 +1,113 @@
+import os
+import re
+import struct
+import subprocess
+import pytest
+
+TESTS = os.path.dirname(os.path.abspath(__file__))
+EMU = os.path.join(TESTS, "..", "emu")
+ROM = os.path.join(TESTS, "roms", "loop.srec")
+
+
+def run_scenario(path):
+    return subprocess.run([EMU, "-rom", ROM, "-scenario", path], stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True, timeout=30)
+
+
+def corrupt_record(data):
+    """Return the offset of a data byte in the first record that has data."""
+    pos, = struct.unpack(">I", data[24:28])
+    while True:
+        kind, length = struct.unpack(">B3xI", data[pos:pos + 8])
+        if length:
+            return pos + 12
+        assert kind != 0
+        pos += 12 + length
+
+
+def result_line(proc):
+    return [line for line in proc.stdout.splitlines() if line.startswith("scenario: ")]
+
+
+@pytest.mark.skipif(not os.access(EMU, os.X_OK), reason="EMU not built")
+class TestScenario:
+
+    @pytest.mark.parametrize("name,status,result", [
+        ("pass", 0, "result=pass cycles=8011 ms=0.501 condition=pass pc 010e"),
+        ("fail", 2, "result=fail cycles=8011 ms=0.501 condition=fail pc 010e"),
+        ("timeout", 3, "result=timeout cycles=800003 ms=50.000 condition=timeout 50ms"),
+    ])
+    def test_example(self, name, status, result):
+        proc = run_scenario(os.path.join(TESTS, "scenarios", name + ".sc"))
+        assert proc.returncode == status
+        assert result_line(proc) == ["scenario: " + result]
+
+    def test_same_result_every_time(self):
+        path = os.path.join(TESTS, "scenarios", "timeout.sc")
+        assert result_line(run_scenario(path)) == result_line(run_scenario(path))
+
+    @pytest.mark.parametrize("line", [
+        "5ms dance",
+        "soon button run press",
+        "1ms button run hold",
+        "1ms sensor 4 100",
+        "1ms sensor 1 2000",
+        "1ms sensor 1 ramp 0 1023",
+        "1ms program 9 demo.lx",
+        "1ms ir 5",
+        "1ms gui OL",
+        "1ms gui C",
+        "1ms gui PC",
+        "1ms gui XY",
+        "pass pc 10f",
+        "pass lcd 00",
+        "fail printf",
+        "timeout soon",
+    ])
+    def test_invalid_line(self, tmp_path, line):
+        path = tmp_path / "invalid.sc"
+        path.write_text("timeout 10ms\n" + line + "\n")
+        proc = run_scenario(str(path))
+        assert proc.returncode == 1
+        assert "invalid line: " + line in proc.stderr
+        assert result_line(proc) == []
+
+    @pytest.mark.parametrize("ratio,target", [("2", 2.0), ("2/3", 0.667), ("1/3", 0.333)])
+    def test_set_speed(self, tmp_path, ratio, target):
+        path = tmp_path / "speed.sc"
+        path.write_text("0 gui PS" + ratio + "\ntimeout 300ms\n")
+        proc = run_scenario(str(path))
+        assert proc.returncode == 3
+        match = re.search(r"speed ([0-9.]+) \(target ([0-9.]+)\)", proc.stdout)
+        assert match
+        assert float(match.group(2)) == target
+        # a loaded host may fall behind, but the brick must never run ahead
+        assert target * 0.6 <= float(match.group(1)) <= target * 1.05
+
+    @pytest.mark.parametrize("part", ["memory", "record", "header"])
+    def test_load_corrupt(self, tmp_path, part):
+        path = tmp_path / "state.sav"
+        save = tmp_path / "save.sc"
+        save.write_text("1ms gui CR%s\ntimeout 2ms\n" % path)
+        assert run_scenario(str(save)).returncode == 3
+        data = bytearray(path.read_bytes())
+        offset = {"memory": struct.unpack(">I", data[16:20])[0] + 0x8000,
+                  "record": corrupt_record(data),
+                  "header": 16}[part]
+        data[offset] ^= 0x01
+        path.write_bytes(bytes(data))
+
+        load = tmp_path / "load.sc"
+        load.write_text("1ms gui CL%s\ntimeout 5ms\n" % path)
+        proc = run_scenario(str(load))
+        assert "%s is corrupt!" % path in proc.stdout
+        assert proc.returncode == 3
+        assert result_line(proc) == ["scenario: result=timeout cycles=80003 ms=5.000 condition=timeout 5ms"]
+
+    def test_load_intact(self, tmp_path):
+        path = tmp_path / "state.sav"
+        script = tmp_path / "load.sc"
+        script.write_text("1ms gui CR%s\n2ms gui CL%s\ntimeout 5ms\n" % (path, path))
+        proc = run_scenario(str(script))
+        assert "corrupt" not in proc.stdout
+        assert proc.returncode == 3
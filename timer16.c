@@ -52,13 +52,17 @@
 #define TOCR_OLVLA 0x02
 #define TOCR_OLVLB 0x01
 
-static uint16 frc, ocra, ocrb;
-static uint8  tcsr, tier, tcr, tocr;
-static uint8  temp;
-static cycle_count_t my_last_cycles;
+static BRICK_LOCAL uint16 frc, ocra, ocrb;
+static BRICK_LOCAL uint8  tcsr, tier, tcr, tocr;
+static BRICK_LOCAL uint8  temp;
+static BRICK_LOCAL cycle_count_t my_last_cycles;
 
 static uint8 freq[4] = { 1, 3, 5, /*XXXX check value*/ 1 };
 
+static void t16_check_next_cycle(void);
+static void t16_update_time(void);
+static BRICK_LOCAL periph_event t16_event = { t16_update_time, 0, -1 };
+
 /* Hook to add ftoa/b listeners */
 #define SET_FTOA(v) do {} while(0)
 #define SET_FTOB(v) do {} while(0)
@@ -72,7 +76,7 @@ typedef struct {
 
 static int t16_save(void *buffer, int maxlen) {
     t16_save_type *data = buffer;
-    data->my_last_cycles = htonl(my_last_cycles);
+    data->my_last_cycles = hton64(my_last_cycles);
     data->frc = htons(frc);
     data->ocra = htons(ocra);
     data->ocrb = htons(ocrb);
@@ -85,7 +89,7 @@ static int t16_save(void *buffer, int maxlen) {
 
 static void t16_load(void *buffer, int len) {
     t16_save_type *data = buffer;
-    my_last_cycles = ntohl(data->my_last_cycles);
+    my_last_cycles = ntoh64(data->my_last_cycles);
     frc = ntohs(data->frc);
     ocra = ntohs(data->ocra);
     ocrb = ntohs(data->ocrb);
@@ -93,6 +97,7 @@ static void t16_load(void *buffer, int len) {
     tier = data->tier;
     tcr  = data->tcr;
     tocr = data->tocr;
+    t16_check_next_cycle();
 }
 
 static void t16_reset() {
@@ -106,17 +111,17 @@ static void t16_reset() {
     SET_FTOA(0);
     SET_FTOB(0);
     my_last_cycles = cycles;
+    t16_check_next_cycle();
 }
 
 static void t16_check_next_cycle() {
     int32 next_cycle;
     int next = 0x10000 - frc;
+    int i;
+    int irqs = tier & tcsr & 0xfe;
 
-    if ((tier & tcsr & 0xfe)) {
-        /* interrupt is pending */
-        next_timer_cycle = cycles;
-        return;
-    }
+    for (i = 0; i < 7; i++)
+        irq_set(ICIA_HANDLER + i, irqs & (1 << (7-i)));
 
 #ifdef DEBUG_TIMER
     printf("%" CYCLE_COUNT_F ": t16_check_next_cycle: %02x %02x %04x %04x", cycles, tier, tcsr, frc, ocra);
@@ -133,11 +138,9 @@ static void t16_check_next_cycle() {
     }
     next_cycle = (int32)((next << freq[tcr & 3]) + my_last_cycles - cycles);
 #ifdef DEBUG_TIMER
-    printf(" --> %d  (%d)\n", next_cycle, (int32)(next_timer_cycle - cycles));
+    printf(" --> %d\n", next_cycle);
 #endif
-    if (next_cycle < (int32) (next_timer_cycle - cycles)) {
-        next_timer_cycle = add_to_cycle('N', cycles, next_cycle);
-    }
+    periph_schedule(&t16_event, add_to_cycle('N', cycles, next_cycle));
 }
 
 static void t16_update_time() {
@@ -181,17 +184,6 @@ static void t16_update_time() {
     t16_check_next_cycle();
 }
 
-static int t16_check_irq() {
-    int i;
-    int irqs = tier & tcsr & 0xfe;
-    for (i = 0; i < 7; i++) {
-        if (irqs & (1 << (7-i)))
-            return 12 + i;
-    }
-    return 255;
-}
-
-
 static void set_TIER(uint8 val) {
 #ifdef VERBOSE_TIMER
     printf("set_TIER(%02x)\n", val);
@@ -213,6 +205,7 @@ static void set_TCSR(uint8 val) {
 }
 
 static uint8 get_TCSR(void) {
+    t16_update_time();
     return tcsr;
 }
 
@@ -224,10 +217,13 @@ static void set_FRCL(uint8 val) {
 #ifdef VERBOSE_TIMER
     printf("set_FRC(%04x)\n", temp << 8 | val);
 #endif
+    t16_update_time();
     frc = temp << 8 | val;
+    t16_check_next_cycle();
 }
 
 static uint8 get_FRCH(void) {
+    t16_update_time();
     temp = frc & 0xff;
     return frc >> 8;
 }
@@ -244,10 +240,12 @@ static void set_OCRL(uint8 val) {
 #ifdef VERBOSE_TIMER
     printf("set_OCR(%04x)\n", temp << 8 | val);
 #endif
+    t16_update_time();
     if (tocr & TOCR_OCRS)
         ocrb = temp << 8 | val;
     else
         ocra = temp << 8 | val;
+    t16_check_next_cycle();
 }
 
 static uint8 get_OCRH(void) {
@@ -270,6 +268,7 @@ static void set_TCR(uint8 val) {
     printf("set_TCR(%02x)\n", val);
 #endif
     tcr = val;
+    t16_check_next_cycle();
 }
 
 static uint8 get_TCR(void) {
@@ -300,7 +299,6 @@ peripheral_ops timer16 = {
     id: 'T',
     reset: t16_reset,
     update_time: t16_update_time,
-    check_irq: t16_check_irq,
     save_data: t16_save,
     load_data: t16_load
 };
@@ -52,12 +52,12 @@
 #define TOCR_OLVLA 0x02
 #define TOCR_OLVLB 0x01
 
-static uint8  tcnt[2], tcr[2], tcsr[2], tcora[2], tcorb[2];
-static uint8  out[2] = {0,0};
-static uint8  stcr;
+static BRICK_LOCAL uint8  tcnt[2], tcr[2], tcsr[2], tcora[2], tcorb[2];
+static BRICK_LOCAL uint8  out[2] = {0,0};
+static BRICK_LOCAL uint8  stcr;
 
-static cycle_count_t last_cycles[2];
-static cycle_count_t my_next_cycle[2];
+static BRICK_LOCAL cycle_count_t last_cycles[2];
+static BRICK_LOCAL cycle_count_t my_next_cycle[2];
 
 static uint8 freq[16] = { 31, 3, 6, 10, 31, 31, 31, 31, 
                           31, 1, 5,  8, 31, 31, 31, 31 };
@@ -72,13 +72,17 @@ typedef struct {
 
 extern void sound_update(int bit, uint32 new_incr);
 
+static void t8_check_next_cycle(void);
+static void t8_update_time(void);
+static BRICK_LOCAL periph_event t8_event = { t8_update_time, 0, -1 };
+
 static int t8_save(void *buffer, int maxlen) {
     int i;
     t8_save_type *data = buffer;
 
     for (i = 0; i < 2; i++) {
-        data->last_cycles[i] = htonl(last_cycles[i]);
-        data->my_next_cycle[i] = htonl(my_next_cycle[i]);
+        data->last_cycles[i] = hton64(last_cycles[i]);
+        data->my_next_cycle[i] = hton64(my_next_cycle[i]);
         data->tcnt[i]  = tcnt[i];
         data->tcr[i]   = tcr[i];
         data->tcsr[i]  = tcsr[i];
@@ -94,8 +98,8 @@ static void t8_load(void *buffer, int len) {
     int i;
     t8_save_type *data = buffer;
     for (i = 0; i < 2; i++) {
-        last_cycles[i] = htonl(data->last_cycles[i]);
-        my_next_cycle[i] = htonl(data->my_next_cycle[i]);
+        last_cycles[i] = ntoh64(data->last_cycles[i]);
+        my_next_cycle[i] = ntoh64(data->my_next_cycle[i]);
         tcnt[i]  = data->tcnt[i];
         tcr[i]   = data->tcr[i];
         tcsr[i]  = data->tcsr[i];
@@ -104,6 +108,7 @@ static void t8_load(void *buffer, int len) {
         out[i]   = data->out[i];
     }
     stcr = data->stcr;
+    t8_check_next_cycle();
 }
 
 static void t8_reset() {
@@ -113,16 +118,17 @@ static void t8_reset() {
     tcora[0] = tcora[1] = tcorb[0] = tcorb[1] = 0xff;
     stcr = 0xf8;
     last_cycles[0] = last_cycles[1] = cycles;
+    t8_check_next_cycle();
 }
 
 static void t8_check_next_cycle() {
     int shift, nr;
+    int running = 0;
+    cycle_count_t next_cycle = 0;
+    int irqs = (tcsr[0] & tcr[0] & 0xe0) | ((tcsr[1] & tcr[1] & 0xe0) >> 3);
 
-    if (((tcsr[0] & tcr[0]) | (tcsr[1] & tcr[1])) & 0xe0) {
-        /* interrupt is pending */
-        next_timer_cycle = cycles;
-        return;
-    }
+    for (nr = 0; nr < 6; nr++)
+        irq_set(CMI0A_HANDLER + nr, irqs & (1 << (7-nr)));
     
     for (nr = 0; nr < 1; nr++) {
         int nextev;
@@ -151,10 +157,16 @@ static void t8_check_next_cycle() {
              tcnt[0], tcnt[1], tcora[0], tcora[1]);
         */
 
-        if (next < (int32) (next_timer_cycle - last_cycles[nr])) {
-            next_timer_cycle = last_cycles[nr] + next;
+        if (!running || my_next_cycle[nr] < next_cycle) {
+            next_cycle = my_next_cycle[nr];
+            running = 1;
         }
     }
+
+    if (running)
+        periph_schedule(&t8_event, next_cycle);
+    else
+        periph_cancel(&t8_event);
 }
 
 static void t8_incr_tcnt(int nr, unsigned int incr, int shift) {
@@ -287,17 +299,6 @@ static void t8_set_last_cycles(int nr) {
 }
 
 
-static int t8_check_irq() {
-    int i;
-    int irqs = (tcsr[0] & tcr[0] & 0xe0) | ((tcsr[1] & tcr[1] & 0xe0) >> 3);
-    for (i = 0; i < 6; i++) {
-        if (irqs & (1 << (7-i)))
-            return 19 + i;
-    }
-    return 255;
-}
-
-
 static void set_TCR0(uint8 val) {
     my_next_cycle[0] = cycles;
     t8_update_time();
@@ -439,7 +440,6 @@ peripheral_ops timer8 = {
     id: '8',
     reset: t8_reset,
     update_time: t8_update_time,
-    check_irq: t8_check_irq,
     save_data: t8_save,
     load_data: t8_load
 };
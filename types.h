@@ -43,6 +43,16 @@ typedef uint64_t uint64;
  */
 typedef uint64_t cycle_count_t;
 
+/*
+ * Storage class of the state of the emulated brick.  With MULTI_BRICK
+ * every thread runs its own brick, see brick.c.
+ */
+#ifdef MULTI_BRICK
+#define BRICK_LOCAL __thread
+#else
+#define BRICK_LOCAL
+#endif
+
 /*
  * Cycle count printf format
  * - https://stackoverflow.com/a/30221946
@@ -23,24 +23,24 @@
 
 #define PIN_WAIT_STATES 0  /*XXX check it out */
 
-uint16 wcsr;
+BRICK_LOCAL uint16 wcsr;
 
 static void set_WCSR(uint8 val) {
     wcsr = val;
     switch (val & 0x0c) {
     case 0:
-        wait_states = val & 3;
+        mem_set_wait_states(val & 3);
         break;
     case 4:
-        wait_states = 0;
+        mem_set_wait_states(0);
         break;
     case 8:
         /* XXX Can't handle these correctly yet. */
-        wait_states = PIN_WAIT_STATES;
+        mem_set_wait_states(PIN_WAIT_STATES);
         break;
     case 12:
         /* XXX Can't handle these correctly yet. */
-        wait_states = (val & 3);
+        mem_set_wait_states(val & 3);
         break;
     }
 #ifdef VERBOSE_WAITSTATE
@@ -20,6 +20,7 @@
 #include "h8300.h"
 #include "memory.h"
 #include "peripherals.h"
+#include "scenario.h"
 
 #include <netinet/in.h> /* for htonx/ntohx */
 
@@ -34,11 +35,16 @@
 #define TCSR_CKS1  0x02
 #define TCSR_CKS0  0x01
 
-static uint8  tcsr, readtcsr, tcnt, pw;
-static cycle_count_t last_cycles;
+static BRICK_LOCAL uint8  tcsr, readtcsr, tcnt, pw;
+static BRICK_LOCAL cycle_count_t last_cycles;
 
 static uint8 freq[8] = { 1, 5, 6, 7, 8, 9, 11, 12 };
 
+static void wdog_check_next_cycle(void);
+static void wdog_update_time(void);
+/* the overflow may raise a NMI, so it goes to the NMI queue */
+static BRICK_LOCAL periph_event wdog_event = { wdog_update_time, 1, -1 };
+
 /* Hook to add ftoa/b listeners */
 #define SET_FTOA(v) do {} while(0)
 #define SET_FTOB(v) do {} while(0)
@@ -50,7 +56,7 @@ typedef struct {
 
 static int wdog_save(void *buffer, int maxlen) {
     wdog_save_type *data = buffer;
-    data->last_cycles = htonl(last_cycles);
+    data->last_cycles = hton64(last_cycles);
     data->tcsr = tcsr;
     data->readtcsr = readtcsr;
     data->tcnt = tcnt;
@@ -60,30 +66,30 @@ static int wdog_save(void *buffer, int maxlen) {
 
 static void wdog_load(void *buffer, int len) {
     wdog_save_type *data = buffer;
-    last_cycles = htonl(data->last_cycles);
+    last_cycles = ntoh64(data->last_cycles);
     tcsr = data->tcsr;
     readtcsr = data->readtcsr;
     tcnt = data->tcnt;
     pw   = data->pw;
+    wdog_check_next_cycle();
 }
 
 static void wdog_reset() {
     tcnt = pw = 0;
     readtcsr = tcsr = 0x10;
     last_cycles = cycles;
+    wdog_check_next_cycle();
 }
 
 static void wdog_check_next_cycle() {
+    irq_set(0, (tcsr & (TCSR_OVF | TCSR_RST)) == (TCSR_OVF | TCSR_RST));
+    irq_set(NMI_HANDLER, (tcsr & (TCSR_OVF | TCSR_RST)) == TCSR_OVF);
     if (tcsr & TCSR_TME) {
         cycle_count_t next_cycle = last_cycles + ((0x100 - tcnt) << freq[tcsr & 7]);
 
-        if (next_cycle < next_nmi_cycle) {
-            next_nmi_cycle = next_cycle;
-        }
-        if (next_cycle < next_timer_cycle) {
-            next_timer_cycle = next_cycle;
-        }
-    }
+        periph_schedule(&wdog_event, next_cycle);
+    } else
+        periph_cancel(&wdog_event);
 }
 
 static void wdog_update_time() {
@@ -118,17 +124,14 @@ static void wdog_update_time() {
     }
 }
 
-static int wdog_check_irq() {
-    if (tcsr & TCSR_OVF) {
-        tcsr &= ~TCSR_OVF;
-        if (tcsr & TCSR_RST) {
-            next_nmi_cycle = last_cycles;
-            return 0;
-        } else {
-            return 3;
-        }
+static void wdog_ack_irq(int vector) {
+    tcsr &= ~TCSR_OVF;
+    wdog_check_next_cycle();
+    if (vector == 0) {
+        /* the reset is finished at last_cycles */
+        next_nmi_cycle = last_cycles;
+        scenario_watchdog();
     }
-    return 255;
 }
 
 static void set_pw(uint8 val) {
@@ -159,6 +162,7 @@ static uint8 get_TCSR(void) {
     return readtcsr = tcsr;
 }
 static uint8 get_TCNT(void) {
+    wdog_update_time();
     return tcnt;
 }
 
@@ -167,7 +171,6 @@ static peripheral_ops watchdog = {
     id: 'W',
     reset: wdog_reset,
     update_time: wdog_update_time,
-    check_irq: wdog_check_irq,
     save_data: wdog_save,
     load_data: wdog_load
 };
@@ -178,6 +181,8 @@ void wdog_init() {
     port[0xA9-0x88].set = set_val;
     port[0xA9-0x88].get = get_TCNT;
 
+    irq_set_ack(0, wdog_ack_irq);
+    irq_set_ack(NMI_HANDLER, wdog_ack_irq);
     register_peripheral(watchdog);
     wdog_reset();
 }